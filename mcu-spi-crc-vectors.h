@@ -0,0 +1,47 @@
+/*
+ * Test vectors of the frame CRC32 (crc32_le, ~crc(0xFFFFFFFF, data)), checked
+ * by the driver against every backend at probe and by the host tools. A
+ * vector without data is len bytes of mcuspi_crc_vector_pattern, the pattern
+ * covers every alignment step of the slice-by-8 and armv8 loops and a full
+ * size frame.
+ */
+#ifndef _MCU_SPI_CRC_VECTORS_H
+#define _MCU_SPI_CRC_VECTORS_H
+
+#include "mcu-spi-proto.h"
+
+struct mcuspi_crc_vector {
+	const char *data;
+	uint32_t len;
+	uint32_t crc;
+};
+
+static inline void mcuspi_crc_vector_pattern(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = i * 7 + (i >> 8);
+	}
+}
+
+static const struct mcuspi_crc_vector mcuspi_crc_vectors[] = {
+	{ "", 0, 0x00000000 },
+	{ "a", 1, 0xE8B7BE43 },
+	{ "abc", 3, 0x352441C2 },
+	{ "123456789", 9, 0xCBF43926 },
+	{ "message digest", 14, 0x20159D7F },
+	{ "abcdefghijklmnopqrstuvwxyz", 26, 0x4C2750BD },
+	{ "The quick brown fox jumps over the lazy dog", 43, 0x414FA339 },
+	{ NULL, 1, 0xD202EF8D },
+	{ NULL, 7, 0x28B012A9 },
+	{ NULL, 8, 0x2CFE44E9 },
+	{ NULL, 9, 0x23FAF38B },
+	{ NULL, 63, 0xFD395FF8 },
+	{ NULL, 64, 0xD324A7D4 },
+	{ NULL, MCUSPI_HEAD_LENGTH, 0xFB1A6AA7 },
+	{ NULL, 72, 0x87F7D02D },
+	{ NULL, MCUSPI_MAX_FRAME_LENGTH - MCUSPI_VERIFY_LENGTH, 0x3594A0EE },
+};
+
+#endif /* _MCU_SPI_CRC_VECTORS_H */
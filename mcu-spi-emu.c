@@ -0,0 +1,555 @@
+/*
+ * Software stand-in for the MCU end of mcu-spi, to run the driver without
+ * hardware. It registers a virtual spi_master with one "mcu_spi" device,
+ * whose interrupt is a software one the emulator fires. Load mcu-spi.ko
+ * first, the device then shows up as /dev/mcuspiN.
+ *
+ * Frames to the driver are generated at rate_hz, burst at a time, with
+ * payloads of mcu-spi-emu.h for tools/mcuspi-bench. The interrupt is fired
+ * for them like the "int" edge of an MCU. Frames from the driver are
+ * checked, counted and acked. With link=1 the link control block is
+ * filled: MORE while frames are waiting, NAKs of frames from the driver
+ * that did not come and frames sent again when the driver NAKs them.
+ * drop_every and nak_every inject losses in each direction. Counters are
+ * in debugfs, mcu-spi-emu/.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/platform_device.h>
+#include <linux/spi/spi.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irq_work.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/property.h>
+#include <linux/debugfs.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include "mcu-spi.h"
+#include "mcu-spi-proto.h"
+#include "mcu-spi-emu.h"
+
+#define EMU_QUEUE_LEN 256 /* frames generated and not sent yet, power of 2 */
+#define EMU_HISTORY 16 /* frames sent kept for a NAK, as MCUSPI_TX_HISTORY */
+#define EMU_SERIALS 256
+#define EMU_RENAK_TICKS 16 /* ticks between NAKs of the same missing frame */
+
+static unsigned int rate_hz = 1000;
+module_param(rate_hz, uint, 0444);
+MODULE_PARM_DESC(rate_hz, "timer ticks per second, each generates burst frames");
+
+static unsigned int burst = 1;
+module_param(burst, uint, 0444);
+MODULE_PARM_DESC(burst, "frames generated per tick");
+
+static unsigned int count;
+module_param(count, uint, 0444);
+MODULE_PARM_DESC(count, "frames generated in all, 0 generates until unloaded");
+
+static unsigned int payload_len = 64;
+module_param(payload_len, uint, 0444);
+MODULE_PARM_DESC(payload_len, "payload bytes of a generated frame, 12 or more carry a time stamp");
+
+static bool link;
+module_param(link, bool, 0444);
+MODULE_PARM_DESC(link, "dozh,link-control: ack, NAK and MORE in the link control block");
+
+static bool varlen;
+module_param(varlen, bool, 0444);
+MODULE_PARM_DESC(varlen, "dozh,variable-length: frames are clocked as a head and a body");
+
+static unsigned int speed_hz = 10000000;
+module_param(speed_hz, uint, 0444);
+MODULE_PARM_DESC(speed_hz, "max_speed_hz of the device, transfers take no bus time");
+
+static unsigned int drop_every;
+module_param(drop_every, uint, 0644);
+MODULE_PARM_DESC(drop_every, "send every Nth new frame to the driver with a bad CRC, 0 never");
+
+static unsigned int nak_every;
+module_param(nak_every, uint, 0644);
+MODULE_PARM_DESC(nak_every, "NAK every Nth new data frame from the driver as if it was lost, 0 never");
+
+struct mcuspi_emu_stats {
+	u64 generated;		/* frames generated */
+	u64 overruns;		/* frames not generated, the queue was full */
+	u64 sent;		/* new frames clocked out */
+	u64 control;		/* control frames clocked out to carry a NAK */
+	u64 dropped;		/* new frames clocked out with a bad CRC */
+	u64 resent;		/* frames sent again on a NAK of the driver */
+	u64 nak_missed;		/* NAKs of frames no longer in the history */
+	u64 host_frames;	/* data frames from the driver taken */
+	u64 host_bytes;
+	u64 host_control;	/* control frames from the driver */
+	u64 host_bad;		/* frames from the driver with bad length or CRC */
+	u64 host_corrupt;	/* frames from the driver whose payload does not check */
+	u64 host_dups;		/* frames from the driver received twice */
+	u64 host_naked;		/* frames from the driver NAK'ed by nak_every */
+	u64 host_lost;		/* frames from the driver skipped in the serials */
+	u64 host_recovered;	/* frames from the driver taken after a NAK */
+};
+
+struct mcuspi_emu {
+	struct platform_device * pdev;
+	struct spi_master * master;
+	struct spi_device * spi;
+	int irq;
+	struct hrtimer timer;
+	ktime_t period;
+	struct irq_work kick;
+	spinlock_t lock; /* everything below, timer and message pump */
+
+	/* frames to the driver */
+	mcu_message * queue;
+	uint32_t head, tail;
+	uint32_t seq; /* of the next frame generated */
+	uint8_t serial; /* of the next new frame */
+	uint8_t (*history)[MCUSPI_MAX_FRAME_LENGTH]; /* by serial % EMU_HISTORY */
+	DECLARE_BITMAP(resend, EMU_SERIALS); /* NAK'ed by the driver */
+
+	/* frames from the driver */
+	int host_last; /* serial of the newest one, -1 before the first */
+	DECLARE_BITMAP(host_missing, EMU_SERIALS); /* NAK'ed, not taken yet */
+	DECLARE_BITMAP(host_nak, EMU_SERIALS); /* to NAK in the next frames */
+	u64 host_new; /* new data frames, for nak_every */
+	unsigned int ticks;
+
+	/* the frame on the bus, varlen mode clocks it as a head and a body */
+	uint8_t * out;
+	size_t out_len;
+	uint8_t * in;
+	bool in_body;
+	bool more_sent; /* the last frame clocked out had MORE, the driver reads on */
+
+	struct mcuspi_emu_stats stats;
+	struct dentry * debugfs;
+};
+
+static struct mcuspi_emu * mcuspi_emu;
+
+/* one more frame for the driver, frames queued, sent again or a NAK owed */
+static bool emu_pending(struct mcuspi_emu *emu)
+{
+	return emu->head != emu->tail || !bitmap_empty(emu->resend, EMU_SERIALS) ||
+	       (link && !bitmap_empty(emu->host_nak, EMU_SERIALS));
+}
+
+/*
+ * Link control block and CRC of the frame in emu->out, own_flags are its
+ * own. A frame about to be dropped carries no NAK, it would be lost with it.
+ */
+static void emu_seal(struct mcuspi_emu *emu, uint8_t own_flags, bool nak)
+{
+	struct mcuspi_link_ctrl * link_ctrl = (void *)(emu->out + MCUSPI_DESC_OFFSET +
+							MCUSPI_LINK_CTRL_OFFSET);
+	uint16_t len = mcuspi_proto_get_le16(emu->out + MCUSPI_COUNT_OFFSET);
+	unsigned long serial;
+
+	if (link) {
+		memset(link_ctrl, 0, sizeof(*link_ctrl));
+		link_ctrl->flags = own_flags;
+		if (emu->host_last >= 0) {
+			link_ctrl->flags |= MCUSPI_LINK_ACK;
+			link_ctrl->ack = emu->host_last;
+		}
+		serial = find_first_bit(emu->host_nak, EMU_SERIALS);
+		if (nak && serial < EMU_SERIALS) {
+			__clear_bit(serial, emu->host_nak);
+			link_ctrl->flags |= MCUSPI_LINK_NAK;
+			link_ctrl->nak = serial;
+		}
+		if (emu_pending(emu)) {
+			link_ctrl->flags |= MCUSPI_LINK_MORE;
+		}
+	}
+	mcuspi_proto_put_crc(emu->out, len, mcuspi_proto_frame_crc(emu->out, len));
+	emu->out_len = MCUSPI_FRAME_LENGTH(len);
+	emu->more_sent = link && (link_ctrl->flags & MCUSPI_LINK_MORE);
+}
+
+/* put the next frame for the driver in emu->out, out_len is 0 if there is none */
+static void emu_next_frame(struct mcuspi_emu *emu)
+{
+	const struct mcuspi_link_ctrl * link_ctrl;
+	mcu_message * msg;
+	unsigned long serial;
+	uint8_t * old;
+	bool drop = false;
+
+	emu->out_len = 0;
+	emu->more_sent = false;
+	/* frames NAK'ed by the driver first, they are the oldest */
+	while ((serial = find_first_bit(emu->resend, EMU_SERIALS)) < EMU_SERIALS) {
+		__clear_bit(serial, emu->resend);
+		old = emu->history[serial % EMU_HISTORY];
+		if (old[0] != MCUSPI_PREAMBLE || old[MCUSPI_SERIAL_OFFSET] != serial) {
+			emu->stats.nak_missed++;
+			continue;
+		}
+		memcpy(emu->out, old, MCUSPI_FRAME_LENGTH(mcuspi_proto_get_le16(old + MCUSPI_COUNT_OFFSET)));
+		link_ctrl = (const void *)(old + MCUSPI_DESC_OFFSET + MCUSPI_LINK_CTRL_OFFSET);
+		emu_seal(emu, link_ctrl->flags & MCUSPI_LINK_CONTROL, true);
+		emu->stats.resent++;
+		return;
+	}
+	if (emu->head != emu->tail) {
+		msg = &emu->queue[emu->head++ & (EMU_QUEUE_LEN - 1)];
+		mcuspi_proto_put_head(emu->out, emu->serial, msg->payload_desc, msg->payload_length);
+		memcpy(emu->out + MCUSPI_PAYLOAD_OFFSET, msg->payload, msg->payload_length);
+		emu->stats.sent++;
+		drop = drop_every && emu->stats.sent % drop_every == 0;
+		emu_seal(emu, 0, !drop);
+	} else if (link && !bitmap_empty(emu->host_nak, EMU_SERIALS)) {
+		mcuspi_proto_put_head(emu->out, emu->serial, NULL, 0);
+		emu_seal(emu, MCUSPI_LINK_CONTROL, true);
+		emu->stats.control++;
+	} else {
+		return;
+	}
+	memcpy(emu->history[emu->serial % EMU_HISTORY], emu->out, emu->out_len);
+	emu->serial++;
+	if (drop) {
+		/* the history keeps it intact for the NAK */
+		emu->out[emu->out_len - 1] ^= 0xFF;
+		emu->more_sent = false;
+		emu->stats.dropped++;
+	}
+}
+
+/* a frame from the driver, clocked in full */
+static void emu_host_frame(struct mcuspi_emu *emu, const uint8_t *buf, size_t len)
+{
+	const struct mcuspi_link_ctrl * link_ctrl;
+	int payload_length = mcuspi_proto_unpack(buf, len);
+	uint8_t serial, s;
+	bool control;
+
+	if (payload_length == -ENODATA) {
+		return;
+	}
+	if (payload_length < 0) {
+		emu->stats.host_bad++;
+		return;
+	}
+	link_ctrl = (const void *)(buf + MCUSPI_DESC_OFFSET + MCUSPI_LINK_CTRL_OFFSET);
+	control = link && (link_ctrl->flags & MCUSPI_LINK_CONTROL);
+	if (link) {
+		if (link_ctrl->flags & MCUSPI_LINK_NAK) {
+			__set_bit(link_ctrl->nak, emu->resend);
+		}
+		serial = buf[MCUSPI_SERIAL_OFFSET];
+		if (__test_and_clear_bit(serial, emu->host_missing)) {
+			__clear_bit(serial, emu->host_nak);
+			emu->stats.host_recovered++;
+		} else if (emu->host_last >= 0 && (uint8_t)(serial - emu->host_last - 1) >= EMU_SERIALS / 2) {
+			emu->stats.host_dups++;
+			return;
+		} else {
+			for (s = emu->host_last + 1; emu->host_last >= 0 && s != serial; s++) {
+				__set_bit(s, emu->host_missing);
+				__set_bit(s, emu->host_nak);
+				emu->stats.host_lost++;
+			}
+			/* a serial half the space back is given up, as the driver does */
+			__clear_bit((uint8_t)(serial + EMU_SERIALS / 2), emu->host_missing);
+			__clear_bit((uint8_t)(serial + EMU_SERIALS / 2), emu->host_nak);
+			emu->host_last = serial;
+			if (!control && nak_every && ++emu->host_new % nak_every == 0) {
+				__set_bit(serial, emu->host_missing);
+				__set_bit(serial, emu->host_nak);
+				emu->stats.host_naked++;
+				return;
+			}
+		}
+	}
+	if (control) {
+		emu->stats.host_control++;
+		return;
+	}
+	if (!mcuspi_emu_check(buf + MCUSPI_PAYLOAD_OFFSET, payload_length)) {
+		emu->stats.host_corrupt++;
+	}
+	emu->stats.host_frames++;
+	emu->stats.host_bytes += payload_length;
+}
+
+/* copy len bytes of the outgoing frame from off, zeros past its end */
+static void emu_clock_out(struct mcuspi_emu *emu, uint8_t *rx, size_t off, size_t len)
+{
+	size_t n = off < emu->out_len ? min(len, emu->out_len - off) : 0;
+
+	if (!rx) {
+		return;
+	}
+	memcpy(rx, emu->out + off, n);
+	memset(rx + n, 0, len - n);
+}
+
+/*
+ * A transfer on the bus. Without varlen every transfer is a whole frame
+ * each way. With varlen a head and a body transfer make a frame, the
+ * emulator only sends on reads: a head clocked out by the driver is its
+ * own frame and the MCU end stays quiet.
+ */
+static void emu_transfer(struct mcuspi_emu *emu, struct spi_transfer *t)
+{
+	size_t len = min_t(size_t, t->len, MCUSPI_MAX_FRAME_LENGTH);
+
+	if (!varlen) {
+		emu_next_frame(emu);
+		emu_clock_out(emu, t->rx_buf, 0, t->len);
+		if (t->tx_buf) {
+			emu_host_frame(emu, t->tx_buf, len);
+		}
+		return;
+	}
+	if (!emu->in_body) {
+		emu->in_body = true;
+		emu->out_len = 0;
+		memset(emu->in, 0, MCUSPI_HEAD_LENGTH);
+		if (t->tx_buf) {
+			memcpy(emu->in, t->tx_buf, min_t(size_t, len, MCUSPI_HEAD_LENGTH));
+		} else {
+			emu_next_frame(emu);
+		}
+		emu_clock_out(emu, t->rx_buf, 0, t->len);
+		return;
+	}
+	emu->in_body = false;
+	emu_clock_out(emu, t->rx_buf, MCUSPI_HEAD_LENGTH, t->len);
+	if (t->tx_buf) {
+		len = min_t(size_t, len, MCUSPI_MAX_FRAME_LENGTH - MCUSPI_HEAD_LENGTH);
+		memcpy(emu->in + MCUSPI_HEAD_LENGTH, t->tx_buf, len);
+		emu_host_frame(emu, emu->in, MCUSPI_HEAD_LENGTH + len);
+	}
+}
+
+static int emu_transfer_one_message(struct spi_master *master, struct spi_message *m)
+{
+	struct mcuspi_emu * emu = spi_master_get_devdata(master);
+	struct spi_transfer * t;
+	unsigned long flags;
+	bool kick;
+
+	spin_lock_irqsave(&emu->lock, flags);
+	list_for_each_entry(t, &m->transfers, transfer_list) {
+		emu_transfer(emu, t);
+		m->actual_length += t->len;
+	}
+	/* as "int" stays asserted, unless the driver reads on for MORE or the body */
+	kick = !emu->in_body && emu_pending(emu) && !emu->more_sent;
+	spin_unlock_irqrestore(&emu->lock, flags);
+	m->status = 0;
+	spi_finalize_current_message(master);
+	if (kick) {
+		irq_work_queue(&emu->kick);
+	}
+	return 0;
+}
+
+static void emu_kick(struct irq_work *work)
+{
+	struct mcuspi_emu * emu = container_of(work, struct mcuspi_emu, kick);
+
+	generic_handle_irq(emu->irq);
+}
+
+/* generate burst frames, fire the interrupt while frames are waiting */
+static enum hrtimer_restart emu_tick(struct hrtimer *timer)
+{
+	struct mcuspi_emu * emu = container_of(timer, struct mcuspi_emu, timer);
+	mcu_message * msg;
+	bool pending;
+	unsigned int i;
+
+	spin_lock(&emu->lock);
+	/* a NAK may be lost with the frame carrying it, repeat them now and then */
+	if (link && !(++emu->ticks % EMU_RENAK_TICKS)) {
+		bitmap_or(emu->host_nak, emu->host_nak, emu->host_missing, EMU_SERIALS);
+	}
+	for (i = 0; i < burst && (!count || emu->seq < count); i++) {
+		if (emu->tail - emu->head >= EMU_QUEUE_LEN) {
+			emu->stats.overruns++;
+			continue;
+		}
+		msg = &emu->queue[emu->tail & (EMU_QUEUE_LEN - 1)];
+		memset(msg->payload_desc, 0, sizeof(msg->payload_desc));
+		msg->payload_length = payload_len;
+		mcuspi_emu_fill(msg->payload, payload_len, ktime_get_ns(), emu->seq++);
+		emu->tail++;
+		emu->stats.generated++;
+	}
+	pending = emu_pending(emu);
+	spin_unlock(&emu->lock);
+	if (pending) {
+		generic_handle_irq(emu->irq);
+	}
+	hrtimer_forward_now(timer, emu->period);
+	return HRTIMER_RESTART;
+}
+
+static const struct {
+	const char * name;
+	size_t offset;
+} mcuspi_emu_counters[] = {
+#define EMU_COUNTER(n) { #n, offsetof(struct mcuspi_emu_stats, n) }
+	EMU_COUNTER(generated),
+	EMU_COUNTER(overruns),
+	EMU_COUNTER(sent),
+	EMU_COUNTER(control),
+	EMU_COUNTER(dropped),
+	EMU_COUNTER(resent),
+	EMU_COUNTER(nak_missed),
+	EMU_COUNTER(host_frames),
+	EMU_COUNTER(host_bytes),
+	EMU_COUNTER(host_control),
+	EMU_COUNTER(host_bad),
+	EMU_COUNTER(host_corrupt),
+	EMU_COUNTER(host_dups),
+	EMU_COUNTER(host_naked),
+	EMU_COUNTER(host_lost),
+	EMU_COUNTER(host_recovered),
+#undef EMU_COUNTER
+};
+
+/* device tree properties of the device, by link | varlen << 1 */
+static const struct property_entry mcuspi_emu_props[][3] = {
+	{ { } },
+	{ PROPERTY_ENTRY_BOOL("dozh,link-control"), { } },
+	{ PROPERTY_ENTRY_BOOL("dozh,variable-length"), { } },
+	{ PROPERTY_ENTRY_BOOL("dozh,link-control"), PROPERTY_ENTRY_BOOL("dozh,variable-length"), { } },
+};
+
+static void mcuspi_emu_free(struct mcuspi_emu *emu)
+{
+	kfree(emu->in);
+	kfree(emu->out);
+	vfree(emu->history);
+	vfree(emu->queue);
+}
+
+static int __init mcuspi_emu_init(void)
+{
+	struct spi_board_info info = {
+		.modalias	= "mcu_spi",
+		.chip_select	= 0,
+		.mode		= SPI_MODE_0,
+	};
+	struct platform_device * pdev;
+	struct spi_master * master;
+	struct mcuspi_emu * emu;
+	int i, ret;
+
+	if (payload_len > MCUSPI_MAX_PAYLOAD_LENGTH || !rate_hz) {
+		return -EINVAL;
+	}
+	pdev = platform_device_register_simple("mcu-spi-emu", PLATFORM_DEVID_NONE, NULL, 0);
+	if (IS_ERR(pdev)) {
+		return PTR_ERR(pdev);
+	}
+	master = spi_alloc_master(&pdev->dev, sizeof(*emu));
+	if (!master) {
+		ret = -ENOMEM;
+		goto err_pdev;
+	}
+	emu = spi_master_get_devdata(master);
+	emu->pdev = pdev;
+	emu->master = master;
+	emu->host_last = -1;
+	spin_lock_init(&emu->lock);
+	init_irq_work(&emu->kick, emu_kick);
+	emu->queue = vzalloc(EMU_QUEUE_LEN * sizeof(*emu->queue));
+	emu->history = vzalloc(EMU_HISTORY * sizeof(*emu->history));
+	emu->out = kzalloc(MCUSPI_MAX_FRAME_LENGTH, GFP_KERNEL);
+	emu->in = kzalloc(MCUSPI_MAX_FRAME_LENGTH, GFP_KERNEL);
+	if (!emu->queue || !emu->history || !emu->out || !emu->in) {
+		ret = -ENOMEM;
+		goto err_master;
+	}
+
+	master->bus_num = -1;
+	master->num_chipselect = 1;
+	master->mode_bits = SPI_CPOL | SPI_CPHA;
+	master->transfer_one_message = emu_transfer_one_message;
+	ret = spi_register_master(master);
+	if (ret) {
+		dev_err(&pdev->dev, "register spi master failed\n");
+		goto err_master;
+	}
+	/* emu lives in the master, keep it past spi_unregister_master */
+	spi_master_get(master);
+
+	/* a software interrupt, fired with generic_handle_irq */
+	emu->irq = irq_alloc_desc(NUMA_NO_NODE);
+	if (emu->irq < 0) {
+		ret = emu->irq;
+		goto err_unregister;
+	}
+	irq_set_chip_and_handler(emu->irq, &dummy_irq_chip, handle_simple_irq);
+	irq_modify_status(emu->irq, IRQ_NOREQUEST, IRQ_NOPROBE);
+
+	info.max_speed_hz = speed_hz;
+	info.bus_num = master->bus_num;
+	info.irq = emu->irq;
+	info.properties = mcuspi_emu_props[link | varlen << 1];
+	emu->spi = spi_new_device(master, &info);
+	if (!emu->spi) {
+		dev_err(&pdev->dev, "new spi device failed\n");
+		ret = -ENODEV;
+		goto err_irq;
+	}
+
+	emu->debugfs = debugfs_create_dir("mcu-spi-emu", NULL);
+	for (i = 0; i < ARRAY_SIZE(mcuspi_emu_counters); i++) {
+		debugfs_create_u64(mcuspi_emu_counters[i].name, 0444, emu->debugfs,
+				   (u64 *)((char *)&emu->stats + mcuspi_emu_counters[i].offset));
+	}
+
+	emu->period = ns_to_ktime(NSEC_PER_SEC / rate_hz);
+	hrtimer_init(&emu->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	emu->timer.function = emu_tick;
+	hrtimer_start(&emu->timer, emu->period, HRTIMER_MODE_REL);
+	mcuspi_emu = emu;
+	dev_info(&pdev->dev, "mcu emulator on spi%d: %u x %u frames/s of %u bytes%s%s\n",
+		 master->bus_num, burst, rate_hz, payload_len, link ? ", link control" : "",
+		 varlen ? ", variable length" : "");
+	return 0;
+
+err_irq:
+	irq_free_desc(emu->irq);
+err_unregister:
+	spi_unregister_master(master);
+err_master:
+	mcuspi_emu_free(emu);
+	spi_master_put(master);
+err_pdev:
+	platform_device_unregister(pdev);
+	return ret;
+}
+
+static void __exit mcuspi_emu_exit(void)
+{
+	struct mcuspi_emu * emu = mcuspi_emu;
+	struct platform_device * pdev = emu->pdev;
+	struct spi_master * master = emu->master;
+
+	hrtimer_cancel(&emu->timer);
+	/* the driver frees its interrupt in remove */
+	spi_unregister_device(emu->spi);
+	irq_work_sync(&emu->kick);
+	debugfs_remove_recursive(emu->debugfs);
+	irq_free_desc(emu->irq);
+	spi_unregister_master(master);
+	mcuspi_emu_free(emu);
+	spi_master_put(master);
+	platform_device_unregister(pdev);
+}
+
+module_init(mcuspi_emu_init);
+module_exit(mcuspi_emu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("DoZh <TATQAQTAT@gmail.com>");
+MODULE_DESCRIPTION("Virtual spi master emulating the MCU end of mcu-spi");
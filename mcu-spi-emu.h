@@ -0,0 +1,62 @@
+/*
+ * Payload of the frames generated by mcu-spi-emu, read back by
+ * tools/mcuspi-bench. It starts with the ktime_get_ns of the generation of
+ * the frame and a sequence number counting the frames generated, both LE,
+ * the rest is mcuspi_emu_pattern. The bench sends its frames to the
+ * emulator the same way, the emulator checks them.
+ */
+#ifndef _MCU_SPI_EMU_H
+#define _MCU_SPI_EMU_H
+
+#include "mcu-spi-proto.h"
+
+#define MCUSPI_EMU_TIME_OFFSET 0
+#define MCUSPI_EMU_SEQ_OFFSET 8
+#define MCUSPI_EMU_STAMP_LENGTH 12
+
+static inline uint8_t mcuspi_emu_pattern(uint32_t seq, size_t i)
+{
+	return (uint8_t)(seq + i);
+}
+
+/* fill a payload of len bytes, a shorter one than the stamp is pattern only */
+static inline void mcuspi_emu_fill(uint8_t *payload, size_t len, uint64_t ns, uint32_t seq)
+{
+	size_t i = 0;
+
+	if (len >= MCUSPI_EMU_STAMP_LENGTH) {
+		mcuspi_proto_put_le32(payload + MCUSPI_EMU_TIME_OFFSET, (uint32_t)ns);
+		mcuspi_proto_put_le32(payload + MCUSPI_EMU_TIME_OFFSET + 4, (uint32_t)(ns >> 32));
+		mcuspi_proto_put_le32(payload + MCUSPI_EMU_SEQ_OFFSET, seq);
+		i = MCUSPI_EMU_STAMP_LENGTH;
+	}
+	for (; i < len; i++) {
+		payload[i] = mcuspi_emu_pattern(seq, i);
+	}
+}
+
+/* true if a payload of len bytes with a stamp carries the pattern of its seq */
+static inline int mcuspi_emu_check(const uint8_t *payload, size_t len)
+{
+	uint32_t seq;
+	size_t i;
+
+	if (len < MCUSPI_EMU_STAMP_LENGTH) {
+		return 1;
+	}
+	seq = mcuspi_proto_get_le32(payload + MCUSPI_EMU_SEQ_OFFSET);
+	for (i = MCUSPI_EMU_STAMP_LENGTH; i < len; i++) {
+		if (payload[i] != mcuspi_emu_pattern(seq, i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static inline uint64_t mcuspi_emu_time(const uint8_t *payload)
+{
+	return mcuspi_proto_get_le32(payload + MCUSPI_EMU_TIME_OFFSET) |
+	       (uint64_t)mcuspi_proto_get_le32(payload + MCUSPI_EMU_TIME_OFFSET + 4) << 32;
+}
+
+#endif /* _MCU_SPI_EMU_H */
@@ -0,0 +1,362 @@
+/*
+ * Frame format of the mcu-spi link, shared by the driver, the MCU firmware
+ * and host tools. Header only, it builds in the kernel and in userspace
+ * (C99 and stdint.h, no other dependency). A frame is:
+ *
+ *	0xAA | serial (1) | payload_desc (64) | payload_length (2, LE) |
+ *	payload (0 ~ 1024) | CRC32 (4, LE)
+ *
+ * The CRC32 is the IEEE one (as crc32_le: reflected 0xEDB88320, inverted
+ * before and after) over everything in front of it. The driver computes it
+ * with the backend it picked at probe, mcuspi_proto_crc32 is the portable
+ * reference. Bytes clocked after the CRC are ignored.
+ */
+#ifndef _MCU_SPI_PROTO_H
+#define _MCU_SPI_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+#include <asm/barrier.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#endif
+
+#define MCUSPI_PREAMBLE 0xAA
+#define MCUSPI_PREAMBLE_LENGTH 1
+#define MCUSPI_SERIAL_NO_LENGTH 1
+#define MCUSPI_PAYLOAD_DESC_LENGTH 64
+#define MCUSPI_PAYLOAD_COUNT_LENGTH 2
+#define MCUSPI_MAX_PAYLOAD_LENGTH 1024
+#define MCUSPI_VERIFY_LENGTH 4
+#define MCUSPI_HEAD_LENGTH (MCUSPI_PREAMBLE_LENGTH + MCUSPI_SERIAL_NO_LENGTH + \
+			    MCUSPI_PAYLOAD_DESC_LENGTH + MCUSPI_PAYLOAD_COUNT_LENGTH) /* 68 */
+#define MCUSPI_FRAME_LENGTH(len) (MCUSPI_HEAD_LENGTH + (len) + MCUSPI_VERIFY_LENGTH)
+#define MCUSPI_MAX_FRAME_LENGTH MCUSPI_FRAME_LENGTH(MCUSPI_MAX_PAYLOAD_LENGTH) /* 1096 */
+
+/* byte offsets in a frame */
+#define MCUSPI_SERIAL_OFFSET MCUSPI_PREAMBLE_LENGTH
+#define MCUSPI_DESC_OFFSET (MCUSPI_SERIAL_OFFSET + MCUSPI_SERIAL_NO_LENGTH)
+#define MCUSPI_COUNT_OFFSET (MCUSPI_DESC_OFFSET + MCUSPI_PAYLOAD_DESC_LENGTH)
+#define MCUSPI_PAYLOAD_OFFSET MCUSPI_HEAD_LENGTH
+
+static inline uint16_t mcuspi_proto_get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t mcuspi_proto_get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void mcuspi_proto_put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void mcuspi_proto_put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* crc32_le: crc is 0xFFFFFFFF for a new frame, the result is not inverted yet */
+static inline uint32_t mcuspi_proto_crc32(uint32_t crc, const uint8_t *p, size_t len)
+{
+#ifdef __KERNEL__
+	return crc32_le(crc, p, len);
+#else
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+	return crc;
+#endif
+}
+
+/*
+ * Slice-by-8 crc32_le, one table lookup per byte and 8 bytes per step. The
+ * 8 KiB table is filled once by mcuspi_proto_crc32_slice8_init.
+ */
+static inline void mcuspi_proto_crc32_slice8_init(uint32_t table[8][256])
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			crc = table[j - 1][i];
+			table[j][i] = (crc >> 8) ^ table[0][crc & 0xFF];
+		}
+	}
+}
+
+static inline uint32_t mcuspi_proto_crc32_slice8(const uint32_t table[8][256], uint32_t crc,
+						 const uint8_t *p, size_t len)
+{
+	uint32_t a, b;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		a = mcuspi_proto_get_le32(p) ^ crc;
+		b = mcuspi_proto_get_le32(p + 4);
+		crc = table[7][a & 0xFF] ^ table[6][(a >> 8) & 0xFF] ^
+		      table[5][(a >> 16) & 0xFF] ^ table[4][a >> 24] ^
+		      table[3][b & 0xFF] ^ table[2][(b >> 8) & 0xFF] ^
+		      table[1][(b >> 16) & 0xFF] ^ table[0][b >> 24];
+	}
+	while (len--) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+	}
+	return crc;
+}
+
+/* CRC32 of a frame of payload_length bytes of payload, as it is sent */
+static inline uint32_t mcuspi_proto_frame_crc(const uint8_t *buf, uint16_t payload_length)
+{
+	return ~mcuspi_proto_crc32(0xFFFFFFFF, buf, MCUSPI_HEAD_LENGTH + payload_length);
+}
+
+/*
+ * Fill the head of a frame whose payload is at buf + MCUSPI_PAYLOAD_OFFSET.
+ * A NULL payload_desc sends an all zero descriptor.
+ */
+static inline void mcuspi_proto_put_head(uint8_t *buf, uint8_t serial, const uint8_t *payload_desc,
+					 uint16_t payload_length)
+{
+	buf[0] = MCUSPI_PREAMBLE;
+	buf[MCUSPI_SERIAL_OFFSET] = serial;
+	if (payload_desc) {
+		memcpy(buf + MCUSPI_DESC_OFFSET, payload_desc, MCUSPI_PAYLOAD_DESC_LENGTH);
+	} else {
+		memset(buf + MCUSPI_DESC_OFFSET, 0, MCUSPI_PAYLOAD_DESC_LENGTH);
+	}
+	mcuspi_proto_put_le16(buf + MCUSPI_COUNT_OFFSET, payload_length);
+}
+
+static inline void mcuspi_proto_put_crc(uint8_t *buf, uint16_t payload_length, uint32_t crc)
+{
+	mcuspi_proto_put_le32(buf + MCUSPI_PAYLOAD_OFFSET + payload_length, crc);
+}
+
+static inline uint32_t mcuspi_proto_get_crc(const uint8_t *buf, uint16_t payload_length)
+{
+	return mcuspi_proto_get_le32(buf + MCUSPI_PAYLOAD_OFFSET + payload_length);
+}
+
+/*
+ * payload_length announced by the MCUSPI_HEAD_LENGTH bytes of a head, before
+ * the rest of the frame is clocked. -ENODATA if the sender had nothing to send,
+ * -EBADMSG if the length is out of range.
+ */
+static inline int mcuspi_proto_head_length(const uint8_t *head)
+{
+	int payload_length;
+
+	if (head[0] != MCUSPI_PREAMBLE) {
+		return -ENODATA;
+	}
+	payload_length = mcuspi_proto_get_le16(head + MCUSPI_COUNT_OFFSET);
+	if (payload_length > MCUSPI_MAX_PAYLOAD_LENGTH) {
+		return -EBADMSG;
+	}
+	return payload_length;
+}
+
+/*
+ * Check the framing of len bytes clocked in, the CRC is left to the caller.
+ * Return payload_length, -ENODATA if the sender had nothing to send or
+ * -EBADMSG if the frame is cut short.
+ */
+static inline int mcuspi_proto_payload_length(const uint8_t *buf, size_t len)
+{
+	int payload_length;
+
+	if (!len || buf[0] != MCUSPI_PREAMBLE) {
+		return -ENODATA;
+	}
+	if (len < MCUSPI_HEAD_LENGTH) {
+		return -EBADMSG;
+	}
+	payload_length = mcuspi_proto_head_length(buf);
+	if (payload_length >= 0 && (size_t)MCUSPI_FRAME_LENGTH(payload_length) > len) {
+		return -EBADMSG;
+	}
+	return payload_length;
+}
+
+/*
+ * Pack a whole frame with the portable CRC, the payload is copied unless it
+ * is at buf + MCUSPI_PAYLOAD_OFFSET already. Return the frame length.
+ */
+static inline size_t mcuspi_proto_pack(uint8_t *buf, uint8_t serial, const uint8_t *payload_desc,
+				       const uint8_t *payload, uint16_t payload_length)
+{
+	if (payload_length && payload != buf + MCUSPI_PAYLOAD_OFFSET) {
+		memmove(buf + MCUSPI_PAYLOAD_OFFSET, payload, payload_length);
+	}
+	mcuspi_proto_put_head(buf, serial, payload_desc, payload_length);
+	mcuspi_proto_put_crc(buf, payload_length, mcuspi_proto_frame_crc(buf, payload_length));
+	return MCUSPI_FRAME_LENGTH(payload_length);
+}
+
+/*
+ * Check a frame with the portable CRC. Return payload_length, -ENODATA or
+ * -EBADMSG as mcuspi_proto_payload_length, -EBADMSG for a bad CRC too.
+ */
+static inline int mcuspi_proto_unpack(const uint8_t *buf, size_t len)
+{
+	int payload_length = mcuspi_proto_payload_length(buf, len);
+
+	if (payload_length >= 0 &&
+	    mcuspi_proto_frame_crc(buf, payload_length) != mcuspi_proto_get_crc(buf, payload_length)) {
+		return -EBADMSG;
+	}
+	return payload_length;
+}
+
+/*
+ * Payload compression, PackBits run length coding. A header byte n is
+ * followed by n + 1 bytes taken as is for n in 0 ~ 127, by one byte repeated
+ * 257 - n times for n in 129 ~ 255, 128 is skipped. Cheap enough to run per
+ * frame on the MCU, it pays off on the zero padding and unchanged fields of
+ * fixed layout records.
+ */
+#define MCUSPI_RLE_RUN_MIN 3 /* shorter runs are sent as they are */
+
+/* Return the bytes written to dst, -ENOSPC if they do not fit in dst_len */
+static inline int mcuspi_proto_rle_encode(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t len)
+{
+	size_t i = 0, o = 0, n;
+
+	while (i < len) {
+		n = 1;
+		while (i + n < len && n < 128 && src[i + n] == src[i]) {
+			n++;
+		}
+		if (n >= MCUSPI_RLE_RUN_MIN) {
+			if (o + 2 > dst_len) {
+				return -ENOSPC;
+			}
+			dst[o++] = (uint8_t)(257 - n);
+			dst[o++] = src[i];
+			i += n;
+			continue;
+		}
+		/* bytes as they are, up to the next run */
+		n = 1;
+		while (i + n < len && n < 128 &&
+		       !(i + n + 2 < len && src[i + n] == src[i + n + 1] && src[i + n] == src[i + n + 2])) {
+			n++;
+		}
+		if (o + 1 + n > dst_len) {
+			return -ENOSPC;
+		}
+		dst[o++] = (uint8_t)(n - 1);
+		memcpy(dst + o, src + i, n);
+		o += n;
+		i += n;
+	}
+	return (int)o;
+}
+
+/* Return the bytes written to dst, -EBADMSG if src is cut short or does not fit in dst_len */
+static inline int mcuspi_proto_rle_decode(uint8_t *dst, size_t dst_len, const uint8_t *src, size_t len)
+{
+	size_t i = 0, o = 0, n;
+
+	while (i < len) {
+		n = src[i++];
+		if (n < 128) {
+			n++;
+			if (i + n > len || o + n > dst_len) {
+				return -EBADMSG;
+			}
+			memcpy(dst + o, src + i, n);
+			i += n;
+		} else if (n > 128) {
+			n = 257 - n;
+			if (i >= len || o + n > dst_len) {
+				return -EBADMSG;
+			}
+			memset(dst + o, src[i++], n);
+		} else {
+			continue;
+		}
+		o += n;
+	}
+	return (int)o;
+}
+
+/*
+ * Receive ring, a power of two count of slots with free running head and
+ * tail. The layout of a slot is struct mcuspi_ring_slot of mcu-spi.h, the
+ * driver keeps one ring per class and userspace may mmap it. The producer
+ * alone writes tail and the consumer alone writes head, each publishes its
+ * index with a release store and loads the other one with acquire: a slot is
+ * filled before tail passes it and copied out before head passes it.
+ */
+typedef struct mcu_message {
+	uint16_t payload_length;
+	uint8_t reserved[6];
+	uint8_t payload_desc[MCUSPI_PAYLOAD_DESC_LENGTH];
+	uint8_t payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+} mcu_message;
+
+#ifdef __KERNEL__
+#define mcuspi_ring_load_acquire(p) smp_load_acquire(p)
+#define mcuspi_ring_store_release(p, v) smp_store_release(p, v)
+#else
+#define mcuspi_ring_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define mcuspi_ring_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+/* producer side, true if the consumer has not handed back the slot at tail */
+static inline int mcuspi_ring_full(const uint32_t *head, uint32_t tail, uint32_t mask)
+{
+	return tail - mcuspi_ring_load_acquire(head) > mask;
+}
+
+/* consumer side, the msgs from head on the producer has published */
+static inline uint32_t mcuspi_ring_used(uint32_t head, const uint32_t *tail)
+{
+	return mcuspi_ring_load_acquire(tail) - head;
+}
+
+/* producer side, fill the slot at tail before publishing tail + 1 */
+static inline void mcuspi_ring_fill(mcu_message *slot, const uint8_t *payload_desc,
+				    const uint8_t *payload, uint16_t payload_length)
+{
+	memcpy(slot->payload_desc, payload_desc, MCUSPI_PAYLOAD_DESC_LENGTH);
+	slot->payload_length = payload_length;
+	if (payload_length) {
+		memcpy(slot->payload, payload, payload_length);
+	}
+}
+
+/* move the own index on once the slot it passes is filled or copied out */
+static inline void mcuspi_ring_publish(uint32_t *idx, uint32_t v)
+{
+	mcuspi_ring_store_release(idx, v);
+}
+
+#endif /* _MCU_SPI_PROTO_H */
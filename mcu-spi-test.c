@@ -0,0 +1,451 @@
+/*
+ * KUnit tests of the receive ring and the frame packing of mcu-spi.c, on a
+ * device with no bus behind it: empty and full ring, both overflow policies,
+ * indices wrapping round, the CRC backends against the shared vectors,
+ * pack_one_mcu_frame round trips and compression, frames that must be
+ * refused and the run length codec. The mcuspi_bench_* cases report with
+ * kunit_info the ns an enqueue, a dequeue, a pack and an unpack of a full
+ * size frame take, and what run length coding a telemetry payload costs
+ * the cpu against the bus time it saves.
+ *
+ * Included at the end of mcu-spi.c with CONFIG_KUNIT, so the tests call the
+ * static functions of the driver. They run when mcu-spi.ko is loaded with
+ * run_tests=1, no device needed:
+ *
+ *	insmod mcu-spi.ko run_tests=1 && dmesg | grep -A40 'mcu-spi'
+ */
+#include <kunit/test.h>
+
+#define TEST_RING_LEN 4 /* power of 2 */
+#define TEST_BENCH_OPS 4096
+#define TEST_BUS_HZ 10000000 /* bus clock the compression bench counts the saving at */
+
+/* enough of a device for the rings and pack_one_mcu_frame, stats are NULL */
+static struct mcuspi_dev *test_mcuspi(struct kunit *test, u32 features)
+{
+	struct mcuspi_dev * mcuspi = kunit_kzalloc(test, sizeof(*mcuspi), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mcuspi);
+	DO_ONCE(mcuspi_crc32_slice8_init);
+	mcuspi->features = features;
+	mcuspi->crc = &mcuspi_crc_backends[0];
+	mcuspi->nr_classes = 1;
+	strscpy(mcuspi->name, "kunit", sizeof(mcuspi->name));
+	return mcuspi;
+}
+
+/* freed by the caller with deinit_mcu_message_queue */
+static mcu_message_queue *test_queue(struct kunit *test, struct mcuspi_dev *mcuspi,
+				     uint32_t depth, int overflow)
+{
+	mcu_message_queue * queue = NULL;
+
+	KUNIT_ASSERT_EQ(test, init_mcu_message_queue(&queue, depth), 0);
+	queue->mcuspi = mcuspi;
+	queue->overflow = overflow;
+	queue->name = mcuspi->name;
+	return queue;
+}
+
+static void test_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = seed + i * 7 + (i >> 8);
+	}
+}
+
+static void mcuspi_test_ring_empty_full(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	mcu_message_queue * queue = test_queue(test, mcuspi, TEST_RING_LEN, MCUSPI_OVERFLOW_DROP_NEWEST);
+	mcu_message * msg = kunit_kzalloc(test, sizeof(*msg), GFP_KERNEL);
+	uint8_t desc[PAYLOAD_DESC_LENGTH] = { 0 };
+	uint8_t payload[16];
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	test_pattern(payload, sizeof(payload), 0);
+	KUNIT_EXPECT_TRUE(test, is_mcu_message_queue_empty(queue));
+	KUNIT_EXPECT_EQ(test, load_one_mcu_message_from_queue(queue, msg), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, drop_one_mcu_message_from_queue(queue), -EAGAIN);
+	for (i = 0; i < TEST_RING_LEN; i++) {
+		desc[0] = i;
+		KUNIT_EXPECT_EQ(test, store_one_mcu_message_to_queue(queue, i, i, desc, payload), 0);
+	}
+	KUNIT_EXPECT_TRUE(test, is_mcu_message_queue_full(queue));
+	KUNIT_EXPECT_EQ(test, store_one_mcu_message_to_queue(queue, i, 1, desc, payload), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, get_mcu_message_count_in_queue(queue), TEST_RING_LEN);
+	KUNIT_EXPECT_EQ(test, get_payload_len_in_next_mcu_msg(queue), 0);
+	for (i = 0; i < TEST_RING_LEN; i++) {
+		KUNIT_ASSERT_EQ(test, load_one_mcu_message_from_queue(queue, msg), 0);
+		KUNIT_EXPECT_EQ(test, msg->payload_desc[0], (uint8_t)i);
+		KUNIT_EXPECT_EQ(test, msg->payload_length, (uint16_t)i);
+		KUNIT_EXPECT_EQ(test, memcmp(msg->payload, payload, i), 0);
+	}
+	KUNIT_EXPECT_EQ(test, load_one_mcu_message_from_queue(queue, msg), -EAGAIN);
+	deinit_mcu_message_queue(queue);
+}
+
+/* a full ring takes the new msg in place of the oldest one */
+static void mcuspi_test_ring_drop_oldest(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	mcu_message_queue * queue = test_queue(test, mcuspi, TEST_RING_LEN, MCUSPI_OVERFLOW_DROP_OLDEST);
+	mcu_message * msg = kunit_kzalloc(test, sizeof(*msg), GFP_KERNEL);
+	uint8_t desc[PAYLOAD_DESC_LENGTH] = { 0 };
+	uint8_t payload[16];
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	test_pattern(payload, sizeof(payload), 0);
+	for (i = 0; i < TEST_RING_LEN + 2; i++) {
+		desc[0] = i;
+		KUNIT_EXPECT_EQ(test, store_one_mcu_message_to_queue(queue, i, i, desc, payload), 0);
+	}
+	KUNIT_EXPECT_EQ(test, get_mcu_message_count_in_queue(queue), TEST_RING_LEN);
+	/* msgs 0 and 1 were overwritten, 2 is dropped by the reader */
+	KUNIT_EXPECT_EQ(test, drop_one_mcu_message_from_queue(queue), 0);
+	for (i = 3; i < TEST_RING_LEN + 2; i++) {
+		KUNIT_ASSERT_EQ(test, load_one_mcu_message_from_queue(queue, msg), 0);
+		KUNIT_EXPECT_EQ(test, msg->payload_desc[0], (uint8_t)i);
+		KUNIT_EXPECT_EQ(test, msg->payload_length, (uint16_t)i);
+	}
+	KUNIT_EXPECT_EQ(test, load_one_mcu_message_from_queue(queue, msg), -EAGAIN);
+	deinit_mcu_message_queue(queue);
+}
+
+/* head and tail cross 2^32, the ring is kept from empty to full on the way */
+static void mcuspi_test_ring_wrap(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	mcu_message_queue * queue = test_queue(test, mcuspi, TEST_RING_LEN, MCUSPI_OVERFLOW_DROP_NEWEST);
+	mcu_message * msg = kunit_kzalloc(test, sizeof(*msg), GFP_KERNEL);
+	uint8_t * payload = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t desc[PAYLOAD_DESC_LENGTH] = { 0 };
+	uint32_t pushed = 0, popped = 0;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	queue->ctrl->head = queue->ctrl->tail = 0xFFFFFFF0;
+	for (i = 0; i < 64; i++) {
+		/* 1 ~ TEST_RING_LEN frames in, then out again */
+		while (pushed - popped < (uint32_t)(i % TEST_RING_LEN) + 1) {
+			desc[0] = pushed;
+			test_pattern(payload, pushed % MAX_PAYLOAD_LENGTH, pushed);
+			KUNIT_ASSERT_EQ(test, store_one_mcu_message_to_queue(queue, pushed,
+					pushed % MAX_PAYLOAD_LENGTH, desc, payload), 0);
+			pushed++;
+		}
+		while (popped != pushed) {
+			KUNIT_ASSERT_EQ(test, load_one_mcu_message_from_queue(queue, msg), 0);
+			test_pattern(payload, popped % MAX_PAYLOAD_LENGTH, popped);
+			KUNIT_EXPECT_EQ(test, msg->payload_desc[0], (uint8_t)popped);
+			KUNIT_EXPECT_EQ(test, msg->payload_length, (uint16_t)(popped % MAX_PAYLOAD_LENGTH));
+			KUNIT_EXPECT_EQ(test, memcmp(msg->payload, payload, msg->payload_length), 0);
+			popped++;
+		}
+	}
+	KUNIT_EXPECT_LT(test, queue->ctrl->tail, 0xFFFFFFF0U);
+	KUNIT_EXPECT_EQ(test, queue->ctrl->head, queue->ctrl->tail);
+	KUNIT_EXPECT_EQ(test, load_one_mcu_message_from_queue(queue, msg), -EAGAIN);
+	deinit_mcu_message_queue(queue);
+}
+
+/* every backend the cpu supports, mcuspi_select_crc may pick any of them */
+static void mcuspi_test_crc_vectors(struct kunit *test)
+{
+	uint8_t * buf = kunit_kzalloc(test, MAX_PACKET_LENGTH, GFP_KERNEL);
+	const struct mcuspi_crc_ops * ops;
+	const struct mcuspi_crc_vector * v;
+	const uint8_t * data;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+	DO_ONCE(mcuspi_crc32_slice8_init);
+	mcuspi_crc_vector_pattern(buf, MAX_PACKET_LENGTH);
+	for (ops = mcuspi_crc_backends; ops < mcuspi_crc_backends + ARRAY_SIZE(mcuspi_crc_backends); ops++) {
+		if (!ops->supported()) {
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(mcuspi_crc_vectors); i++) {
+			v = &mcuspi_crc_vectors[i];
+			data = v->data ? (const uint8_t *)v->data : buf;
+			KUNIT_EXPECT_EQ_MSG(test, ~ops->update(0xFFFFFFFF, data, v->len), v->crc,
+					    "%s vector %d, %u bytes", ops->name, i, v->len);
+		}
+	}
+}
+
+static void mcuspi_test_frame_roundtrip(struct kunit *test)
+{
+	static const uint16_t lengths[] = { 0, 1, 7, 63, 64, 1023, MAX_PAYLOAD_LENGTH };
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	uint8_t * frame = kunit_kzalloc(test, MAX_PACKET_LENGTH, GFP_KERNEL);
+	uint8_t * payload = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t desc[PAYLOAD_DESC_LENGTH];
+	size_t len;
+	int i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frame);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	mcuspi->tx_serial = 0xFE;
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		test_pattern(desc, sizeof(desc), 0x5A + i);
+		test_pattern(payload, lengths[i], i);
+		memcpy(frame + PAYLOAD_SHIFT, payload, lengths[i]);
+		KUNIT_ASSERT_EQ(test, pack_one_mcu_frame(mcuspi, frame, desc, lengths[i], 0, 0), lengths[i]);
+		len = MCUSPI_FRAME_LENGTH(lengths[i]);
+		KUNIT_EXPECT_EQ(test, frame[0], (uint8_t)MCUSPI_PREAMBLE);
+		/* serials count on across 0xFF */
+		KUNIT_EXPECT_EQ(test, frame[PREAMBLE_LENGTH], (uint8_t)(0xFE + i));
+		KUNIT_EXPECT_EQ(test, memcmp(frame + MCUSPI_DESC_OFFSET, desc, sizeof(desc)), 0);
+		KUNIT_EXPECT_EQ(test, memcmp(frame + PAYLOAD_SHIFT, payload, lengths[i]), 0);
+		/* the whole frame, a fixed length transfer of it and the codec of userspace */
+		KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, len), (int)lengths[i]);
+		KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, MAX_PACKET_LENGTH), (int)lengths[i]);
+		KUNIT_EXPECT_EQ(test, mcuspi_proto_unpack(frame, len), (int)lengths[i]);
+		/* cut short by one byte */
+		KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, len - 1), -EBADMSG);
+		/* any bit flipped fails the CRC */
+		frame[len - 1 - i] ^= 0x10;
+		KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, len), -EBADMSG);
+		frame[len - 1 - i] ^= 0x10;
+	}
+
+	/* no frame clocked out, and a length past the largest payload */
+	memset(frame, 0, MAX_PACKET_LENGTH);
+	KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, MAX_PACKET_LENGTH), -ENODATA);
+	pack_one_mcu_frame(mcuspi, frame, NULL, 16, 0, 0);
+	mcuspi_proto_put_le16(frame + MCUSPI_COUNT_OFFSET, MAX_PAYLOAD_LENGTH + 1);
+	KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, MAX_PACKET_LENGTH), -EBADMSG);
+}
+
+/* only variable length frames with link control are clocked short */
+static void mcuspi_test_frame_length(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+
+	KUNIT_EXPECT_EQ(test, mcu_frame_length(mcuspi, 16), (size_t)MAX_PACKET_LENGTH);
+	mcuspi->features = MCUSPI_FEAT_VARLEN;
+	KUNIT_EXPECT_EQ(test, mcu_frame_length(mcuspi, 16), (size_t)MAX_PACKET_LENGTH);
+	mcuspi->features = MCUSPI_FEAT_VARLEN | MCUSPI_FEAT_LINK;
+	KUNIT_EXPECT_EQ(test, mcu_frame_length(mcuspi, 16), (size_t)MCUSPI_FRAME_LENGTH(16));
+	KUNIT_EXPECT_EQ(test, mcu_frame_length(mcuspi, MAX_PAYLOAD_LENGTH), (size_t)MAX_PACKET_LENGTH);
+}
+
+/* pack_one_mcu_frame compresses the classes asked for when that is shorter */
+static void mcuspi_test_frame_compress(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	uint8_t * frame = kunit_kzalloc(test, MAX_PACKET_LENGTH, GFP_KERNEL);
+	uint8_t * payload = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t * out = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint16_t sent;
+
+	mcuspi->tx_compress_buf = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frame);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mcuspi->tx_compress_buf);
+	mcuspi->compress_classes = BIT(0);
+	memset(payload + 64, 0xEE, 512);
+	memcpy(frame + PAYLOAD_SHIFT, payload, MAX_PAYLOAD_LENGTH);
+	sent = pack_one_mcu_frame(mcuspi, frame, NULL, MAX_PAYLOAD_LENGTH, 0, 0);
+	KUNIT_EXPECT_LT(test, sent, MAX_PAYLOAD_LENGTH / 4);
+	KUNIT_EXPECT_EQ(test, unpack_one_mcu_frame(mcuspi, frame, MAX_PACKET_LENGTH), (int)sent);
+	KUNIT_EXPECT_EQ(test, mcuspi_proto_rle_decode(out, MAX_PAYLOAD_LENGTH, frame + PAYLOAD_SHIFT, sent),
+			MAX_PAYLOAD_LENGTH);
+	KUNIT_EXPECT_EQ(test, memcmp(out, payload, MAX_PAYLOAD_LENGTH), 0);
+
+	/* a payload that does not shrink goes as it is */
+	test_pattern(payload, MAX_PAYLOAD_LENGTH, 1);
+	memcpy(frame + PAYLOAD_SHIFT, payload, MAX_PAYLOAD_LENGTH);
+	KUNIT_EXPECT_EQ(test, pack_one_mcu_frame(mcuspi, frame, NULL, MAX_PAYLOAD_LENGTH, 0, 0),
+			MAX_PAYLOAD_LENGTH);
+	KUNIT_EXPECT_EQ(test, memcmp(frame + PAYLOAD_SHIFT, payload, MAX_PAYLOAD_LENGTH), 0);
+}
+
+static void test_rle_roundtrip(struct kunit *test, const uint8_t *src, size_t len,
+			       uint8_t *rle, uint8_t *out)
+{
+	int rle_len, out_len;
+
+	rle_len = mcuspi_proto_rle_encode(rle, MAX_PACKET_LENGTH, src, len);
+	KUNIT_ASSERT_GE(test, rle_len, 0);
+	out_len = mcuspi_proto_rle_decode(out, MAX_PAYLOAD_LENGTH, rle, rle_len);
+	KUNIT_ASSERT_EQ(test, out_len, (int)len);
+	KUNIT_EXPECT_EQ(test, memcmp(out, src, len), 0);
+	if (rle_len) {
+		KUNIT_EXPECT_EQ(test, mcuspi_proto_rle_decode(out, MAX_PAYLOAD_LENGTH, rle, rle_len - 1),
+				-EBADMSG);
+	}
+}
+
+static void mcuspi_test_rle(struct kunit *test)
+{
+	static const size_t runs[] = { 1, 2, 3, 127, 128, 129, 130, 256, 257 };
+	uint8_t * src = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t * rle = kunit_kzalloc(test, MAX_PACKET_LENGTH, GFP_KERNEL);
+	uint8_t * out = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	int i, rle_len;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, src);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rle);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	test_rle_roundtrip(test, src, 0, rle, out);
+	/* runs round the longest one a header codes, between literals */
+	for (i = 0; i < ARRAY_SIZE(runs); i++) {
+		test_pattern(src, MAX_PAYLOAD_LENGTH, i);
+		memset(src + 5, 0xEE, runs[i]);
+		test_rle_roundtrip(test, src, 5 + runs[i] + 9, rle, out);
+	}
+	/* literals only, they grow by a header byte in 128 */
+	test_pattern(src, MAX_PAYLOAD_LENGTH, 1);
+	test_rle_roundtrip(test, src, MAX_PAYLOAD_LENGTH, rle, out);
+	KUNIT_EXPECT_EQ(test, mcuspi_proto_rle_encode(rle, MAX_PAYLOAD_LENGTH - 1, src,
+						      MAX_PAYLOAD_LENGTH), -ENOSPC);
+	/* records of 16 bytes as the MCU telemetry: a counter, a flag and zero padding */
+	for (i = 0; i < MAX_PAYLOAD_LENGTH; i++) {
+		src[i] = i % 16 < 2 ? i / 16 : i % 16 == 3;
+	}
+	test_rle_roundtrip(test, src, MAX_PAYLOAD_LENGTH, rle, out);
+	rle_len = mcuspi_proto_rle_encode(rle, MAX_PACKET_LENGTH, src, MAX_PAYLOAD_LENGTH);
+	KUNIT_EXPECT_LT(test, rle_len, MAX_PAYLOAD_LENGTH / 2);
+	/* decoded past the room of dst */
+	KUNIT_EXPECT_EQ(test, mcuspi_proto_rle_decode(out, MAX_PAYLOAD_LENGTH - 1, rle, rle_len),
+			-EBADMSG);
+}
+
+/* ns per op of the enqueue and dequeue of full size frames, one slot ahead */
+static void mcuspi_bench_ring(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	mcu_message_queue * queue = test_queue(test, mcuspi, TEST_RING_LEN, MCUSPI_OVERFLOW_DROP_NEWEST);
+	mcu_message * msg = kunit_kzalloc(test, sizeof(*msg), GFP_KERNEL);
+	uint8_t * payload = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t desc[PAYLOAD_DESC_LENGTH] = { 0 };
+	u64 enqueue_ns = 0, dequeue_ns = 0, start;
+	int i, ret = 0;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msg);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, payload);
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		start = ktime_get_ns();
+		ret |= store_one_mcu_message_to_queue(queue, i, MAX_PAYLOAD_LENGTH, desc, payload);
+		enqueue_ns += ktime_get_ns() - start;
+		start = ktime_get_ns();
+		ret |= load_one_mcu_message_from_queue(queue, msg);
+		dequeue_ns += ktime_get_ns() - start;
+	}
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	kunit_info(test, "%llu ns to enqueue, %llu ns to dequeue a %d byte frame\n",
+		   div_u64(enqueue_ns, TEST_BENCH_OPS), div_u64(dequeue_ns, TEST_BENCH_OPS),
+		   MAX_PAYLOAD_LENGTH);
+	deinit_mcu_message_queue(queue);
+}
+
+/* ns per op of the pack and unpack of a full size frame, with each crc32 backend */
+static void mcuspi_bench_pack(struct kunit *test)
+{
+	struct mcuspi_dev * mcuspi = test_mcuspi(test, 0);
+	uint8_t * frame = kunit_kzalloc(test, MAX_PACKET_LENGTH, GFP_KERNEL);
+	const struct mcuspi_crc_ops * ops;
+	u64 pack_ns, unpack_ns, start;
+	int i, ret = 0;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, frame);
+	test_pattern(frame + PAYLOAD_SHIFT, MAX_PAYLOAD_LENGTH, 0);
+	for (ops = mcuspi_crc_backends; ops < mcuspi_crc_backends + ARRAY_SIZE(mcuspi_crc_backends); ops++) {
+		if (!ops->supported()) {
+			continue;
+		}
+		mcuspi->crc = ops;
+		start = ktime_get_ns();
+		for (i = 0; i < TEST_BENCH_OPS; i++) {
+			pack_one_mcu_frame(mcuspi, frame, NULL, MAX_PAYLOAD_LENGTH, 0, 0);
+		}
+		pack_ns = ktime_get_ns() - start;
+		start = ktime_get_ns();
+		for (i = 0; i < TEST_BENCH_OPS; i++) {
+			ret |= unpack_one_mcu_frame(mcuspi, frame, MAX_PACKET_LENGTH) != MAX_PAYLOAD_LENGTH;
+		}
+		unpack_ns = ktime_get_ns() - start;
+		kunit_info(test, "%s: %llu ns to pack, %llu ns to unpack a %d byte frame\n", ops->name,
+			   div_u64(pack_ns, TEST_BENCH_OPS), div_u64(unpack_ns, TEST_BENCH_OPS),
+			   MAX_PAYLOAD_LENGTH);
+	}
+	KUNIT_EXPECT_EQ(test, ret, 0);
+}
+
+/* ns per op of the run length coding of a telemetry payload, and the bus time it saves */
+static void mcuspi_bench_compress(struct kunit *test)
+{
+	uint8_t * src = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t * rle = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	uint8_t * out = kunit_kzalloc(test, MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	u64 encode_ns, decode_ns, start;
+	int i, rle_len = 0, len = 0;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, src);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, rle);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, out);
+	/* records of 16 bytes as the MCU telemetry: a counter, a flag and zero padding */
+	for (i = 0; i < MAX_PAYLOAD_LENGTH; i++) {
+		src[i] = i % 16 < 2 ? i / 16 : i % 16 == 3;
+	}
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		rle_len = mcuspi_proto_rle_encode(rle, MAX_PAYLOAD_LENGTH, src, MAX_PAYLOAD_LENGTH);
+	}
+	encode_ns = ktime_get_ns() - start;
+	KUNIT_ASSERT_GT(test, rle_len, 0);
+	start = ktime_get_ns();
+	for (i = 0; i < TEST_BENCH_OPS; i++) {
+		len = mcuspi_proto_rle_decode(out, MAX_PAYLOAD_LENGTH, rle, rle_len);
+	}
+	decode_ns = ktime_get_ns() - start;
+	KUNIT_ASSERT_EQ(test, len, MAX_PAYLOAD_LENGTH);
+	KUNIT_EXPECT_EQ(test, memcmp(out, src, MAX_PAYLOAD_LENGTH), 0);
+	kunit_info(test, "rle %d -> %d bytes, %llu ns to compress, %llu ns to decompress, %llu ns of bus saved at %u Hz\n",
+		   MAX_PAYLOAD_LENGTH, rle_len, div_u64(encode_ns, TEST_BENCH_OPS),
+		   div_u64(decode_ns, TEST_BENCH_OPS),
+		   div_u64((u64)(MAX_PAYLOAD_LENGTH - rle_len) * 8 * NSEC_PER_SEC, TEST_BUS_HZ), TEST_BUS_HZ);
+}
+
+static struct kunit_case mcuspi_test_cases[] = {
+	KUNIT_CASE(mcuspi_test_ring_empty_full),
+	KUNIT_CASE(mcuspi_test_ring_drop_oldest),
+	KUNIT_CASE(mcuspi_test_ring_wrap),
+	KUNIT_CASE(mcuspi_test_crc_vectors),
+	KUNIT_CASE(mcuspi_test_frame_roundtrip),
+	KUNIT_CASE(mcuspi_test_frame_length),
+	KUNIT_CASE(mcuspi_test_frame_compress),
+	KUNIT_CASE(mcuspi_test_rle),
+	KUNIT_CASE(mcuspi_bench_ring),
+	KUNIT_CASE(mcuspi_bench_pack),
+	KUNIT_CASE(mcuspi_bench_compress),
+	{}
+};
+
+static struct kunit_suite mcuspi_test_suite = {
+	.name = "mcu-spi",
+	.test_cases = mcuspi_test_cases,
+};
+
+static bool run_tests;
+module_param(run_tests, bool, 0444);
+MODULE_PARM_DESC(run_tests, "run the KUnit tests of the driver when it is loaded");
+
+/* 
+ * Called by the module init, kunit_test_suite would add a module_init of
+ * its own on the kernels the driver is built for.
+ */
+static void mcuspi_run_tests(void)
+{
+	if (run_tests) {
+		kunit_run_tests(&mcuspi_test_suite);
+	}
+}
@@ -0,0 +1,111 @@
+/*
+ * Tracepoints of the mcu-spi frame lifecycle.
+ *
+ * A received frame goes irq_hardirq -> spi_rx_done -> crc_checked ->
+ * enqueued -> dequeued, a sent frame tx_packed -> tx_done. Frames clocked in
+ * along with a tx frame skip irq_hardirq and spi_rx_done. serial is the
+ * serial number byte of the frame, -1 where it is not known yet, depth is
+ * the number of frames in the receive ring (tx queue for tx events) after
+ * the event.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mcuspi
+
+#if !defined(_MCU_SPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MCU_SPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(mcuspi_frame,
+
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+
+	TP_ARGS(name, serial, len, depth),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(int, serial)
+		__field(unsigned int, len)
+		__field(unsigned int, depth)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->serial = serial;
+		__entry->len = len;
+		__entry->depth = depth;
+	),
+
+	TP_printk("%s serial=%d len=%u depth=%u",
+		  __get_str(name), __entry->serial, __entry->len, __entry->depth)
+);
+
+/* interrupt edge, before the isr thread runs */
+DEFINE_EVENT(mcuspi_frame, mcuspi_irq_hardirq,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* isr read finished, len is the bytes clocked */
+DEFINE_EVENT(mcuspi_frame, mcuspi_spi_rx_done,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* frame stored to the receive ring, len is the payload length */
+DEFINE_EVENT(mcuspi_frame, mcuspi_enqueued,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* frame taken from the receive ring by a reader */
+DEFINE_EVENT(mcuspi_frame, mcuspi_dequeued,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* frame packed into a tx slot */
+DEFINE_EVENT(mcuspi_frame, mcuspi_tx_packed,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* frame clocked out, its tx batch has completed */
+DEFINE_EVENT(mcuspi_frame, mcuspi_tx_done,
+	TP_PROTO(const char *name, int serial, unsigned int len, unsigned int depth),
+	TP_ARGS(name, serial, len, depth)
+);
+
+/* frame length and CRC checked, result is 0 or the negative errno */
+TRACE_EVENT(mcuspi_crc_checked,
+
+	TP_PROTO(const char *name, int serial, unsigned int len, int result),
+
+	TP_ARGS(name, serial, len, result),
+
+	TP_STRUCT__entry(
+		__string(name, name)
+		__field(int, serial)
+		__field(unsigned int, len)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, name);
+		__entry->serial = serial;
+		__entry->len = len;
+		__entry->result = result;
+	),
+
+	TP_printk("%s serial=%d len=%u result=%d",
+		  __get_str(name), __entry->serial, __entry->len, __entry->result)
+);
+
+#endif /* _MCU_SPI_TRACE_H */
+
+/* the module is built out of tree, the header is next to mcu-spi.c */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mcu-spi-trace
+#include <trace/define_trace.h>
@@ -10,23 +10,290 @@
 #include <linux/uaccess.h>
 #include <linux/interrupt.h>
 #include <linux/crc32.h>
+#include <linux/crc32poly.h>
+#include <linux/once.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <asm/unaligned.h>
+#if defined(CONFIG_ARM64)
+#include <asm/cpufeature.h>
+#elif defined(CONFIG_ARM)
+#include <asm/hwcap.h>
+#endif
 #include <linux/delay.h>
-
-
-#define PREAMBLE_LENGTH 1
-#define SERIAL_NO_LENGTH 1
-#define PAYLOAD_DESC_LENGTH 64
-#define PAYLOAD_COUNT_LENGTH 2
-#define MAX_PAYLOAD_LENGTH 1024
-#define VERIFY_LENGTH 4
-#define HEAD_LENGTH (PREAMBLE_LENGTH + SERIAL_NO_LENGTH + PAYLOAD_DESC_LENGTH + PAYLOAD_COUNT_LENGTH) //68
-#define PAYLOAD_SHIFT HEAD_LENGTH
-#define MAX_PACKET_LENGTH (HEAD_LENGTH + MAX_PAYLOAD_LENGTH + VERIFY_LENGTH) //1096
+#include <linux/property.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/stringify.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/bitmap.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/rculist.h>
+#include <linux/string.h>
+#include <linux/gpio/consumer.h>
+
+#include "mcu-spi.h"
+#include "mcu-spi-proto.h"
+#include "mcu-spi-crc-vectors.h"
+
+#define CREATE_TRACE_POINTS
+#include "mcu-spi-trace.h"
+
+
+/* frame format, see mcu-spi-proto.h */
+#define PREAMBLE_LENGTH MCUSPI_PREAMBLE_LENGTH
+#define SERIAL_NO_LENGTH MCUSPI_SERIAL_NO_LENGTH
+#define PAYLOAD_DESC_LENGTH MCUSPI_PAYLOAD_DESC_LENGTH
+#define PAYLOAD_COUNT_LENGTH MCUSPI_PAYLOAD_COUNT_LENGTH
+#define MAX_PAYLOAD_LENGTH MCUSPI_MAX_PAYLOAD_LENGTH
+#define VERIFY_LENGTH MCUSPI_VERIFY_LENGTH
+#define HEAD_LENGTH MCUSPI_HEAD_LENGTH //68
+#define PAYLOAD_SHIFT MCUSPI_PAYLOAD_OFFSET
+#define MAX_PACKET_LENGTH MCUSPI_MAX_FRAME_LENGTH //1096
 
 #define SEND_SYSFS_DIR_NAME "send"
 #define RECV_SYSFS_DIR_NAME "recv"
 
-#define MAX_BUFFERED_MSG 1024 
+#define MAX_BUFFERED_MSG 1024 /* default depth of a receive ring */
+#define MCUSPI_MAX_RING_DEPTH 4096
+#define MCUSPI_SHARED_POOL 256 /* msgs held by subscribers at a time */
+#define MCUSPI_TX_QUEUE_LEN 64 /* frames queued or in flight, power of 2 */
+#define MCUSPI_TX_BATCH 8 /* frames chained in one spi_message */
+#define MCUSPI_TX_HISTORY 16 /* sent frames kept for retransmission with link control */
+#define MCUSPI_SERIALS 256 /* serial numbers are one byte */
+#define MCUSPI_READY_MARGIN 4 /* free slots left when the ready line drops */
+#define MCUSPI_FLOW_POLL_MS 10 /* recheck of the rings while the MCU is held off */
+#define MCUSPI_CREDIT_LOW 8 /* credits left when fresh ones are sent */
+#define MCUSPI_CREDIT_SLACK 2 /* frames between sequence check and store, isr and tx completion */
+#define MCUSPI_RX_BURST 64 /* frames read by one run of the isr thread */
+#define MCUSPI_FRAG_BUFS 4 /* reassembly buffers, one message is reassembled while the others wait */
+#define MCUSPI_COMPRESS_MIN 16 /* shorter payloads are sent as they are */
+
+/* Protocol features negotiated with the MCU through device tree properties */
+#define MCUSPI_FEAT_VARLEN	BIT(0) /* "dozh,variable-length": clock only HEAD + payload + CRC */
+#define MCUSPI_FEAT_LINK	BIT(1) /* "dozh,link-control": ack/nak block in payload_desc, see mcu-spi.h */
+#define MCUSPI_FEAT_CREDITS	BIT(2) /* "dozh,rx-credits": free receive slots in the link control block */
+#define MCUSPI_FEAT_INT_LEVEL	BIT(3) /* "dozh,int-level": "int" stays low while the MCU has frames */
+#define MCUSPI_FEAT_FRAG	BIT(4) /* "dozh,fragments": messages longer than a frame, see mcu-spi.h */
+#define MCUSPI_FEAT_COMPRESS	BIT(5) /* "dozh,compress-classes": run length coded payloads */
+
+static char *crc_backend = "auto";
+module_param(crc_backend, charp, 0444);
+MODULE_PARM_DESC(crc_backend, "frame CRC32 implementation: auto (fastest), kernel, slice8 or armv8");
+
+static unsigned int rx_depth = MAX_BUFFERED_MSG;
+module_param(rx_depth, uint, 0444);
+MODULE_PARM_DESC(rx_depth, "receive ring depth when dozh,rx-class-depths is absent, rounded up to a power of 2");
+
+static char *rx_overflow = "drop-newest";
+module_param(rx_overflow, charp, 0444);
+MODULE_PARM_DESC(rx_overflow, "full receive ring policy when dozh,rx-overflow is absent: drop-newest, drop-oldest or block");
+
+static unsigned int rx_coalesce_us = 2000;
+module_param(rx_coalesce_us, uint, 0644);
+MODULE_PARM_DESC(rx_coalesce_us, "longest wait of a reader for its wakeup while a burst is read, 0 wakes per frame");
+
+static unsigned int tx_starve_us = 2000;
+module_param(tx_starve_us, uint, 0644);
+MODULE_PARM_DESC(tx_starve_us, "longest wait of a tx batch behind pending isr reads, 0 alternates rx and tx");
+
+static unsigned int rx_frag_max = 64 * MAX_PAYLOAD_LENGTH;
+module_param(rx_frag_max, uint, 0444);
+MODULE_PARM_DESC(rx_frag_max, "longest message reassembled from fragments, bytes, rounded up to whole frames");
+
+static unsigned int rx_frag_timeout_ms = 100;
+module_param(rx_frag_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(rx_frag_timeout_ms, "longest time from the first to the last fragment of a message");
+
+
+/* owner of the half duplex bus, see mcuspi_bus_rx_begin */
+enum mcuspi_bus_state {
+	MCUSPI_BUS_IDLE,
+	MCUSPI_BUS_RX,	/* read by the isr thread */
+	MCUSPI_BUS_TX,	/* a tx batch is in flight */
+};
+
+/* what a producer does with a frame that finds its receive ring full */
+enum mcuspi_overflow {
+	MCUSPI_OVERFLOW_DROP_NEWEST,	/* the frame is dropped */
+	MCUSPI_OVERFLOW_DROP_OLDEST,	/* the oldest msg of the ring is overwritten */
+	MCUSPI_OVERFLOW_BLOCK,		/* the ready gpio holds the MCU off before the ring fills */
+};
+
+static const char * const mcuspi_overflow_names[] = {
+	[MCUSPI_OVERFLOW_DROP_NEWEST] = "drop-newest",
+	[MCUSPI_OVERFLOW_DROP_OLDEST] = "drop-oldest",
+	[MCUSPI_OVERFLOW_BLOCK] = "block",
+};
+
+/* 
+ * Statistics, per cpu so that the isr, the tx completion and readers update
+ * them without locks. Summed up by the debugfs stats file and sysfs counters.
+ */
+enum mcuspi_counter {
+	MCUSPI_CNT_RX_FRAMES,
+	MCUSPI_CNT_RX_BYTES,		/* payload bytes */
+	MCUSPI_CNT_RX_PIGGYBACK,	/* frames clocked in along with a tx frame */
+	MCUSPI_CNT_RX_BAD_FRAMES,	/* bad length or CRC */
+	MCUSPI_CNT_RX_QUEUE_FULL,
+	MCUSPI_CNT_RX_OVERWRITTEN,	/* unread msgs overwritten with drop-oldest */
+	MCUSPI_CNT_RX_FLOW_OFF,		/* ready line dropped to hold the MCU off */
+	MCUSPI_CNT_RX_CREDIT_OVERRUN,	/* frames received past the credits given */
+	MCUSPI_CNT_RX_IDLE,		/* isr read found no frame */
+	MCUSPI_CNT_RX_BURST_READS,	/* frames read by the isr without an edge of "int" */
+	MCUSPI_CNT_RX_WAKEUPS,		/* wakeups of readers of the receive rings */
+	MCUSPI_CNT_RX_LOST,		/* frames whose serial was skipped */
+	MCUSPI_CNT_RX_DUPLICATES,	/* frames whose serial was already received */
+	MCUSPI_CNT_RX_RECOVERED,	/* lost frames received later on */
+	MCUSPI_CNT_RX_FRAGMENTS,
+	MCUSPI_CNT_RX_REASSEMBLED,	/* msgs reassembled from fragments */
+	MCUSPI_CNT_RX_FRAG_DROPPED,	/* fragments of msgs dropped before they were whole */
+	MCUSPI_CNT_RX_COMPRESSED,	/* frames decompressed */
+	MCUSPI_CNT_RX_DECOMPRESS_ERRORS, /* compressed frames that did not decode */
+	MCUSPI_CNT_SUB_DELIVERED,	/* msgs handed to a subscriber */
+	MCUSPI_CNT_SUB_DROPPED,		/* msgs not handed to a full subscriber */
+	MCUSPI_CNT_SUB_POOL_EMPTY,	/* matched msgs dropped, no shared buffer left */
+	MCUSPI_CNT_TX_FRAMES,
+	MCUSPI_CNT_TX_BYTES,		/* payload bytes */
+	MCUSPI_CNT_TX_BATCHES,
+	MCUSPI_CNT_TX_ERRORS,
+	MCUSPI_CNT_TX_QUEUE_FULL,	/* a writer found no free slot */
+	MCUSPI_CNT_TX_DEFERRED,		/* batch held back by a pending isr read */
+	MCUSPI_CNT_TX_STARVED,		/* batch started ahead of a pending isr read after tx_starve_us */
+	MCUSPI_CNT_ISR_TX_WAITS,	/* isr waited for the tx batch in flight */
+	MCUSPI_CNT_TX_RETRANSMITS,	/* frames sent again on a NAK of the MCU */
+	MCUSPI_CNT_TX_NAK_MISSED,	/* NAK for a frame no longer in history */
+	MCUSPI_CNT_TX_CONTROL,		/* control frames sent to carry a NAK or credits */
+	MCUSPI_CNT_TX_FRAGMENTED,	/* msgs sent as fragments */
+	MCUSPI_CNT_TX_COMPRESSED,	/* frames sent compressed */
+	MCUSPI_CNT_TX_COMPRESS_SAVED,	/* payload bytes not clocked thanks to compression */
+	MCUSPI_CNT_NR
+};
+
+static const char * const mcuspi_counter_names[MCUSPI_CNT_NR] = {
+	[MCUSPI_CNT_RX_FRAMES] = "rx_frames",
+	[MCUSPI_CNT_RX_BYTES] = "rx_bytes",
+	[MCUSPI_CNT_RX_PIGGYBACK] = "rx_piggyback",
+	[MCUSPI_CNT_RX_BAD_FRAMES] = "rx_bad_frames",
+	[MCUSPI_CNT_RX_QUEUE_FULL] = "rx_queue_full",
+	[MCUSPI_CNT_RX_OVERWRITTEN] = "rx_overwritten",
+	[MCUSPI_CNT_RX_FLOW_OFF] = "rx_flow_off",
+	[MCUSPI_CNT_RX_CREDIT_OVERRUN] = "rx_credit_overrun",
+	[MCUSPI_CNT_RX_IDLE] = "rx_idle",
+	[MCUSPI_CNT_RX_BURST_READS] = "rx_burst_reads",
+	[MCUSPI_CNT_RX_WAKEUPS] = "rx_wakeups",
+	[MCUSPI_CNT_RX_LOST] = "rx_lost",
+	[MCUSPI_CNT_RX_DUPLICATES] = "rx_duplicates",
+	[MCUSPI_CNT_RX_RECOVERED] = "rx_recovered",
+	[MCUSPI_CNT_RX_FRAGMENTS] = "rx_fragments",
+	[MCUSPI_CNT_RX_REASSEMBLED] = "rx_reassembled",
+	[MCUSPI_CNT_RX_FRAG_DROPPED] = "rx_frag_dropped",
+	[MCUSPI_CNT_RX_COMPRESSED] = "rx_compressed",
+	[MCUSPI_CNT_RX_DECOMPRESS_ERRORS] = "rx_decompress_errors",
+	[MCUSPI_CNT_SUB_DELIVERED] = "sub_delivered",
+	[MCUSPI_CNT_SUB_DROPPED] = "sub_dropped",
+	[MCUSPI_CNT_SUB_POOL_EMPTY] = "sub_pool_empty",
+	[MCUSPI_CNT_TX_FRAMES] = "tx_frames",
+	[MCUSPI_CNT_TX_BYTES] = "tx_bytes",
+	[MCUSPI_CNT_TX_BATCHES] = "tx_batches",
+	[MCUSPI_CNT_TX_ERRORS] = "tx_errors",
+	[MCUSPI_CNT_TX_QUEUE_FULL] = "tx_queue_full",
+	[MCUSPI_CNT_TX_DEFERRED] = "tx_deferred",
+	[MCUSPI_CNT_TX_STARVED] = "tx_starved",
+	[MCUSPI_CNT_ISR_TX_WAITS] = "isr_tx_waits",
+	[MCUSPI_CNT_TX_RETRANSMITS] = "tx_retransmits",
+	[MCUSPI_CNT_TX_NAK_MISSED] = "tx_nak_missed",
+	[MCUSPI_CNT_TX_CONTROL] = "tx_control",
+	[MCUSPI_CNT_TX_FRAGMENTED] = "tx_fragmented",
+	[MCUSPI_CNT_TX_COMPRESSED] = "tx_compressed",
+	[MCUSPI_CNT_TX_COMPRESS_SAVED] = "tx_compress_saved",
+};
+
+/* log2 histograms of ns */
+enum mcuspi_hist {
+	MCUSPI_HIST_IRQ_TO_QUEUE,	/* interrupt edge to msg stored in receive ring */
+	MCUSPI_HIST_RESIDENCY,		/* msg stored to msg taken by a reader */
+	MCUSPI_HIST_SEND,		/* frame queued by a writer to tx completion */
+	MCUSPI_HIST_NR
+};
+
+static const char * const mcuspi_hist_names[MCUSPI_HIST_NR] = {
+	[MCUSPI_HIST_IRQ_TO_QUEUE] = "irq_to_queue",
+	[MCUSPI_HIST_RESIDENCY] = "queue_residency",
+	[MCUSPI_HIST_SEND] = "send_latency",
+};
+
+#define MCUSPI_HIST_BUCKETS 32 /* bucket i counts [2^i, 2^(i+1)) ns, the last one is open */
+
+/* per receive class, see MCUSPI_MAX_CLASSES */
+enum mcuspi_class_counter {
+	MCUSPI_CLASS_CNT_FRAMES,
+	MCUSPI_CLASS_CNT_QUEUE_FULL,
+	MCUSPI_CLASS_CNT_NR
+};
+
+struct mcuspi_stats {
+	u64 cnt[MCUSPI_CNT_NR];
+	u64 hist[MCUSPI_HIST_NR][MCUSPI_HIST_BUCKETS];
+	u64 class_cnt[MCUSPI_MAX_CLASSES][MCUSPI_CLASS_CNT_NR];
+	u64 class_hist[MCUSPI_MAX_CLASSES][MCUSPI_HIST_BUCKETS]; /* queue residency */
+};
+
+static inline void mcuspi_stat_add(struct mcuspi_stats __percpu *stats, int cnt, u64 val)
+{
+	if (stats) {
+		this_cpu_add(stats->cnt[cnt], val);
+	}
+}
+
+static inline void mcuspi_stat_inc(struct mcuspi_stats __percpu *stats, int cnt)
+{
+	mcuspi_stat_add(stats, cnt, 1);
+}
+
+static inline int mcuspi_hist_bucket(u64 ns)
+{
+	return min_t(int, ilog2(ns | 1), MCUSPI_HIST_BUCKETS - 1);
+}
+
+static inline void mcuspi_hist_add(struct mcuspi_stats __percpu *stats, int hist, u64 ns)
+{
+	if (stats) {
+		this_cpu_inc(stats->hist[hist][mcuspi_hist_bucket(ns)]);
+	}
+}
+
+static inline void mcuspi_stat_class_inc(struct mcuspi_stats __percpu *stats, int class, int cnt)
+{
+	if (stats) {
+		this_cpu_inc(stats->class_cnt[class][cnt]);
+	}
+}
+
+static inline void mcuspi_class_hist_add(struct mcuspi_stats __percpu *stats, int class, u64 ns)
+{
+	if (stats) {
+		this_cpu_inc(stats->class_hist[class][mcuspi_hist_bucket(ns)]);
+	}
+}
+
+static u64 mcuspi_stat_sum(struct mcuspi_stats __percpu *stats, int cnt)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sum += per_cpu_ptr(stats, cpu)->cnt[cnt];
+	}
+	return sum;
+}
 
 #define BIN_ATTR(_name, _mode, _show, _store) \
 struct bin_attribute  bin_attr_##_name = { \
@@ -36,34 +303,204 @@ struct bin_attribute  bin_attr_##_name = { \
 	.write	= _store,						\
 }
 
+/* One frame of the tx queue, buffers are MAX_PACKET_LENGTH bytes */
+struct mcuspi_tx_slot {
+	struct spi_transfer xfer[2];
+	uint8_t * tx_buf;
+	uint8_t * rx_buf;
+	size_t len; /* bytes clocked for this frame */
+	u64 queued_ns; /* ktime when the writer queued it */
+};
+
 /* This structure will represent single device */
 struct mcuspi_dev {
 	struct spi_device * spid;
 	struct miscdevice mcu_spi_miscdevice;
-	struct mcu_message_queue * recv_msg_queue; /* msg buff to store received msgs from ext interrupt*/
+	/* 
+	 * Open files hold a reference, the rings and the tx queue outlive
+	 * remove until the last one is closed. Remove sets dead, file ops
+	 * check it under dead_lock and fail with -ENODEV.
+	 */
+	struct kref kref;
+	spinlock_t dead_lock;
+	bool dead;
+	/* 
+	 * Receive rings, one per class. payload_desc[0] of a frame selects its
+	 * class, 0 is read first, values past the last class go to the last one.
+	 */
+	struct mcu_message_queue * recv_queues[MCUSPI_MAX_CLASSES];
+	int nr_classes;
+	struct mcuspi_class * classes; /* a misc device per class when nr_classes > 1 */
+	/* subscriptions of open files, see mcuspi_sub_deliver */
+	struct list_head subs; /* rcu, changed under subs_lock */
+	struct mutex subs_lock;
+	struct mcuspi_shared_msg * shared_pool; /* MCUSPI_SHARED_POOL msgs, allocated by the first subscriber */
+	struct list_head shared_free;
+	spinlock_t shared_lock;
 	struct mcu_message * send_msg;	/* store the send_msg being processed by userspace*/
 	struct mcu_message * recv_msg;  /* store the recv_msg being processed by userspace*/
 	struct kobject *send_subdir;
 	struct kobject *recv_subdir;
-	struct mutex bus_lock;
-	bool intr_recv_not_comp;
-	uint8_t * unexpected_recv_data_when_send;  
+	wait_queue_head_t recv_wait; /* woken when a msg is stored to any receive ring */
+	struct gpio_desc * int_gpio;
+	int irq; /* of int_gpio or of the spi device */
+	u64 irq_ns; /* ktime of the last interrupt edge */
+	uint8_t * isr_buf; /* mcu_rx_buf_length bytes, frame buffer of mcu_spi_isr */
+	/* 
+	 * tx queue: writers fill slots at tx_tail under tx_lock, the engine sends
+	 * [tx_submit, tx_tail) with spi_async and retires [tx_head, tx_submit)
+	 * in its completion. Indices are free running.
+	 */
+	struct mcuspi_tx_slot * tx_slots;
+	struct spi_message tx_msg; /* the batch in flight */
+	struct mutex tx_lock;
+	spinlock_t tx_spin; /* protects the tx indices and the bus arbiter */
+	uint32_t tx_head;
+	uint32_t tx_submit;
+	uint32_t tx_tail;
+	/* 
+	 * Bus arbiter: the isr thread reads only while no tx batch is in flight.
+	 * rx_pending is set by the edge of "int", or by the isr thread when the
+	 * MCU has the next frame of a burst ready. No batch starts while it is
+	 * set, unless tx has waited for tx_starve_us already.
+	 */
+	int bus_state; /* enum mcuspi_bus_state, under tx_spin */
+	bool rx_pending;
+	u64 tx_defer_ns; /* ktime a batch was first held back for rx, 0 if none */
+	bool tx_stop;
+	wait_queue_head_t tx_wait; /* woken when slots are retired or the bus goes idle */
+	/* 
+	 * With link control the MCU may NAK a retired frame, tx_retx holds the
+	 * indices of the slots to send again at the front of the next batch.
+	 * Writers leave MCUSPI_TX_HISTORY + MCUSPI_TX_BATCH slots behind tx_head
+	 * alone, so a NAK'ed slot is not reused before it has been resent.
+	 */
+	uint32_t tx_retx[MCUSPI_TX_BATCH]; /* under tx_spin */
+	uint32_t tx_retx_nr;
+	uint32_t tx_retx_flight[MCUSPI_TX_BATCH]; /* resent by the batch in flight */
+	uint32_t tx_retx_flight_nr;
+	uint8_t tx_serial; /* serial of the next frame packed, under tx_lock */
+	u32 compress_classes; /* classes whose frames are sent compressed */
+	uint8_t * tx_compress_buf; /* MAX_PAYLOAD_LENGTH bytes, under tx_lock */
+	/* receive sequence, see mcuspi_rx_sequence */
+	spinlock_t rx_seq_lock;
+	int rx_expected; /* serial of the next frame in order, -1 before the first one */
+	DECLARE_BITMAP(rx_missing, MCUSPI_SERIALS); /* serials skipped and not received since */
+	DECLARE_BITMAP(rx_nak, MCUSPI_SERIALS); /* missing serials not NAK'ed yet */
+	int rx_credits; /* frames the MCU may still send, under rx_seq_lock */
+	int rx_credit_low; /* fresh credits are sent at or below this */
+	struct work_struct link_work; /* sends a control frame for a pending NAK or credits */
+	struct work_struct tx_rx_work; /* parses the frames received during a tx batch */
+	/* overflow policy of the receive rings, the ready gpio with block */
+	int overflow; /* enum mcuspi_overflow */
+	struct gpio_desc * ready_gpio;
+	spinlock_t flow_lock;
+	bool rx_flow_off; /* ready is deasserted */
+	struct delayed_work flow_work; /* rechecks the rings for mmap consumers, ready gpio and credits, times out reassembly */
+	/* 
+	 * Reassembly with "dozh,fragments": frag_asm is the msg being
+	 * reassembled, whole ones wait in frag_done for a payload mode read.
+	 */
+	spinlock_t frag_lock;
+	struct mcuspi_frag_msg * frag_asm;
+	struct list_head frag_done;
+	struct list_head frag_free;
+	void * frag_pool; /* MCUSPI_FRAG_BUFS buffers */
+	uint32_t frag_max; /* payload bytes of a buffer, whole frames */
+	u32 inject_rx_errors; /* debugfs, fail the CRC of every Nth good frame */
+	atomic_t rx_inject_count;
+	struct mcuspi_stats __percpu * stats;
+	struct dentry * debugfs;
+	const struct mcuspi_crc_ops * crc; /* frame CRC32 backend chosen at probe */
+	u32 features; /* MCUSPI_FEAT_xxx */
+	u32 head_gap_us; /* idle time between header and body transfer in variable-length mode */
 	char name[8]; /* mcuspiX */
 };
 
+/* /dev/mcuspiX-cN, reads the receive ring of one class only */
+struct mcuspi_class {
+	struct miscdevice miscdevice;
+	struct mcuspi_dev * mcuspi;
+	int class;
+	char name[16];
+};
+
+/* what the driver remembers about a slot of the receive ring */
+struct mcu_message_meta {
+	u64 enqueue_ns; /* ktime it was stored */
+	int serial; /* serial number byte of the frame */
+};
+
 typedef struct mcu_message_queue {
-	struct mcu_message * mcu_msg[MAX_BUFFERED_MSG];
-	int16_t read_msg_idx;
-	int16_t write_msg_idx;
-	int16_t msg_count;
+	/* 
+	 * Producer / consumer ring of mask + 1 contiguous slots. head and
+	 * tail are free running, each is written by one side only and published
+	 * with release/acquire ordering, so producers never wait for a reader.
+	 * Producers (isr thread and tx completion) serialise on write_lock,
+	 * readers on read_lock.
+	 * With drop-oldest a producer that finds the ring full advances head
+	 * itself, producers and readers then hand head on with cmpxchg.
+	 * head and tail live in the control page in front of the slots, the whole
+	 * area can be mmap'ed by userspace (see mcu-spi.h).
+	 */
+	struct mcuspi_ring_ctrl * ctrl;
+	struct mcu_message * slots;
+	size_t ring_size; /* bytes of slots, page aligned */
+	struct mcu_message_meta * meta; /* one entry per slot, kernel only, not mmap'ed */
+	uint32_t mask; /* slot count - 1, ctrl->slot_count is writable by userspace */
+	int class;
+	int overflow; /* enum mcuspi_overflow */
+	struct mcuspi_dev * mcuspi;
+	struct mcuspi_stats __percpu * stats;
+	const char * name; /* of the device, for tracepoints */
+	spinlock_t write_lock;
+	struct mutex read_lock;
+	wait_queue_head_t wait; /* woken when a msg is stored */
 }mcu_message_queue;
 
-/* This structure will save each message that received from MCU */
-typedef struct mcu_message {
-	uint16_t payload_length;
-	uint8_t payload_desc[PAYLOAD_DESC_LENGTH]; 
-	uint8_t * payload;
-}mcu_message;
+/* a received msg shared by the subscribers it matched, one copy for all */
+struct mcuspi_shared_msg {
+	atomic_t ref;
+	struct list_head free; /* in shared_free while unused */
+	u64 enqueue_ns;
+	int serial;
+	struct mcu_message msg;
+};
+
+/* a msg reassembled from fragments, see mcuspi_rx_fragment */
+struct mcuspi_frag_msg {
+	struct list_head node; /* in frag_done or frag_free */
+	u64 start_ns; /* ktime its first fragment came */
+	int last; /* index of the last fragment, -1 until it has come */
+	uint32_t length;
+	DECLARE_BITMAP(got, MCUSPI_MAX_FRAGS); /* fragments received */
+	uint8_t payload_desc[PAYLOAD_DESC_LENGTH];
+	uint8_t payload[]; /* frag_max bytes */
+};
+
+/* subscription of an open file, MCUSPI_IOC_SUBSCRIBE */
+struct mcuspi_sub {
+	struct list_head node; /* in mcuspi->subs */
+	u64 mask[PAYLOAD_DESC_LENGTH / 8];
+	u64 value[PAYLOAD_DESC_LENGTH / 8]; /* already masked */
+	/* ring of msgs, producers push at tail under lock, readers serialise on read_lock */
+	spinlock_t lock;
+	struct mutex read_lock;
+	uint32_t head;
+	uint32_t tail;
+	struct mcuspi_shared_msg * ring[MCUSPI_SUB_DEPTH];
+	wait_queue_head_t wait;
+};
+
+/* This structure will represent one open file of /dev/mcuspiX */
+struct mcuspi_file {
+	struct mcuspi_dev * mcuspi;
+	uint32_t mode; /* MCUSPI_MODE_xxx */
+	struct mcu_message_queue * queue; /* of a class device, NULL reads every class */
+	struct mcuspi_sub * sub; /* set once, freed on release */
+	struct mutex lock; /* serialise users of msg */
+	struct mcu_message msg; /* msg being copied to userspace */
+};
 
 void dev_dump_hex(const void* data, size_t size) {
 	char ascii[17];
@@ -106,326 +543,2003 @@ spi_read_and_write(struct spi_device *spi, void *rxbuf, void *txbuf, size_t len)
 	return spi_sync_transfer(spi, &t, 1);
 }
 
-static inline int
-data_write_to_bus(struct mcuspi_dev *mcuspi, const void *buf, size_t len)
+/* 
+ * Read a variable-length frame from MCU. The header is read with chip select
+ * held, payload_length is taken from it, then exactly payload + CRC is clocked.
+ * Return the frame length on success, -ENODATA if the MCU has nothing to send.
+ *
+ * This takes two spi_messages: the transfers of a message are fixed before it
+ * starts, so the body length read from the header cannot size a transfer of
+ * the same message. cs_change on the last transfer of the head message asks
+ * the controller to keep chip select asserted until the next message, and
+ * spi_bus_lock makes sure that next message is our body, not one for another
+ * device on the bus. cs_change there is only a hint, a controller may still
+ * drop chip select between the two, the MCU keeps its frame across that.
+ */
+static int
+spi_read_frame(struct spi_device *spi, uint8_t *buf, u32 head_gap_us)
 {
-	int ret = 0;
-	/*
-	if (mcuspi->intr_recv_not_comp) {
-		usleep_range(50, 100);
-		while (mcuspi->intr_recv_not_comp) {
-			//dev_info(&mcuspi->spid->dev, 
-			//"%s: wait isr comp\n", mcuspi->name);
-			//msleep_interruptible(10);
-			usleep_range(1000, 2000);
-		}
+	struct spi_message m;
+	struct spi_transfer head = {
+		.rx_buf		= buf,
+		.len		= HEAD_LENGTH,
+		.cs_change	= 1,	/* keep chip selected for the body transfer */
+		.delay		= {
+			.value	= head_gap_us,
+			.unit	= SPI_DELAY_UNIT_USECS,
+		},
+	};
+	struct spi_transfer body = { };
+	int payload_length;
+	int ret;
+
+	spi_bus_lock(spi->master);
+	spi_message_init_with_transfers(&m, &head, 1);
+	ret = spi_sync_locked(spi, &m);
+	if (ret) {
+		goto out;
 	}
-	*/
-	
-	
-	mutex_lock_interruptible(&mcuspi->bus_lock);
-	while (mcuspi->intr_recv_not_comp) {
-		mutex_unlock(&mcuspi->bus_lock);
-		usleep_range(50, 100);
-		mutex_lock_interruptible(&mcuspi->bus_lock);
-	}
-	while (1) {
-		uint8_t *recvbuf = kzalloc(len, GFP_KERNEL);
-		ret = spi_read_and_write(mcuspi->spid, recvbuf, buf, len);
-		if (*recvbuf == 0xAA) {
-			mcuspi->unexpected_recv_data_when_send == recvbuf;
-			while (mcuspi->intr_recv_not_comp) {
-				mutex_unlock(&mcuspi->bus_lock);
-				usleep_range(50, 100);
-				mutex_lock_interruptible(&mcuspi->bus_lock);
-			}
-		} else {
-			kfree(recvbuf);
-			mutex_unlock(&mcuspi->bus_lock);
-			return ret;
-		}
+
+	payload_length = mcuspi_proto_head_length(buf);
+	if (payload_length < 0) {
+		/* no valid header, only release chip select */
+		body.len = 0;
+		ret = payload_length;
+	} else {
+		body.rx_buf = buf + HEAD_LENGTH;
+		body.len = payload_length + VERIFY_LENGTH;
 	}
-	
+	spi_message_init_with_transfers(&m, &body, 1);
+	if (spi_sync_locked(spi, &m) == 0 && ret == 0) {
+		ret = HEAD_LENGTH + payload_length + VERIFY_LENGTH;
+	} else if (ret == 0) {
+		ret = -EIO;
+	}
+out:
+	spi_bus_unlock(spi->master);
+	return ret;
 }
 
-static inline int
-data_read_from_bus(struct mcuspi_dev *mcuspi, const void *buf, size_t len)
+/* 
+ * Bytes clocked on the bus for a frame carrying payload_length bytes. A
+ * frame the MCU sends while we send ours is cut to the length of ours,
+ * without link control nothing would send it again: our frames are then
+ * clocked at full length, the MCU ignores the bytes after our CRC.
+ */
+static inline size_t
+mcu_frame_length(struct mcuspi_dev *mcuspi, uint16_t payload_length)
 {
-	int ret = 0;
-	mutex_lock_interruptible(&mcuspi->bus_lock);
-	if (mcuspi->unexpected_recv_data_when_send == NULL) {
-		ret = spi_read(mcuspi->spid, buf, len);
-	} else {
-		memcpy(buf, mcuspi->unexpected_recv_data_when_send, len);
-		kfree(mcuspi->unexpected_recv_data_when_send);
-		mcuspi->unexpected_recv_data_when_send = NULL;
+	if ((mcuspi->features & MCUSPI_FEAT_VARLEN) && (mcuspi->features & MCUSPI_FEAT_LINK)) {
+		return HEAD_LENGTH + payload_length + VERIFY_LENGTH;
 	}
-	mutex_unlock(&mcuspi->bus_lock);
-	return ret;
+	return MAX_PACKET_LENGTH; //fixed length in PHY.
 }
 
-bool is_mcu_message_queue_full(mcu_message_queue *msg_queue) 
+/* Receive frame buffers, with compression the payload is decompressed behind the frame */
+static inline size_t mcu_rx_buf_length(struct mcuspi_dev *mcuspi)
 {
-	return msg_queue->msg_count >= MAX_BUFFERED_MSG;
+	if (mcuspi->features & MCUSPI_FEAT_COMPRESS) {
+		return MAX_PACKET_LENGTH + MAX_PAYLOAD_LENGTH;
+	}
+	return MAX_PACKET_LENGTH;
 }
 
-bool is_mcu_message_queue_empty(mcu_message_queue *msg_queue) 
+/* 
+ * Frame CRC32 backends. All of them compute crc32_le (IEEE 802.3, reflected),
+ * a frame carries ~crc(0xFFFFFFFF, head + payload). The backend is picked at
+ * probe by the crc_backend module parameter and checked against crc32_le.
+ */
+struct mcuspi_crc_ops {
+	const char * name;
+	bool (*supported)(void);
+	u32 (*update)(u32 crc, const uint8_t *buf, size_t len); /* not crc32, linux/crc32.h has a crc32() macro */
+};
+
+static bool mcuspi_crc_always_supported(void)
 {
-	return msg_queue->msg_count <= 0;
+	return true;
 }
 
-int get_payload_len_in_next_mcu_msg(mcu_message_queue *msg_queue) 
+static u32 mcuspi_crc32_kernel(u32 crc, const uint8_t *buf, size_t len)
 {
-	return msg_queue->mcu_msg[msg_queue->read_msg_idx]->payload_length;
+	return crc32_le(crc, buf, len);
 }
 
-int store_one_mcu_message_to_queue(mcu_message_queue *msg_queue, 
-			uint16_t payload_length, uint8_t *payload_desc, uint8_t *payload)
+/* slice-by-8, shared with the host tools */
+static u32 mcuspi_crc32_table[8][256];
+
+static void mcuspi_crc32_slice8_init(void)
 {
-	//TODO: rewrite it use mcu_message instead of seperated payload_xxx
-	if (msg_queue->msg_count >= MAX_BUFFERED_MSG) {
-		return -ENOSPC;
-	}
+	mcuspi_proto_crc32_slice8_init(mcuspi_crc32_table);
+}
 
-	mcu_message * mcu_msg_in_queue = kzalloc(sizeof(mcu_message), GFP_KERNEL);
-	if (!mcu_msg_in_queue) {
-		return -ENOMEM;
+static u32 mcuspi_crc32_slice8(u32 crc, const uint8_t *buf, size_t len)
+{
+	return mcuspi_proto_crc32_slice8(mcuspi_crc32_table, crc, buf, len);
+}
+
+#if defined(CONFIG_ARM64) || (defined(CONFIG_ARM) && __LINUX_ARM_ARCH__ == 7)
+#define MCUSPI_CRC_ARMV8
+#endif
+
+#ifdef MCUSPI_CRC_ARMV8
+/* 
+ * ARMv8 CRC32 instructions, 8 (arm64) or 4 (arm) bytes per instruction.
+ * The .arch directives only let the assembler accept them, they are executed
+ * only when the cpu reports the CRC32 extension. On arm the directives hold
+ * to the end of the file, the armv7-a the kernel is built for is set again
+ * right after the instruction.
+ */
+#ifdef CONFIG_ARM64
+#define MCUSPI_CRC_ASM(insn) ".arch_extension crc\n" insn " %w0, %w0, %w1"
+#else
+#define MCUSPI_CRC_ASM(insn) ".arch armv8-a\n.arch_extension crc\n" insn " %0, %0, %1\n" \
+			     ".arch armv" __stringify(__LINUX_ARM_ARCH__) "-a"
+#endif
+
+static bool mcuspi_crc_armv8_supported(void)
+{
+#ifdef CONFIG_ARM64
+	return cpu_have_named_feature(CRC32);
+#else
+	return elf_hwcap2 & HWCAP2_CRC32;
+#endif
+}
+
+static u32 mcuspi_crc32_armv8(u32 crc, const uint8_t *buf, size_t len)
+{
+#ifdef CONFIG_ARM64
+	for (; len >= 8; len -= 8, buf += 8) {
+		asm(".arch_extension crc\ncrc32x %w0, %w0, %x1"
+		    : "+r" (crc) : "r" (get_unaligned_le64(buf)));
 	}
-	
-	memcpy(mcu_msg_in_queue->payload_desc, payload_desc, PAYLOAD_DESC_LENGTH);
-	mcu_msg_in_queue->payload = NULL;
-	mcu_msg_in_queue->payload_length = payload_length;
-	if (payload_length > 0) {
-		mcu_msg_in_queue->payload = kzalloc(payload_length, GFP_KERNEL);
-		if (!mcu_msg_in_queue->payload) {
-			kfree(mcu_msg_in_queue);
-			return -ENOMEM;
-		}
-		memcpy(mcu_msg_in_queue->payload, payload, payload_length);
+#endif
+	for (; len >= 4; len -= 4, buf += 4) {
+		asm(MCUSPI_CRC_ASM("crc32w")
+		    : "+r" (crc) : "r" (get_unaligned_le32(buf)));
 	}
-	msg_queue->mcu_msg[msg_queue->write_msg_idx] = mcu_msg_in_queue;
-	(msg_queue->write_msg_idx)++;
-	if ((msg_queue->write_msg_idx) >= MAX_BUFFERED_MSG) {
-		msg_queue->write_msg_idx = 0;
+	while (len--) {
+		asm(MCUSPI_CRC_ASM("crc32b")
+		    : "+r" (crc) : "r" ((u32)*buf++));
 	}
-	(msg_queue->msg_count)++;
-	return 0;
+	return crc;
 }
+#endif
+
+static const struct mcuspi_crc_ops mcuspi_crc_backends[] = {
+	{ "kernel", mcuspi_crc_always_supported, mcuspi_crc32_kernel },
+	{ "slice8", mcuspi_crc_always_supported, mcuspi_crc32_slice8 },
+#ifdef MCUSPI_CRC_ARMV8
+	{ "armv8", mcuspi_crc_armv8_supported, mcuspi_crc32_armv8 },
+#endif
+};
 
-int load_one_mcu_message_from_queue(mcu_message_queue *msg_queue, mcu_message *mcu_msg)
+/* 
+ * Check a backend with the vectors of mcu-spi-crc-vectors.h and against
+ * crc32_le over every length and alignment of a frame head, return the ns it
+ * takes for a full size frame. buf holds mcuspi_crc_vector_pattern.
+ */
+static int mcuspi_crc_selftest(const struct mcuspi_crc_ops *ops, uint8_t *buf, u64 *ns)
 {
-	if (msg_queue->msg_count <= 0) {
-		return -EAGAIN;
+	const struct mcuspi_crc_vector * v;
+	u64 start;
+	int len, off, i;
+
+	for (i = 0; i < ARRAY_SIZE(mcuspi_crc_vectors); i++) {
+		v = &mcuspi_crc_vectors[i];
+		if (~ops->update(0xFFFFFFFF, v->data ? (const uint8_t *)v->data : buf, v->len) != v->crc) {
+			return -EINVAL;
+		}
 	}
-
-	//clean up memory of previous msg
-	struct mcu_message *prev_mcu_msg = msg_queue->mcu_msg[msg_queue->read_msg_idx];
-	if (prev_mcu_msg) {
-		if (prev_mcu_msg->payload_length > 0 && prev_mcu_msg->payload) {
-			//memcpy(payload, mcu_msg->payload, mcu_msg->payload_length);
-			kfree (prev_mcu_msg->payload);
-			prev_mcu_msg->payload = NULL;
+	for (off = 0; off < 8; off++) {
+		for (len = 0; len <= HEAD_LENGTH; len++) {
+			if (ops->update(0xFFFFFFFF, buf + off, len) != crc32_le(0xFFFFFFFF, buf + off, len)) {
+				return -EINVAL;
+			}
 		}
-		//memcpy(payload_desc, mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
-		//*payload_length = mcu_msg->payload_length;
-		kfree(prev_mcu_msg);
-		msg_queue->mcu_msg[msg_queue->read_msg_idx] = NULL;
+	}
+	if (ops->update(0xFFFFFFFF, buf, MAX_PACKET_LENGTH - VERIFY_LENGTH) !=
+	    crc32_le(0xFFFFFFFF, buf, MAX_PACKET_LENGTH - VERIFY_LENGTH)) {
+		return -EINVAL;
 	}
 
-	(msg_queue->read_msg_idx)++; //TODO: check if can add it at every load_msg step.
-	if ((msg_queue->read_msg_idx) >= MAX_BUFFERED_MSG) {
-		msg_queue->read_msg_idx = 0;
+	start = ktime_get_ns();
+	for (i = 0; i < 16; i++) {
+		ops->update(0xFFFFFFFF, buf, MAX_PACKET_LENGTH - VERIFY_LENGTH);
 	}
-	mcu_message * this_mcu_msg = msg_queue->mcu_msg[msg_queue->read_msg_idx];
-	if (!this_mcu_msg) {
-		return -EFAULT; 
+	*ns = (ktime_get_ns() - start) / 16;
+	return 0;
+}
+
+/* pick the crc_backend backend, or the fastest one that passes the self test */
+static const struct mcuspi_crc_ops *mcuspi_select_crc(struct device *dev)
+{
+	const struct mcuspi_crc_ops * ops = &mcuspi_crc_backends[0];
+	const struct mcuspi_crc_ops * best = NULL;
+	bool automatic = !strcmp(crc_backend, "auto");
+	uint8_t * buf;
+	u64 ns, best_ns = U64_MAX;
+	int i;
+
+	DO_ONCE(mcuspi_crc32_slice8_init);
+	buf = kmalloc(MAX_PACKET_LENGTH + 8, GFP_KERNEL);
+	if (!buf) {
+		return ops;
 	}
-	memcpy(mcu_msg->payload_desc, this_mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
-	mcu_msg->payload_length = this_mcu_msg->payload_length;
-	if (this_mcu_msg->payload_length > 0) {
-		if (!this_mcu_msg->payload) {
-			return -EFAULT;
+	mcuspi_crc_vector_pattern(buf, MAX_PACKET_LENGTH + 8);
+
+	for (i = 0; i < ARRAY_SIZE(mcuspi_crc_backends); i++) {
+		if (!automatic && strcmp(crc_backend, mcuspi_crc_backends[i].name)) {
+			continue;
+		}
+		if (!mcuspi_crc_backends[i].supported()) {
+			dev_info(dev, "crc32 backend %s not supported by this cpu\n",
+				 mcuspi_crc_backends[i].name);
+			continue;
+		}
+		if (mcuspi_crc_selftest(&mcuspi_crc_backends[i], buf, &ns)) {
+			dev_err(dev, "crc32 backend %s failed self test\n", mcuspi_crc_backends[i].name);
+			continue;
+		}
+		dev_info(dev, "crc32 backend %s: %llu ns per frame\n", mcuspi_crc_backends[i].name, ns);
+		if (ns < best_ns) {
+			best = &mcuspi_crc_backends[i];
+			best_ns = ns;
 		}
-		memcpy(mcu_msg->payload, this_mcu_msg->payload, this_mcu_msg->payload_length);
-		kfree (this_mcu_msg->payload);
-		this_mcu_msg->payload = NULL;
 	}
-	kfree(this_mcu_msg);
-	msg_queue->mcu_msg[msg_queue->read_msg_idx] = NULL;
+	kfree(buf);
+	return best ? best : ops;
+}
 
-	(msg_queue->msg_count)--;
-	return 0;
+/* frame checksum over len bytes of head + payload */
+static inline u32 mcu_frame_crc(struct mcuspi_dev *mcuspi, const uint8_t *buf, size_t len)
+{
+	return ~mcuspi->crc->update(0xFFFFFFFF, buf, len);
 }
 
-int drop_one_mcu_message_from_queue(mcu_message_queue *msg_queue)
+/* 
+ * Add the transfers of one queued frame to msg, return the last one. The
+ * transfers are set up once by init_mcuspi_tx_queue, only lengths change.
+ * Variable-length frames are clocked as two transfers: the fixed size header
+ * first, so the MCU learns payload_length, then the payload and CRC.
+ */
+static struct spi_transfer *
+mcuspi_tx_add_slot(struct mcuspi_dev *mcuspi, struct mcuspi_tx_slot *slot,
+			struct spi_message *msg)
 {
-	if (msg_queue->msg_count <= 0) {
-		return -EAGAIN;
+	if (!(mcuspi->features & MCUSPI_FEAT_VARLEN)) {
+		slot->xfer[0].len = slot->len;
+		slot->xfer[0].cs_change = 0;
+		spi_message_add_tail(&slot->xfer[0], msg);
+		return &slot->xfer[0];
 	}
+	slot->xfer[1].len = slot->len - HEAD_LENGTH;
+	slot->xfer[1].cs_change = 0;
+	spi_message_add_tail(&slot->xfer[0], msg);
+	spi_message_add_tail(&slot->xfer[1], msg);
+	return &slot->xfer[1];
+}
+
+static void mcuspi_tx_complete(void *context);
 
-	//clean up memory of previous msg
-	struct mcu_message *prev_mcu_msg = msg_queue->mcu_msg[msg_queue->read_msg_idx];
-	if (prev_mcu_msg) {
-		if (prev_mcu_msg->payload_length > 0 && prev_mcu_msg->payload) {
-			//memcpy(payload, mcu_msg->payload, mcu_msg->payload_length);
-			kfree (prev_mcu_msg->payload);
-			prev_mcu_msg->payload = NULL;
+/* 
+ * Chain the frames to resend and up to MCUSPI_TX_BATCH queued frames into
+ * tx_msg. Nothing is started while the bus is not idle, tx is stopped or
+ * an isr read is pending, unless tx has waited tx_starve_us for it already.
+ * Called with tx_spin held, return NULL if there is nothing to send.
+ */
+static struct spi_message *
+mcuspi_tx_build_batch(struct mcuspi_dev *mcuspi, uint32_t *nr)
+{
+	struct spi_message * msg = &mcuspi->tx_msg;
+	u64 now;
+	struct spi_transfer * last = NULL;
+	uint32_t i, n;
+
+	if (mcuspi->bus_state != MCUSPI_BUS_IDLE || mcuspi->tx_stop ||
+	    (mcuspi->tx_submit == mcuspi->tx_tail && !mcuspi->tx_retx_nr)) {
+		return NULL;
+	}
+	/* rx goes first, the isr thread kicks tx once it is done */
+	if (READ_ONCE(mcuspi->rx_pending)) {
+		now = ktime_get_ns();
+		if (!mcuspi->tx_defer_ns) {
+			mcuspi->tx_defer_ns = now;
 		}
-		//memcpy(payload_desc, mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
-		//*payload_length = mcu_msg->payload_length;
-		kfree(prev_mcu_msg);
-		msg_queue->mcu_msg[msg_queue->read_msg_idx] = NULL;
+		if (now - mcuspi->tx_defer_ns < (u64)READ_ONCE(tx_starve_us) * NSEC_PER_USEC) {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_DEFERRED);
+			return NULL;
+		}
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_STARVED);
 	}
+	mcuspi->tx_defer_ns = 0;
 
-	(msg_queue->read_msg_idx)++;
-	if ((msg_queue->read_msg_idx) >= MAX_BUFFERED_MSG) {
-		msg_queue->read_msg_idx = 0;
+	spi_message_init(msg);
+	/* resent frames go first, their slots are retired, see mcuspi_tx_kick */
+	for (i = 0; i < mcuspi->tx_retx_nr; i++) {
+		if (last) {
+			last->cs_change = 1; /* deselect between frames */
+		}
+		last = mcuspi_tx_add_slot(mcuspi,
+				&mcuspi->tx_slots[mcuspi->tx_retx[i] & (MCUSPI_TX_QUEUE_LEN - 1)], msg);
+		mcuspi->tx_retx_flight[i] = mcuspi->tx_retx[i];
 	}
-	mcu_message * mcu_msg = msg_queue->mcu_msg[msg_queue->read_msg_idx];
-	if (!mcu_msg) {
-		return -EFAULT; 
+	mcuspi->tx_retx_flight_nr = mcuspi->tx_retx_nr;
+	mcuspi->tx_retx_nr = 0;
+	for (n = 0; i + n < MCUSPI_TX_BATCH && mcuspi->tx_submit + n != mcuspi->tx_tail; n++) {
+		if (last) {
+			last->cs_change = 1;
+		}
+		last = mcuspi_tx_add_slot(mcuspi,
+				&mcuspi->tx_slots[(mcuspi->tx_submit + n) & (MCUSPI_TX_QUEUE_LEN - 1)], msg);
 	}
-	if (mcu_msg->payload_length > 0) {
-		if (!mcu_msg->payload) {
-			return -EFAULT;
+	msg->complete = mcuspi_tx_complete;
+	msg->context = mcuspi;
+
+	mcuspi->tx_submit += n;
+	mcuspi->bus_state = MCUSPI_BUS_TX;
+	*nr = i + n;
+	return msg;
+}
+
+static void mcuspi_link_refresh(struct mcuspi_dev *mcuspi, uint8_t *buf);
+
+/* start the next batch if the bus is free, may be called from any context */
+static void mcuspi_tx_kick(struct mcuspi_dev *mcuspi)
+{
+	struct spi_message * msg;
+	unsigned long flags;
+	uint32_t nr = 0, i;
+	int ret;
+
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	msg = mcuspi_tx_build_batch(mcuspi, &nr);
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	if (!msg) {
+		return;
+	}
+	/* 
+	 * A resent frame would carry the ack and NAK of its first sending, the
+	 * slots in flight are ours until mcuspi_tx_complete.
+	 */
+	if (mcuspi->features & MCUSPI_FEAT_LINK) {
+		for (i = 0; i < mcuspi->tx_retx_flight_nr; i++) {
+			mcuspi_link_refresh(mcuspi,
+				mcuspi->tx_slots[mcuspi->tx_retx_flight[i] & (MCUSPI_TX_QUEUE_LEN - 1)].tx_buf);
 		}
-		kfree (mcu_msg->payload);
-		mcu_msg->payload = NULL;
 	}
-	kfree(mcu_msg);
-	msg_queue->mcu_msg[msg_queue->read_msg_idx] = NULL;
-	
-	(msg_queue->msg_count)--;
-	return 0;
+
+	/* bus_state keeps other kickers away, spi_async is called unlocked */
+	ret = spi_async(mcuspi->spid, msg);
+	if (ret) {
+		dev_err_ratelimited(&mcuspi->spid->dev, "spi_async failed, ERRNO: %d\n", ret);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_TX_ERRORS, nr);
+		spin_lock_irqsave(&mcuspi->tx_spin, flags);
+		mcuspi->tx_head = mcuspi->tx_submit;
+		mcuspi->tx_retx_flight_nr = 0;
+		mcuspi->bus_state = MCUSPI_BUS_IDLE;
+		spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+		wake_up(&mcuspi->tx_wait);
+	}
 }
 
-int pack_one_mcu_message(mcu_message *mcu_msg, uint8_t *buf)
+static int receive_one_mcu_frame(struct mcuspi_dev *mcuspi, uint8_t *buf, size_t len,
+				 unsigned long *wake);
+static void mcuspi_rx_wake(struct mcuspi_dev *mcuspi, unsigned long wake);
+
+/* retire the batch in flight and start the next one */
+static void mcuspi_tx_finish(struct mcuspi_dev *mcuspi)
 {
-	
-	uint16_t payload_length;
-	static uint8_t serial_no = 0;
-	uint32_t checksum;
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	mcuspi->tx_head = mcuspi->tx_submit;
+	mcuspi->tx_retx_flight_nr = 0;
+	mcuspi->bus_state = MCUSPI_BUS_IDLE;
+	idle = mcuspi->tx_tail == mcuspi->tx_head;
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+
+	wake_up(&mcuspi->tx_wait);
+	mcuspi_tx_kick(mcuspi);
+	/* no queued frame left to carry a pending NAK */
+	if (idle && !bitmap_empty(mcuspi->rx_nak, MCUSPI_SERIALS) && !READ_ONCE(mcuspi->tx_stop)) {
+		schedule_work(&mcuspi->link_work);
+	}
+}
 
-	// pre_head 0xAA + serial no(1 Byte) + custom data descriptor(64 Bytes) + payload length(2 bytes, count by bytes) + payload(0~1024 Bytes) + CRC32
-	
-	buf[0] = 0xAA;
-	buf[PREAMBLE_LENGTH] = serial_no++;
+static struct mcuspi_tx_slot *mcuspi_tx_flight_slot(struct mcuspi_dev *mcuspi, uint32_t i)
+{
+	if (i < mcuspi->tx_retx_flight_nr) {
+		return &mcuspi->tx_slots[mcuspi->tx_retx_flight[i] & (MCUSPI_TX_QUEUE_LEN - 1)];
+	}
+	return &mcuspi->tx_slots[(mcuspi->tx_head + i - mcuspi->tx_retx_flight_nr) & (MCUSPI_TX_QUEUE_LEN - 1)];
+}
 
+/* 
+ * Frames the MCU sent during a batch, parsed here rather than in the spi
+ * completion: CRC, decompression, the copies to the rings and the wakeups
+ * are too much for atomic context. The bus stays busy until the batch is
+ * retired, so the slots are not reused and mcuspi_tx_stop waits for us.
+ */
+static void mcuspi_tx_rx_work(struct work_struct *work)
+{
+	struct mcuspi_dev * mcuspi = container_of(work, struct mcuspi_dev, tx_rx_work);
+	struct mcuspi_tx_slot * slot;
+	unsigned long wake = 0;
+	uint32_t i, n;
+
+	n = mcuspi->tx_retx_flight_nr + mcuspi->tx_submit - mcuspi->tx_head;
+	for (i = 0; i < n; i++) {
+		slot = mcuspi_tx_flight_slot(mcuspi, i);
+		if (slot->rx_buf[0] == MCUSPI_PREAMBLE &&
+		    receive_one_mcu_frame(mcuspi, slot->rx_buf, slot->len, &wake) == 0) {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_PIGGYBACK);
+		}
+	}
+	mcuspi_rx_wake(mcuspi, wake);
+	mcuspi_tx_finish(mcuspi);
+}
 
-	// use little endian to store payload length 
-	 *(uint16_t *)(buf + PAYLOAD_SHIFT - 2) = mcu_msg->payload_length; //check align!
-	//buf[PAYLOAD_SHIFT - 2] = (uint8_t)(mcu_msg->payload_length & 0xFF);
-	//buf[PAYLOAD_SHIFT - 1] = (uint8_t)((mcu_msg->payload_length >> 8) & 0xFF);
+/* 
+ * Completion of a tx batch, called by the spi core in atomic context. The bus
+ * is full duplex, a frame the MCU sent while we were sending is in the rx
+ * buffer of the slot; if there is one the batch is retired by tx_rx_work
+ * once it went to the receive queue like one read by the isr.
+ */
+static void mcuspi_tx_complete(void *context)
+{
+	struct mcuspi_dev * mcuspi = context;
+	struct mcuspi_tx_slot * slot;
+	uint32_t idx, i, n;
+	bool rx = false;
+	u64 now = ktime_get_ns();
+
+	/* [tx_head, tx_submit) is not touched by writers until tx_head moves */
+	if (mcuspi->tx_msg.status) {
+		dev_err_ratelimited(&mcuspi->spid->dev, "spi tx failed, ERRNO: %d\n", mcuspi->tx_msg.status);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_TX_ERRORS,
+				mcuspi->tx_submit - mcuspi->tx_head + mcuspi->tx_retx_flight_nr);
+		mcuspi_tx_finish(mcuspi);
+		return;
+	}
 
-	//for test
-	uint16_t datacount;
-	uint8_t *dataptr = buf + PAYLOAD_SHIFT;
-	uint8_t data = 0;
-	for (datacount = 0 ; datacount < MAX_PAYLOAD_LENGTH; datacount++)
-	{
-			*dataptr++ = data++;
+	mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_BATCHES);
+	mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_TX_RETRANSMITS, mcuspi->tx_retx_flight_nr);
+	for (idx = mcuspi->tx_head; idx != mcuspi->tx_submit; idx++) {
+		slot = &mcuspi->tx_slots[idx & (MCUSPI_TX_QUEUE_LEN - 1)];
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_FRAMES);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_TX_BYTES,
+				get_unaligned_le16(slot->tx_buf + PAYLOAD_SHIFT - 2));
+		mcuspi_hist_add(mcuspi->stats, MCUSPI_HIST_SEND, now - slot->queued_ns);
+		trace_mcuspi_tx_done(mcuspi->name, slot->tx_buf[PREAMBLE_LENGTH],
+				get_unaligned_le16(slot->tx_buf + PAYLOAD_SHIFT - 2),
+				mcuspi->tx_tail - idx - 1);
 	}
-	
-	if (mcu_msg->payload_length > 0) {
-		memcpy(buf + PAYLOAD_SHIFT, mcu_msg->payload, mcu_msg->payload_length);
+	n = mcuspi->tx_retx_flight_nr + mcuspi->tx_submit - mcuspi->tx_head;
+	for (i = 0; i < n && !rx; i++) {
+		rx = mcuspi_tx_flight_slot(mcuspi, i)->rx_buf[0] == MCUSPI_PREAMBLE;
 	}
-	
-	checksum = ~crc32(0xFFFFFFFF, buf, HEAD_LENGTH + mcu_msg->payload_length);
-	*(uint32_t *)(buf + PAYLOAD_SHIFT + mcu_msg->payload_length) = checksum; //check align!
+	if (rx) {
+		queue_work(system_highpri_wq, &mcuspi->tx_rx_work);
+	} else {
+		mcuspi_tx_finish(mcuspi);
+	}
+}
 
+/* 
+ * The MCU NAK'ed the frame of serial, queue its slot to be sent again at the
+ * front of the next batch if it is among the last MCUSPI_TX_HISTORY frames
+ * sent. May be called from any context.
+ */
+static void mcuspi_tx_retransmit(struct mcuspi_dev *mcuspi, uint8_t serial)
+{
+	struct mcuspi_tx_slot * slot;
+	unsigned long flags;
+	uint32_t idx, i;
+	bool queued = false;
+
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	for (idx = mcuspi->tx_submit - 1; mcuspi->tx_submit - idx <= MCUSPI_TX_HISTORY; idx--) {
+		slot = &mcuspi->tx_slots[idx & (MCUSPI_TX_QUEUE_LEN - 1)];
+		if (slot->tx_buf[0] != MCUSPI_PREAMBLE || slot->tx_buf[PREAMBLE_LENGTH] != serial) {
+			continue;
+		}
+		for (i = 0; i < mcuspi->tx_retx_nr && mcuspi->tx_retx[i] != idx; i++)
+			;
+		if (i == mcuspi->tx_retx_nr && i < MCUSPI_TX_BATCH) {
+			mcuspi->tx_retx[mcuspi->tx_retx_nr++] = idx;
+		}
+		queued = i < MCUSPI_TX_BATCH;
+		break;
+	}
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	if (!queued) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_NAK_MISSED);
+		return;
+	}
+	mcuspi_tx_kick(mcuspi);
+}
 
+/* 
+ * Writers lock the tx queue with mcuspi_tx_begin, pack each frame into the
+ * buffer returned by mcuspi_tx_get_slot and queue it with mcuspi_tx_put_slot,
+ * then call mcuspi_tx_end. Frames queued between begin and end are sent in
+ * order with no frame of another writer between them, in batches of up to
+ * MCUSPI_TX_BATCH frames that isr reads may come between.
+ */
+static inline int mcuspi_tx_begin(struct mcuspi_dev *mcuspi)
+{
+	return mutex_lock_interruptible(&mcuspi->tx_lock);
+}
 
-	return 0;
+static inline void mcuspi_tx_end(struct mcuspi_dev *mcuspi)
+{
+	mutex_unlock(&mcuspi->tx_lock);
 }
 
-int init_mcu_message_queue(mcu_message_queue **msg_queue)
+/* frames writers may have queued or in flight */
+static inline uint32_t mcuspi_tx_capacity(struct mcuspi_dev *mcuspi)
 {
-	*msg_queue = kzalloc(sizeof(mcu_message_queue), GFP_KERNEL);
-	if (!msg_queue) {
-		return -ENOMEM;
+	uint32_t len = MCUSPI_TX_QUEUE_LEN;
+
+	if (mcuspi->features & MCUSPI_FEAT_LINK) {
+		len -= MCUSPI_TX_HISTORY + MCUSPI_TX_BATCH; /* see tx_retx */
 	}
-	(*msg_queue)->read_msg_idx = MAX_BUFFERED_MSG - 1;
-	(*msg_queue)->write_msg_idx = 0;
-	(*msg_queue)->msg_count = 0;
-	return 0;
+	return len;
 }
 
-int deinit_mcu_message_queue(mcu_message_queue *msg_queue)
+static inline bool mcuspi_tx_has_room(struct mcuspi_dev *mcuspi, uint32_t nr)
 {
-	if (!msg_queue) {
-		return -EFAULT;
-	}
-	while (!is_mcu_message_queue_empty(msg_queue)) {
-		drop_one_mcu_message_from_queue(msg_queue);
-	}
-	kfree(msg_queue);
-	return 0;
+	return READ_ONCE(mcuspi->tx_tail) - READ_ONCE(mcuspi->tx_head) + nr <= mcuspi_tx_capacity(mcuspi);
 }
 
-int init_mcu_message(mcu_message **msg)
+static inline bool mcuspi_tx_has_space(struct mcuspi_dev *mcuspi)
 {
-	*msg = kzalloc(sizeof(mcu_message), GFP_KERNEL);
-	if (!msg) {
-		return -ENOMEM;
-	}
+	return mcuspi_tx_has_room(mcuspi, 1);
+}
 
-	(*msg)->payload = kzalloc(MAX_PAYLOAD_LENGTH, GFP_KERNEL);
-	if (!(*msg)->payload) {
-		kfree(msg);
-		return -ENOMEM;
+/* wait for a free slot unless nonblock, *frame is its MAX_PACKET_LENGTH bytes buffer */
+static int mcuspi_tx_get_slot(struct mcuspi_dev *mcuspi, bool nonblock, uint8_t **frame)
+{
+	int ret;
+
+	if (!mcuspi_tx_has_space(mcuspi)) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_QUEUE_FULL);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(mcuspi->tx_wait, mcuspi_tx_has_space(mcuspi));
+		if (ret) {
+			return ret;
+		}
 	}
+	*frame = mcuspi->tx_slots[mcuspi->tx_tail & (MCUSPI_TX_QUEUE_LEN - 1)].tx_buf;
 	return 0;
 }
 
-int deinit_mcu_message(mcu_message *msg)
+/* queue the slot returned by mcuspi_tx_get_slot, len bytes are clocked */
+static void mcuspi_tx_put_slot(struct mcuspi_dev *mcuspi, size_t len)
 {
-	if (!msg) {
-		return -EFAULT;
+	struct mcuspi_tx_slot * slot = &mcuspi->tx_slots[mcuspi->tx_tail & (MCUSPI_TX_QUEUE_LEN - 1)];
+	unsigned long flags;
+
+	slot->len = len;
+	slot->queued_ns = ktime_get_ns();
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	mcuspi->tx_tail++;
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	if (trace_mcuspi_tx_packed_enabled()) {
+		trace_mcuspi_tx_packed(mcuspi->name, slot->tx_buf[PREAMBLE_LENGTH],
+				get_unaligned_le16(slot->tx_buf + PAYLOAD_SHIFT - 2),
+				mcuspi->tx_tail - READ_ONCE(mcuspi->tx_head));
 	}
-	kfree(msg->payload);
-	kfree(msg);
-	return 0;
+	mcuspi_tx_kick(mcuspi);
 }
 
+/* stop starting new batches and wait for the one in flight */
+static void mcuspi_tx_stop(struct mcuspi_dev *mcuspi)
+{
+	unsigned long flags;
 
-/* User is reading data from /dev/mcuspiX */
-static ssize_t mcuspi_read_file(struct file *file, char __user *userbuf,
-                               size_t count, loff_t *ppos)
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	mcuspi->tx_stop = true;
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	wait_event(mcuspi->tx_wait, READ_ONCE(mcuspi->bus_state) != MCUSPI_BUS_TX);
+}
+
+int init_mcuspi_tx_queue(struct mcuspi_dev *mcuspi)
 {
-	int expval, size;
-	//char *recvbuf;
-	struct mcuspi_dev * mcuspi;
-	struct mcu_message * mcu_msg = NULL;
-	struct mcu_message_queue * mcu_msg_queue = NULL;
-	int offset = 0;
-	int ret = 0;
+	struct mcuspi_tx_slot * slot;
+	int i;
 
+	BUILD_BUG_ON(MCUSPI_TX_QUEUE_LEN & (MCUSPI_TX_QUEUE_LEN - 1));
+	BUILD_BUG_ON(MCUSPI_TX_HISTORY + 2 * MCUSPI_TX_BATCH > MCUSPI_TX_QUEUE_LEN);
 
-	/* calc mcuspi addr by miscdevice addr. miscdevice addr fill into
-	 * file->private_data by misc_open()*/
-	mcuspi = container_of(file->private_data, 
-			     struct mcuspi_dev, 
-			     mcu_spi_miscdevice);
-	mcu_msg = mcuspi->send_msg;
-	mcu_msg_queue = mcuspi->recv_msg_queue;
-	/*
-	dev_info(&mcuspi->spid->dev, 
-		 "mcuspi_read_file entered on %s\n", mcuspi->name);
+	mcuspi->tx_slots = kcalloc(MCUSPI_TX_QUEUE_LEN, sizeof(*mcuspi->tx_slots), GFP_KERNEL);
+	if (!mcuspi->tx_slots) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < MCUSPI_TX_QUEUE_LEN; i++) {
+		slot = &mcuspi->tx_slots[i];
+		/* 
+		 * kzalloc data is ARCH_KMALLOC_MINALIGN (cacheline) aligned
+		 * and the slack behind it is unused, the spi core can map it for
+		 * DMA without sharing a cacheline with other data.
 		 */
-
-	if (!mcu_msg || !mcu_msg_queue) {
-		dev_info(&mcuspi->spid->dev, 
-		    "mcu_msg: %08x, mcu_msg_queue: %08x\n", mcu_msg, mcu_msg_queue);
-		return -EFAULT; 
+		slot->tx_buf = kzalloc(MAX_PACKET_LENGTH, GFP_KERNEL);
+		slot->rx_buf = kzalloc(mcu_rx_buf_length(mcuspi), GFP_KERNEL);
+		if (!slot->tx_buf || !slot->rx_buf) {
+			return -ENOMEM;
+		}
+		slot->xfer[0].tx_buf = slot->tx_buf;
+		slot->xfer[0].rx_buf = slot->rx_buf;
+		if (mcuspi->features & MCUSPI_FEAT_VARLEN) {
+			slot->xfer[0].len = HEAD_LENGTH;
+			slot->xfer[0].delay.value = mcuspi->head_gap_us;
+			slot->xfer[0].delay.unit = SPI_DELAY_UNIT_USECS;
+			slot->xfer[1].tx_buf = slot->tx_buf + HEAD_LENGTH;
+			slot->xfer[1].rx_buf = slot->rx_buf + HEAD_LENGTH;
+		}
 	}
+	mutex_init(&mcuspi->tx_lock);
+	spin_lock_init(&mcuspi->tx_spin);
+	init_waitqueue_head(&mcuspi->tx_wait);
+	return 0;
+}
 
-	ret |= load_one_mcu_message_from_queue(mcu_msg_queue, mcu_msg);
-	if (ret < 0) {
-		dev_info(&mcuspi->spid->dev, 
-			"load_one_mcu_message_from_queue Failed with %d\n", ret);
-		return -EFAULT;
+void deinit_mcuspi_tx_queue(struct mcuspi_dev *mcuspi)
+{
+	int i;
+
+	for (i = 0; mcuspi->tx_slots && i < MCUSPI_TX_QUEUE_LEN; i++) {
+		kfree(mcuspi->tx_slots[i].tx_buf);
+		kfree(mcuspi->tx_slots[i].rx_buf);
 	}
-	//recvbuf = kzalloc(MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+	kfree(mcuspi->tx_slots);
+}
+
+/* return the bytes read into buf */
+static inline int
+data_read_from_bus(struct mcuspi_dev *mcuspi, const void *buf, size_t len)
+{
+	int ret = 0;
+	/* the caller owns the bus, see mcuspi_bus_rx_begin */
+	if (mcuspi->features & MCUSPI_FEAT_VARLEN) {
+		ret = spi_read_frame(mcuspi->spid, (uint8_t *)buf, mcuspi->head_gap_us);
+	} else {
+		ret = spi_read(mcuspi->spid, buf, len);
+		ret = ret ? ret : len;
+	}
+	return ret;
+}
+
+bool is_mcu_message_queue_full(mcu_message_queue *msg_queue) 
+{
+	return READ_ONCE(msg_queue->ctrl->tail) - READ_ONCE(msg_queue->ctrl->head) > msg_queue->mask;
+}
+
+bool is_mcu_message_queue_empty(mcu_message_queue *msg_queue) 
+{
+	return READ_ONCE(msg_queue->ctrl->tail) == READ_ONCE(msg_queue->ctrl->head);
+}
+
+int get_mcu_message_count_in_queue(mcu_message_queue *msg_queue)
+{
+	return READ_ONCE(msg_queue->ctrl->tail) - READ_ONCE(msg_queue->ctrl->head);
+}
+
+/* caller is the consumer, the queue must not be empty */
+int get_payload_len_in_next_mcu_msg(mcu_message_queue *msg_queue) 
+{
+	uint32_t head = msg_queue->ctrl->head;
+
+	return msg_queue->slots[head & msg_queue->mask].payload_length;
+}
+
+/* producer side, called from the isr thread and the tx completion */
+int store_one_mcu_message_to_queue(mcu_message_queue *msg_queue, int serial,
+			uint16_t payload_length, const uint8_t *payload_desc, const uint8_t *payload)
+{
+	//TODO: rewrite it use mcu_message instead of seperated payload_xxx
+	uint32_t tail;
+	struct mcu_message * mcu_msg_in_queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(&msg_queue->write_lock, flags);
+	tail = msg_queue->ctrl->tail;
+	/* pairs with the release of head, slot is no longer read by consumer */
+	if (mcuspi_ring_full(&msg_queue->ctrl->head, tail, msg_queue->mask)) {
+		if (msg_queue->overflow != MCUSPI_OVERFLOW_DROP_OLDEST) {
+			spin_unlock_irqrestore(&msg_queue->write_lock, flags);
+			return -ENOSPC;
+		}
+		/* 
+		 * take the oldest slot, unless a reader has just released it.
+		 * A reader copying it fails its cmpxchg and takes the next one.
+		 */
+		if (cmpxchg(&msg_queue->ctrl->head, tail - msg_queue->mask - 1,
+			    tail - msg_queue->mask) == tail - msg_queue->mask - 1) {
+			mcuspi_stat_inc(msg_queue->stats, MCUSPI_CNT_RX_OVERWRITTEN);
+		}
+	}
+
+	mcu_msg_in_queue = &msg_queue->slots[tail & msg_queue->mask];
+	mcuspi_ring_fill(mcu_msg_in_queue, payload_desc, payload, payload_length);
+	msg_queue->meta[tail & msg_queue->mask].enqueue_ns = ktime_get_ns();
+	msg_queue->meta[tail & msg_queue->mask].serial = serial;
+	/* publish the slot content before the new tail */
+	mcuspi_ring_publish(&msg_queue->ctrl->tail, tail + 1);
+	spin_unlock_irqrestore(&msg_queue->write_lock, flags);
+	if (trace_mcuspi_enqueued_enabled()) {
+		trace_mcuspi_enqueued(msg_queue->name, serial, payload_length,
+				tail + 1 - READ_ONCE(msg_queue->ctrl->head));
+	}
+	return 0;
+}
+
+static struct mcuspi_shared_msg *mcuspi_shared_get(struct mcuspi_dev *mcuspi)
+{
+	struct mcuspi_shared_msg * shared = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mcuspi->shared_lock, flags);
+	if (!list_empty(&mcuspi->shared_free)) {
+		shared = list_first_entry(&mcuspi->shared_free, struct mcuspi_shared_msg, free);
+		list_del(&shared->free);
+	}
+	spin_unlock_irqrestore(&mcuspi->shared_lock, flags);
+	if (shared) {
+		atomic_set(&shared->ref, 1);
+	}
+	return shared;
+}
+
+static void mcuspi_shared_put(struct mcuspi_dev *mcuspi, struct mcuspi_shared_msg *shared)
+{
+	unsigned long flags;
+
+	if (atomic_dec_and_test(&shared->ref)) {
+		spin_lock_irqsave(&mcuspi->shared_lock, flags);
+		list_add(&shared->free, &mcuspi->shared_free);
+		spin_unlock_irqrestore(&mcuspi->shared_lock, flags);
+	}
+}
+
+static inline bool mcuspi_sub_match(const struct mcuspi_sub *sub, const uint8_t *payload_desc)
+{
+	int i;
+
+	for (i = 0; i < PAYLOAD_DESC_LENGTH / 8; i++) {
+		if ((get_unaligned((const u64 *)payload_desc + i) & sub->mask[i]) != sub->value[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* 
+ * Producer side, hand a msg to every subscriber whose filter matches it. The
+ * msg is copied once to a buffer of the shared pool, each subscriber ring
+ * holds a reference to it. Return the number of subscribers that matched,
+ * 0 sends the msg to the receive rings.
+ */
+static int mcuspi_sub_deliver(struct mcuspi_dev *mcuspi, int serial, uint16_t payload_length,
+			const uint8_t *payload_desc, const uint8_t *payload)
+{
+	struct mcuspi_shared_msg * shared = NULL;
+	struct mcuspi_sub * sub;
+	unsigned long flags;
+	uint32_t depth = 0;
+	int matched = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(sub, &mcuspi->subs, node) {
+		if (!mcuspi_sub_match(sub, payload_desc)) {
+			continue;
+		}
+		matched++;
+		if (!shared) {
+			shared = mcuspi_shared_get(mcuspi);
+			if (!shared) {
+				mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_SUB_POOL_EMPTY);
+				break;
+			}
+			memcpy(shared->msg.payload_desc, payload_desc, PAYLOAD_DESC_LENGTH);
+			shared->msg.payload_length = payload_length;
+			memcpy(shared->msg.payload, payload, payload_length);
+			shared->enqueue_ns = ktime_get_ns();
+			shared->serial = serial;
+		}
+		spin_lock_irqsave(&sub->lock, flags);
+		if (sub->tail - sub->head < MCUSPI_SUB_DEPTH) {
+			atomic_inc(&shared->ref);
+			sub->ring[sub->tail++ & (MCUSPI_SUB_DEPTH - 1)] = shared;
+			depth = sub->tail - sub->head;
+		} else {
+			depth = 0;
+		}
+		spin_unlock_irqrestore(&sub->lock, flags);
+		if (!depth) {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_SUB_DROPPED);
+			continue;
+		}
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_SUB_DELIVERED);
+		trace_mcuspi_enqueued(mcuspi->name, serial, payload_length, depth);
+		wake_up_interruptible(&sub->wait);
+	}
+	rcu_read_unlock();
+	if (shared) {
+		mcuspi_shared_put(mcuspi, shared);
+	}
+	return matched;
+}
+
+/* 
+ * Check a frame clocked in from the MCU, len is the bytes received. Return
+ * payload_length, -ENODATA if the MCU had nothing to send or -EBADMSG if the
+ * frame is cut short or fails the CRC.
+ */
+static int unpack_one_mcu_frame(struct mcuspi_dev *mcuspi, const uint8_t *buf, size_t len)
+{
+	int payload_length;
+
+	payload_length = mcuspi_proto_payload_length(buf, len);
+	if (payload_length < 0) {
+		return payload_length;
+	}
+	if (mcu_frame_crc(mcuspi, buf, HEAD_LENGTH + payload_length) !=
+	    mcuspi_proto_get_crc(buf, payload_length)) {
+		return -EBADMSG;
+	}
+	return payload_length;
+}
+
+/* 
+ * Check the serial of a good frame against the one expected. Serials up to
+ * half the serial space ahead are taken as frames lost in between, they are
+ * remembered in rx_missing until they show up or the serials come round
+ * again. Anything else behind is a duplicate. Return -EALREADY for a
+ * duplicate that has to be dropped, that is with link control only.
+ */
+static int mcuspi_rx_sequence(struct mcuspi_dev *mcuspi, uint8_t serial)
+{
+	unsigned long flags;
+	uint8_t s;
+	bool lost = false;
+	int ret = 0;
+
+	spin_lock_irqsave(&mcuspi->rx_seq_lock, flags);
+	if (mcuspi->rx_expected >= 0 && serial != mcuspi->rx_expected) {
+		if ((uint8_t)(serial - mcuspi->rx_expected) < MCUSPI_SERIALS / 2) {
+			for (s = mcuspi->rx_expected; s != serial; s++) {
+				__set_bit(s, mcuspi->rx_missing);
+				__set_bit(s, mcuspi->rx_nak);
+				__clear_bit((uint8_t)(s + MCUSPI_SERIALS / 2), mcuspi->rx_missing);
+				__clear_bit((uint8_t)(s + MCUSPI_SERIALS / 2), mcuspi->rx_nak);
+			}
+			mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_LOST,
+					(uint8_t)(serial - mcuspi->rx_expected));
+			lost = true;
+		} else if (__test_and_clear_bit(serial, mcuspi->rx_missing)) {
+			__clear_bit(serial, mcuspi->rx_nak);
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_RECOVERED);
+			goto out; /* a late frame does not move the sequence */
+		} else {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_DUPLICATES);
+			ret = mcuspi->features & MCUSPI_FEAT_LINK ? -EALREADY : 0;
+			goto out;
+		}
+	}
+	/* a serial half the space ahead is left from the previous round */
+	__clear_bit((uint8_t)(serial + MCUSPI_SERIALS / 2), mcuspi->rx_missing);
+	__clear_bit((uint8_t)(serial + MCUSPI_SERIALS / 2), mcuspi->rx_nak);
+	/* frames skipped have used up their credits as well */
+	mcuspi->rx_credits -= mcuspi->rx_expected >= 0 ? (uint8_t)(serial - mcuspi->rx_expected) + 1 : 1;
+	if (mcuspi->rx_credits < 0) {
+		if (mcuspi->features & MCUSPI_FEAT_CREDITS) {
+			mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_CREDIT_OVERRUN, -mcuspi->rx_credits);
+		}
+		mcuspi->rx_credits = 0;
+	}
+	mcuspi->rx_expected = (uint8_t)(serial + 1);
+out:
+	spin_unlock_irqrestore(&mcuspi->rx_seq_lock, flags);
+	if (lost && (mcuspi->features & MCUSPI_FEAT_LINK) && !READ_ONCE(mcuspi->tx_stop)) {
+		schedule_work(&mcuspi->link_work);
+	}
+	return ret;
+}
+
+/* 
+ * Credits to give the MCU, the free slots of the fullest receive ring less
+ * the frames that may be between sequence check and store. Subscribers are
+ * not counted, a frame they take leaves the rings alone.
+ */
+static int mcuspi_rx_credits(struct mcuspi_dev *mcuspi)
+{
+	mcu_message_queue * msg_queue;
+	int i, used, credits = MCUSPI_SERIALS / 2 - 1;
+
+	for (i = 0; i < mcuspi->nr_classes; i++) {
+		msg_queue = mcuspi->recv_queues[i];
+		used = min_t(uint32_t, READ_ONCE(msg_queue->ctrl->tail) - READ_ONCE(msg_queue->ctrl->head),
+			     msg_queue->mask + 1);
+		credits = min_t(int, credits, msg_queue->mask + 1 - used - MCUSPI_CREDIT_SLACK);
+	}
+	return max(credits, 0);
+}
+
+/* 
+ * The MCU is about to run out of credits: send it fresh ones in a control
+ * frame once the rings have room, until then poll for room, readers of an
+ * mmap'ed ring do not call in. Called after a store and after a release.
+ */
+static void mcuspi_rx_credit_update(struct mcuspi_dev *mcuspi)
+{
+	int credits;
+
+	if (!(mcuspi->features & MCUSPI_FEAT_CREDITS) || READ_ONCE(mcuspi->tx_stop)) {
+		return;
+	}
+	credits = READ_ONCE(mcuspi->rx_credits);
+	if (credits > mcuspi->rx_credit_low) {
+		return;
+	}
+	if (mcuspi_rx_credits(mcuspi) >= credits + mcuspi->rx_credit_low) {
+		schedule_work(&mcuspi->link_work);
+	} else {
+		schedule_delayed_work(&mcuspi->flow_work, msecs_to_jiffies(MCUSPI_FLOW_POLL_MS));
+	}
+}
+
+/* 
+ * Block policy: the ready gpio tells the MCU it may send. It drops when a
+ * receive ring is down to MCUSPI_READY_MARGIN free slots (a quarter of a
+ * small ring) and rises once every ring has twice that, the MCU is expected
+ * to finish the frame it is sending. Called by producers after a store and
+ * by readers after a release while the MCU is held off.
+ */
+static void mcuspi_rx_flow_update(struct mcuspi_dev *mcuspi)
+{
+	mcu_message_queue * msg_queue;
+	uint32_t used, low;
+	bool hold = false, release = true;
+	unsigned long flags;
+	int i;
+
+	if (mcuspi->overflow != MCUSPI_OVERFLOW_BLOCK) {
+		return;
+	}
+	spin_lock_irqsave(&mcuspi->flow_lock, flags);
+	for (i = 0; i < mcuspi->nr_classes; i++) {
+		msg_queue = mcuspi->recv_queues[i];
+		/* head may be written by an mmap consumer, do not trust it */
+		used = min_t(uint32_t, READ_ONCE(msg_queue->ctrl->tail) - READ_ONCE(msg_queue->ctrl->head),
+			     msg_queue->mask + 1);
+		low = min_t(uint32_t, MCUSPI_READY_MARGIN, (msg_queue->mask + 1) / 4);
+		if (msg_queue->mask + 1 - used <= low) {
+			hold = true;
+		}
+		if (msg_queue->mask + 1 - used <= 2 * low) {
+			release = false;
+		}
+	}
+	if (hold && !mcuspi->rx_flow_off) {
+		gpiod_set_value(mcuspi->ready_gpio, 0);
+		WRITE_ONCE(mcuspi->rx_flow_off, true);
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_FLOW_OFF);
+		if (!READ_ONCE(mcuspi->tx_stop)) {
+			schedule_delayed_work(&mcuspi->flow_work, msecs_to_jiffies(MCUSPI_FLOW_POLL_MS));
+		}
+	} else if (release && mcuspi->rx_flow_off) {
+		gpiod_set_value(mcuspi->ready_gpio, 1);
+		WRITE_ONCE(mcuspi->rx_flow_off, false);
+	}
+	spin_unlock_irqrestore(&mcuspi->flow_lock, flags);
+}
+
+/* 
+ * Drop the msg being reassembled once rx_frag_timeout_ms have passed since
+ * its first fragment, rather than when the next fragment comes. Return the
+ * jiffies until it times out, 0 if none is left.
+ */
+static unsigned long mcuspi_frag_expire(struct mcuspi_dev *mcuspi)
+{
+	struct mcuspi_frag_msg * msg;
+	u64 timeout = (u64)rx_frag_timeout_ms * NSEC_PER_MSEC;
+	u64 now = ktime_get_ns();
+	unsigned long left = 0;
+	unsigned long flags;
+	int dropped = 0;
+
+	spin_lock_irqsave(&mcuspi->frag_lock, flags);
+	msg = mcuspi->frag_asm;
+	if (msg && now - msg->start_ns > timeout) {
+		dropped = bitmap_weight(msg->got, MCUSPI_MAX_FRAGS);
+		list_add(&msg->node, &mcuspi->frag_free);
+		mcuspi->frag_asm = NULL;
+	} else if (msg) {
+		left = nsecs_to_jiffies(msg->start_ns + timeout - now) + 1;
+	}
+	spin_unlock_irqrestore(&mcuspi->frag_lock, flags);
+	if (dropped) {
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_FRAG_DROPPED, dropped);
+	}
+	return left;
+}
+
+/* 
+ * Readers of an mmap'ed ring do not call in, poll while the MCU is held off.
+ * Also times out the msg being reassembled.
+ */
+static void mcuspi_flow_work(struct work_struct *work)
+{
+	struct mcuspi_dev * mcuspi = container_of(to_delayed_work(work), struct mcuspi_dev, flow_work);
+	unsigned long frag_left = 0;
+
+	mcuspi_rx_credit_update(mcuspi);
+	mcuspi_rx_flow_update(mcuspi);
+	if (mcuspi->features & MCUSPI_FEAT_FRAG) {
+		frag_left = mcuspi_frag_expire(mcuspi);
+	}
+	if (READ_ONCE(mcuspi->tx_stop)) {
+		return;
+	}
+	if (READ_ONCE(mcuspi->rx_flow_off)) {
+		schedule_delayed_work(&mcuspi->flow_work, msecs_to_jiffies(MCUSPI_FLOW_POLL_MS));
+	} else if (frag_left) {
+		schedule_delayed_work(&mcuspi->flow_work, frag_left);
+	}
+}
+
+/* wake the readers of the classes in wake and of /dev/mcuspiX */
+static void mcuspi_rx_wake(struct mcuspi_dev *mcuspi, unsigned long wake)
+{
+	int class;
+
+	if (!wake) {
+		return;
+	}
+	for_each_set_bit(class, &wake, MCUSPI_MAX_CLASSES) {
+		wake_up_interruptible(&mcuspi->recv_queues[class]->wait);
+	}
+	wake_up_interruptible(&mcuspi->recv_wait);
+	mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_WAKEUPS);
+}
+
+/* 
+ * Reassemble a fragment of a msg, the msg is queued to frag_done once every
+ * fragment up to the last one has come. Lost fragments are resent out of
+ * order, so each one is put in place by its index. A fragment whose index
+ * has come already, or coming rx_frag_timeout_ms after the first one, starts
+ * a new msg. A fragment that does not fit the msg drops it.
+ */
+static void mcuspi_rx_fragment(struct mcuspi_dev *mcuspi, const struct mcuspi_link_ctrl *link,
+			const uint8_t *payload_desc, const uint8_t *payload, uint16_t payload_length)
+{
+	struct mcuspi_frag_msg * msg;
+	uint32_t offset = link->frag * MAX_PAYLOAD_LENGTH;
+	bool end = link->flags & MCUSPI_LINK_FRAG_END;
+	u64 now = ktime_get_ns();
+	unsigned long flags;
+	int dropped = 0;
+	bool done = false;
+
+	mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_FRAGMENTS);
+	spin_lock_irqsave(&mcuspi->frag_lock, flags);
+	msg = mcuspi->frag_asm;
+	if (msg && (test_bit(link->frag, msg->got) ||
+		    now - msg->start_ns > (u64)rx_frag_timeout_ms * NSEC_PER_MSEC)) {
+		dropped += bitmap_weight(msg->got, MCUSPI_MAX_FRAGS);
+		list_add(&msg->node, &mcuspi->frag_free);
+		mcuspi->frag_asm = msg = NULL;
+	}
+	if (!msg) {
+		if (list_empty(&mcuspi->frag_free)) {
+			dropped++;
+			goto out;
+		}
+		msg = list_first_entry(&mcuspi->frag_free, struct mcuspi_frag_msg, node);
+		list_del(&msg->node);
+		msg->start_ns = now;
+		msg->last = -1;
+		bitmap_zero(msg->got, MCUSPI_MAX_FRAGS);
+		mcuspi->frag_asm = msg;
+		/* flow_work drops it if the rest does not come */
+		if (!READ_ONCE(mcuspi->tx_stop)) {
+			schedule_delayed_work(&mcuspi->flow_work,
+					msecs_to_jiffies(rx_frag_timeout_ms) + 1);
+		}
+	}
+	/* only the last fragment may be short, nothing may follow it */
+	if ((!end && payload_length != MAX_PAYLOAD_LENGTH) ||
+	    offset + payload_length > mcuspi->frag_max ||
+	    (msg->last >= 0 && (end || link->frag > msg->last)) ||
+	    (end && find_next_bit(msg->got, MCUSPI_MAX_FRAGS, link->frag + 1) < MCUSPI_MAX_FRAGS)) {
+		dropped += bitmap_weight(msg->got, MCUSPI_MAX_FRAGS) + 1;
+		list_add(&msg->node, &mcuspi->frag_free);
+		mcuspi->frag_asm = NULL;
+		goto out;
+	}
+	memcpy(msg->payload + offset, payload, payload_length);
+	if (link->frag == 0) {
+		memcpy(msg->payload_desc, payload_desc, PAYLOAD_DESC_LENGTH);
+	}
+	__set_bit(link->frag, msg->got);
+	if (end) {
+		msg->last = link->frag;
+		msg->length = offset + payload_length;
+	}
+	if (msg->last >= 0 && bitmap_weight(msg->got, MCUSPI_MAX_FRAGS) == msg->last + 1) {
+		list_add_tail(&msg->node, &mcuspi->frag_done);
+		mcuspi->frag_asm = NULL;
+		done = true;
+	}
+out:
+	spin_unlock_irqrestore(&mcuspi->frag_lock, flags);
+	if (dropped) {
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_FRAG_DROPPED, dropped);
+	}
+	if (done) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_REASSEMBLED);
+		wake_up_interruptible(&mcuspi->recv_wait);
+	}
+}
+
+/* 
+ * Queue a frame read by the isr or clocked in along with a tx frame. With
+ * wake the readers are not woken, the class stored to is added to it. buf
+ * is mcu_rx_buf_length bytes, a compressed payload is decompressed behind
+ * the frame.
+ */
+static int receive_one_mcu_frame(struct mcuspi_dev *mcuspi, uint8_t *buf, size_t len,
+				 unsigned long *wake)
+{
+	const struct mcuspi_link_ctrl * link;
+	struct mcu_message_queue * queue;
+	const uint8_t * payload = buf + PAYLOAD_SHIFT;
+	int payload_length;
+	u32 inject;
+	int ret;
+
+	payload_length = unpack_one_mcu_frame(mcuspi, buf, len);
+	inject = READ_ONCE(mcuspi->inject_rx_errors); /* debugfs may zero it meanwhile */
+	if (payload_length >= 0 && inject && atomic_inc_return(&mcuspi->rx_inject_count) % inject == 0) {
+		payload_length = -EBADMSG;
+	}
+	if (payload_length != -ENODATA) {
+		trace_mcuspi_crc_checked(mcuspi->name, buf[PREAMBLE_LENGTH],
+				get_unaligned_le16(buf + PAYLOAD_SHIFT - 2), min(payload_length, 0));
+	}
+	if (payload_length < 0) {
+		if (payload_length == -EBADMSG) {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_BAD_FRAMES);
+		}
+		return payload_length;
+	}
+	link = (const void *)(buf + PREAMBLE_LENGTH + SERIAL_NO_LENGTH + MCUSPI_LINK_CTRL_OFFSET);
+	if ((mcuspi->features & MCUSPI_FEAT_LINK) && (link->flags & MCUSPI_LINK_NAK)) {
+		mcuspi_tx_retransmit(mcuspi, link->nak);
+	}
+	ret = mcuspi_rx_sequence(mcuspi, buf[PREAMBLE_LENGTH]);
+	if (ret) {
+		return ret;
+	}
+	if ((mcuspi->features & MCUSPI_FEAT_LINK) && (link->flags & MCUSPI_LINK_CONTROL)) {
+		return 0;
+	}
+	if ((mcuspi->features & MCUSPI_FEAT_COMPRESS) && (link->flags & MCUSPI_LINK_COMPRESSED)) {
+		payload_length = mcuspi_proto_rle_decode(buf + MAX_PACKET_LENGTH, MAX_PAYLOAD_LENGTH,
+				payload, payload_length);
+		if (payload_length < 0) {
+			mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_DECOMPRESS_ERRORS);
+			return payload_length;
+		}
+		payload = buf + MAX_PACKET_LENGTH;
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_COMPRESSED);
+	}
+	/* fragments skip subscribers and rings, the credits they used are given back */
+	if ((mcuspi->features & MCUSPI_FEAT_FRAG) && (link->flags & MCUSPI_LINK_FRAG)) {
+		mcuspi_rx_fragment(mcuspi, link, buf + MCUSPI_DESC_OFFSET, payload, payload_length);
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_FRAMES);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_BYTES, payload_length);
+		mcuspi_rx_credit_update(mcuspi);
+		return 0;
+	}
+	if (!list_empty(&mcuspi->subs) &&
+	    mcuspi_sub_deliver(mcuspi, buf[PREAMBLE_LENGTH], payload_length,
+			buf + PREAMBLE_LENGTH + SERIAL_NO_LENGTH, payload)) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_FRAMES);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_BYTES, payload_length);
+		return 0;
+	}
+	/* payload_desc[0] selects the class */
+	queue = mcuspi->recv_queues[min_t(int, buf[PREAMBLE_LENGTH + SERIAL_NO_LENGTH],
+				mcuspi->nr_classes - 1)];
+	ret = store_one_mcu_message_to_queue(queue, buf[PREAMBLE_LENGTH],
+			payload_length, buf + PREAMBLE_LENGTH + SERIAL_NO_LENGTH, payload);
+	if (ret == 0) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_FRAMES);
+		mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_RX_BYTES, payload_length);
+		mcuspi_stat_class_inc(mcuspi->stats, queue->class, MCUSPI_CLASS_CNT_FRAMES);
+		if (wake) {
+			__set_bit(queue->class, wake);
+		} else {
+			mcuspi_rx_wake(mcuspi, BIT(queue->class));
+		}
+	} else if (ret == -ENOSPC) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_QUEUE_FULL);
+		mcuspi_stat_class_inc(mcuspi->stats, queue->class, MCUSPI_CLASS_CNT_QUEUE_FULL);
+	}
+	mcuspi_rx_flow_update(mcuspi);
+	mcuspi_rx_credit_update(mcuspi);
+	return ret;
+}
+
+/* 
+ * Consumer side, hand the slot of index head back to the producers once it
+ * has been copied. With drop-oldest a producer may have taken the slot from
+ * under the reader already, return false then: the copy may be torn and has
+ * to be thrown away.
+ */
+static inline bool mcu_message_release(mcu_message_queue *msg_queue, uint32_t head)
+{
+	if (msg_queue->overflow == MCUSPI_OVERFLOW_DROP_OLDEST) {
+		if (cmpxchg(&msg_queue->ctrl->head, head, head + 1) != head) {
+			return false;
+		}
+	} else {
+		mcuspi_ring_publish(&msg_queue->ctrl->head, head + 1);
+	}
+	if (READ_ONCE(msg_queue->mcuspi->rx_flow_off)) {
+		mcuspi_rx_flow_update(msg_queue->mcuspi);
+	}
+	mcuspi_rx_credit_update(msg_queue->mcuspi);
+	return true;
+}
+
+/* consumer side, slot of index head is handed back, account its residency */
+static inline void mcu_message_consumed(mcu_message_queue *msg_queue, uint32_t head)
+{
+	struct mcu_message_meta * meta = &msg_queue->meta[head & msg_queue->mask];
+	u64 ns = ktime_get_ns() - meta->enqueue_ns;
+
+	mcuspi_hist_add(msg_queue->stats, MCUSPI_HIST_RESIDENCY, ns);
+	mcuspi_class_hist_add(msg_queue->stats, msg_queue->class, ns);
+	if (trace_mcuspi_dequeued_enabled()) {
+		trace_mcuspi_dequeued(msg_queue->name, meta->serial,
+				msg_queue->slots[head & msg_queue->mask].payload_length,
+				READ_ONCE(msg_queue->ctrl->tail) - head - 1);
+	}
+}
+
+int load_one_mcu_message_from_queue(mcu_message_queue *msg_queue, mcu_message *mcu_msg)
+{
+	uint32_t head;
+	struct mcu_message * this_mcu_msg;
+
+	mutex_lock(&msg_queue->read_lock);
+	do {
+		head = READ_ONCE(msg_queue->ctrl->head);
+		/* pairs with the release of tail, slot content is visible */
+		if (!mcuspi_ring_used(head, &msg_queue->ctrl->tail)) {
+			mutex_unlock(&msg_queue->read_lock);
+			return -EAGAIN;
+		}
+
+		this_mcu_msg = &msg_queue->slots[head & msg_queue->mask];
+		memcpy(mcu_msg->payload_desc, this_mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
+		mcu_msg->payload_length = min_t(uint16_t, this_mcu_msg->payload_length, MAX_PAYLOAD_LENGTH);
+		if (mcu_msg->payload_length > 0) {
+			memcpy(mcu_msg->payload, this_mcu_msg->payload, mcu_msg->payload_length);
+		}
+		/* hand the slot back to producer after it has been copied */
+	} while (!mcu_message_release(msg_queue, head));
+	mcu_message_consumed(msg_queue, head);
+	mutex_unlock(&msg_queue->read_lock);
+	return 0;
+}
+
+int drop_one_mcu_message_from_queue(mcu_message_queue *msg_queue)
+{
+	uint32_t head;
+
+	mutex_lock(&msg_queue->read_lock);
+	do {
+		head = READ_ONCE(msg_queue->ctrl->head);
+		if (!mcuspi_ring_used(head, &msg_queue->ctrl->tail)) {
+			mutex_unlock(&msg_queue->read_lock);
+			return -EAGAIN;
+		}
+	} while (!mcu_message_release(msg_queue, head));
+	mcu_message_consumed(msg_queue, head);
+	mutex_unlock(&msg_queue->read_lock);
+	return 0;
+}
+
+/* 
+ * Consumer side, copy as many msgs as fit in count bytes to userspace, each
+ * one as struct mcuspi_record + payload. Return the bytes copied, -EAGAIN if
+ * the queue is empty or -EMSGSIZE if the first msg does not fit.
+ */
+ssize_t copy_mcu_messages_to_user(mcu_message_queue *msg_queue, char __user *userbuf,
+			size_t count)
+{
+	struct mcuspi_record record;
+	struct mcu_message * mcu_msg;
+	uint32_t head, tail;
+	size_t done = 0;
+	size_t size;
+	ssize_t ret = -EAGAIN;
+
+	mutex_lock(&msg_queue->read_lock);
+	head = READ_ONCE(msg_queue->ctrl->head);
+	tail = head + mcuspi_ring_used(head, &msg_queue->ctrl->tail);
+	while (head != tail) {
+		mcu_msg = &msg_queue->slots[head & msg_queue->mask];
+		record.payload_length = min_t(uint16_t, mcu_msg->payload_length, MAX_PAYLOAD_LENGTH);
+		size = MCUSPI_RECORD_SIZE(record.payload_length);
+		if (size > count - done) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		memcpy(record.payload_desc, mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
+		/* slot stays owned by us until head moves, copy straight from it */
+		if (copy_to_user(userbuf + done, &record, sizeof(record)) ||
+		    copy_to_user(userbuf + done + sizeof(record), mcu_msg->payload, record.payload_length) ||
+		    clear_user(userbuf + done + sizeof(record) + record.payload_length,
+				size - sizeof(record) - record.payload_length)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (!mcu_message_release(msg_queue, head)) {
+			/* overwritten by a producer, the record is written again */
+			head = READ_ONCE(msg_queue->ctrl->head);
+			tail = head + mcuspi_ring_used(head, &msg_queue->ctrl->tail);
+			continue;
+		}
+		mcu_message_consumed(msg_queue, head);
+		done += size;
+		head++;
+	}
+	mutex_unlock(&msg_queue->read_lock);
+	return done ? done : ret;
+}
+
+/* 
+ * Consumer side, copy the next msg to the buffer described by msg and fill in
+ * its payload_desc, payload_length and flags. Return -EAGAIN if queue is empty.
+ */
+int load_one_mcu_message_to_user(mcu_message_queue *msg_queue, struct mcuspi_msg *msg)
+{
+	struct mcu_message * mcu_msg;
+	uint32_t head;
+	uint16_t payload_length;
+	int ret = 0;
+
+	mutex_lock(&msg_queue->read_lock);
+	do {
+		head = READ_ONCE(msg_queue->ctrl->head);
+		if (!mcuspi_ring_used(head, &msg_queue->ctrl->tail)) {
+			mutex_unlock(&msg_queue->read_lock);
+			return -EAGAIN;
+		}
+		mcu_msg = &msg_queue->slots[head & msg_queue->mask];
+		payload_length = min_t(uint16_t, mcu_msg->payload_length, MAX_PAYLOAD_LENGTH);
+		if (copy_to_user(u64_to_user_ptr(msg->payload), mcu_msg->payload,
+				min_t(uint32_t, payload_length, msg->payload_length))) {
+			mutex_unlock(&msg_queue->read_lock);
+			return -EFAULT; /* leave the msg in queue */
+		}
+		memcpy(msg->payload_desc, mcu_msg->payload_desc, PAYLOAD_DESC_LENGTH);
+	} while (!mcu_message_release(msg_queue, head));
+	msg->flags = payload_length > msg->payload_length ? MCUSPI_MSG_TRUNC : 0;
+	msg->payload_length = payload_length;
+	mcu_message_consumed(msg_queue, head);
+	mutex_unlock(&msg_queue->read_lock);
+	return ret;
+}
+
+static inline bool mcuspi_sub_empty(struct mcuspi_sub *sub)
+{
+	return READ_ONCE(sub->head) == READ_ONCE(sub->tail);
+}
+
+/* oldest msg of sub, it stays in the ring. Caller holds read_lock */
+static struct mcuspi_shared_msg *mcuspi_sub_peek(struct mcuspi_sub *sub)
+{
+	struct mcuspi_shared_msg * shared = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (sub->head != sub->tail) {
+		shared = sub->ring[sub->head & (MCUSPI_SUB_DEPTH - 1)];
+	}
+	spin_unlock_irqrestore(&sub->lock, flags);
+	return shared;
+}
+
+/* take the msg returned by mcuspi_sub_peek out of the ring */
+static void mcuspi_sub_consume(struct mcuspi_dev *mcuspi, struct mcuspi_sub *sub,
+			struct mcuspi_shared_msg *shared)
+{
+	unsigned long flags;
+	uint32_t depth;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	sub->head++;
+	depth = sub->tail - sub->head;
+	spin_unlock_irqrestore(&sub->lock, flags);
+	mcuspi_hist_add(mcuspi->stats, MCUSPI_HIST_RESIDENCY, ktime_get_ns() - shared->enqueue_ns);
+	trace_mcuspi_dequeued(mcuspi->name, shared->serial, shared->msg.payload_length, depth);
+	mcuspi_shared_put(mcuspi, shared);
+}
+
+/* 
+ * Consumer side of a subscribed file, copy its msgs to userspace as read()
+ * does in mode: one payload, or as many records as fit in count bytes.
+ * Return the bytes copied, -EAGAIN if there is no msg or -EMSGSIZE if the
+ * first record does not fit.
+ */
+static ssize_t mcuspi_sub_read(struct mcuspi_dev *mcuspi, struct mcuspi_sub *sub, uint32_t mode,
+			char __user *userbuf, size_t count)
+{
+	struct mcuspi_shared_msg * shared;
+	struct mcuspi_record record;
+	size_t done = 0;
+	size_t size;
+	ssize_t ret = -EAGAIN;
+
+	mutex_lock(&sub->read_lock);
+	while ((shared = mcuspi_sub_peek(sub))) {
+		if (mode != MCUSPI_MODE_RECORD) {
+			size = min_t(size_t, count, shared->msg.payload_length);
+			ret = copy_to_user(userbuf, shared->msg.payload, size) ? -EFAULT : size;
+			if (ret >= 0) {
+				mcuspi_sub_consume(mcuspi, sub, shared);
+			}
+			break;
+		}
+		record.payload_length = shared->msg.payload_length;
+		size = MCUSPI_RECORD_SIZE(record.payload_length);
+		if (size > count - done) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		memcpy(record.payload_desc, shared->msg.payload_desc, PAYLOAD_DESC_LENGTH);
+		if (copy_to_user(userbuf + done, &record, sizeof(record)) ||
+		    copy_to_user(userbuf + done + sizeof(record), shared->msg.payload, record.payload_length) ||
+		    clear_user(userbuf + done + sizeof(record) + record.payload_length,
+				size - sizeof(record) - record.payload_length)) {
+			ret = -EFAULT;
+			break;
+		}
+		mcuspi_sub_consume(mcuspi, sub, shared);
+		done += size;
+	}
+	mutex_unlock(&sub->read_lock);
+	return done ? done : ret;
+}
+
+/* as load_one_mcu_message_to_user, for a subscribed file */
+static int mcuspi_sub_recv_one(struct mcuspi_dev *mcuspi, struct mcuspi_sub *sub,
+			struct mcuspi_msg *msg)
+{
+	struct mcuspi_shared_msg * shared;
+	uint16_t payload_length;
+	int ret = 0;
+
+	mutex_lock(&sub->read_lock);
+	shared = mcuspi_sub_peek(sub);
+	if (!shared) {
+		mutex_unlock(&sub->read_lock);
+		return -EAGAIN;
+	}
+	payload_length = shared->msg.payload_length;
+	if (copy_to_user(u64_to_user_ptr(msg->payload), shared->msg.payload,
+			min_t(uint32_t, payload_length, msg->payload_length))) {
+		ret = -EFAULT;
+	} else {
+		memcpy(msg->payload_desc, shared->msg.payload_desc, PAYLOAD_DESC_LENGTH);
+		msg->flags = payload_length > msg->payload_length ? MCUSPI_MSG_TRUNC : 0;
+		msg->payload_length = payload_length;
+		mcuspi_sub_consume(mcuspi, sub, shared);
+	}
+	mutex_unlock(&sub->read_lock);
+	return ret;
+}
+
+/* MCUSPI_IOC_SUBSCRIBE, the first subscriber allocates the shared pool */
+static int mcuspi_subscribe(struct mcuspi_file *mcuspi_file, const struct mcuspi_filter *filter)
+{
+	struct mcuspi_dev * mcuspi = mcuspi_file->mcuspi;
+	struct mcuspi_sub * sub;
+	int i, ret = 0;
+
+	mutex_lock(&mcuspi->subs_lock);
+	if (mcuspi_file->sub) {
+		ret = -EBUSY;
+		goto out;
+	}
+	if (!mcuspi->shared_pool) {
+		mcuspi->shared_pool = kvcalloc(MCUSPI_SHARED_POOL, sizeof(*mcuspi->shared_pool), GFP_KERNEL);
+		if (!mcuspi->shared_pool) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		/* no producer takes from the pool before a subscriber is listed */
+		for (i = 0; i < MCUSPI_SHARED_POOL; i++) {
+			list_add(&mcuspi->shared_pool[i].free, &mcuspi->shared_free);
+		}
+	}
+	sub = kzalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(sub->mask, filter->mask, PAYLOAD_DESC_LENGTH);
+	memcpy(sub->value, filter->value, PAYLOAD_DESC_LENGTH);
+	for (i = 0; i < PAYLOAD_DESC_LENGTH / 8; i++) {
+		sub->value[i] &= sub->mask[i];
+	}
+	spin_lock_init(&sub->lock);
+	mutex_init(&sub->read_lock);
+	init_waitqueue_head(&sub->wait);
+	/* readers test mcuspi_file->sub without subs_lock */
+	smp_store_release(&mcuspi_file->sub, sub);
+	list_add_tail_rcu(&sub->node, &mcuspi->subs);
+out:
+	mutex_unlock(&mcuspi->subs_lock);
+	return ret;
+}
+
+/* file released, no reader is left */
+static void mcuspi_unsubscribe(struct mcuspi_file *mcuspi_file)
+{
+	struct mcuspi_dev * mcuspi = mcuspi_file->mcuspi;
+	struct mcuspi_sub * sub = mcuspi_file->sub;
+
+	if (!sub) {
+		return;
+	}
+	mutex_lock(&mcuspi->subs_lock);
+	list_del_rcu(&sub->node);
+	mutex_unlock(&mcuspi->subs_lock);
+	synchronize_rcu(); /* no producer sees sub any more */
+	while (sub->head != sub->tail) {
+		mcuspi_shared_put(mcuspi, sub->ring[sub->head++ & (MCUSPI_SUB_DEPTH - 1)]);
+	}
+	kfree(sub);
+}
+
+/* 
+ * Fill the link control block of an outgoing frame: ack of the newest frame
+ * received, NAK of the oldest missing one not NAK'ed yet, the credits and
+ * frag, the fragment index with MCUSPI_LINK_FRAG.
+ */
+static void mcuspi_link_fill(struct mcuspi_dev *mcuspi, uint8_t *payload_desc, uint8_t link_flags,
+			     uint8_t frag)
+{
+	struct mcuspi_link_ctrl * link = (void *)(payload_desc + MCUSPI_LINK_CTRL_OFFSET);
+	unsigned long flags;
+	unsigned long serial;
+	int credits = 0;
+
+	memset(link, 0, sizeof(*link));
+	link->frag = frag;
+	if (mcuspi->features & MCUSPI_FEAT_CREDITS) {
+		credits = mcuspi_rx_credits(mcuspi);
+	}
+	spin_lock_irqsave(&mcuspi->rx_seq_lock, flags);
+	if (mcuspi->features & MCUSPI_FEAT_CREDITS) {
+		/* counted from the ack below, frames received since use them up */
+		link_flags |= MCUSPI_LINK_CREDITS;
+		link->credits = credits;
+		mcuspi->rx_credits = credits;
+	}
+	if (mcuspi->rx_expected >= 0) {
+		link_flags |= MCUSPI_LINK_ACK;
+		link->ack = mcuspi->rx_expected - 1;
+		/* the oldest serial still in the window is half the space ahead */
+		serial = find_next_bit(mcuspi->rx_nak, MCUSPI_SERIALS,
+				(uint8_t)(mcuspi->rx_expected + MCUSPI_SERIALS / 2));
+		if (serial >= MCUSPI_SERIALS) {
+			serial = find_first_bit(mcuspi->rx_nak, MCUSPI_SERIALS);
+		}
+		if (serial < MCUSPI_SERIALS) {
+			__clear_bit(serial, mcuspi->rx_nak);
+			link_flags |= MCUSPI_LINK_NAK;
+			link->nak = serial;
+		}
+	}
+	spin_unlock_irqrestore(&mcuspi->rx_seq_lock, flags);
+	link->flags = link_flags;
+}
+
+/* 
+ * Fill the link control block of a frame sent again anew, it keeps its own
+ * flags and fragment index, and its CRC.
+ */
+static void mcuspi_link_refresh(struct mcuspi_dev *mcuspi, uint8_t *buf)
+{
+	const struct mcuspi_link_ctrl * link = (void *)(buf + MCUSPI_DESC_OFFSET + MCUSPI_LINK_CTRL_OFFSET);
+	uint16_t payload_length = get_unaligned_le16(buf + PAYLOAD_SHIFT - 2);
+
+	mcuspi_link_fill(mcuspi, buf + MCUSPI_DESC_OFFSET,
+			 link->flags & (MCUSPI_LINK_CONTROL | MCUSPI_LINK_FRAG | MCUSPI_LINK_FRAG_END |
+					MCUSPI_LINK_COMPRESSED), link->frag);
+	mcuspi_proto_put_crc(buf, payload_length, mcu_frame_crc(mcuspi, buf, HEAD_LENGTH + payload_length));
+}
+
+/* 
+ * Compress the payload at buf + PAYLOAD_SHIFT in place when its class is one
+ * of compress_classes and it gets shorter. Return the payload length to send.
+ * The caller holds tx_lock.
+ */
+static uint16_t mcuspi_tx_compress(struct mcuspi_dev *mcuspi, uint8_t *buf, const uint8_t *payload_desc,
+				   uint16_t payload_length)
+{
+	int class = payload_desc ? min_t(int, payload_desc[0], mcuspi->nr_classes - 1) : 0;
+	int len;
+
+	if (payload_length < MCUSPI_COMPRESS_MIN || !(mcuspi->compress_classes & BIT(class))) {
+		return payload_length;
+	}
+	len = mcuspi_proto_rle_encode(mcuspi->tx_compress_buf, payload_length - 1,
+			buf + PAYLOAD_SHIFT, payload_length);
+	if (len < 0) {
+		return payload_length;
+	}
+	memcpy(buf + PAYLOAD_SHIFT, mcuspi->tx_compress_buf, len);
+	mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_COMPRESSED);
+	mcuspi_stat_add(mcuspi->stats, MCUSPI_CNT_TX_COMPRESS_SAVED, payload_length - len);
+	return len;
+}
+
+/* 
+ * Fill head and CRC of a frame whose payload is already at buf + PAYLOAD_SHIFT.
+ * A NULL payload_desc sends an all zero descriptor, link_flags are extra
+ * MCUSPI_LINK_xxx flags for link control and frag the fragment index that
+ * goes with MCUSPI_LINK_FRAG. Bytes after the CRC are not
+ * touched, they are clocked out in fixed length mode and ignored by MCU.
+ * The caller holds tx_lock, frames are numbered in the order they are queued.
+ * Return the payload length of the frame, less than payload_length when it
+ * has been compressed.
+ */
+uint16_t pack_one_mcu_frame(struct mcuspi_dev *mcuspi, uint8_t *buf, const uint8_t *payload_desc,
+			uint16_t payload_length, uint8_t link_flags, uint8_t frag)
+{
+	uint16_t raw_length = payload_length;
+
+	if (mcuspi->compress_classes) {
+		payload_length = mcuspi_tx_compress(mcuspi, buf, payload_desc, payload_length);
+		if (payload_length != raw_length) {
+			link_flags |= MCUSPI_LINK_COMPRESSED;
+		}
+	}
+	// pre_head 0xAA + serial no(1 Byte) + custom data descriptor(64 Bytes) + payload length(2 bytes, count by bytes) + payload(0~1024 Bytes) + CRC32
+	mcuspi_proto_put_head(buf, mcuspi->tx_serial++, payload_desc, payload_length);
+	if (mcuspi->features & MCUSPI_FEAT_LINK) {
+		mcuspi_link_fill(mcuspi, buf + MCUSPI_DESC_OFFSET, link_flags, frag);
+	}
+	mcuspi_proto_put_crc(buf, payload_length, mcu_frame_crc(mcuspi, buf, HEAD_LENGTH + payload_length));
+	return payload_length;
+}
+
+/* return the payload length of the frame, as pack_one_mcu_frame */
+int pack_one_mcu_message(struct mcuspi_dev *mcuspi, mcu_message *mcu_msg, uint8_t *buf)
+{
+	if (mcu_msg->payload_length > 0) {
+		memcpy(buf + PAYLOAD_SHIFT, mcu_msg->payload, mcu_msg->payload_length);
+	}
+	return pack_one_mcu_frame(mcuspi, buf, mcu_msg->payload_desc, mcu_msg->payload_length, 0, 0);
+}
+
+/* 
+ * The MCU runs short of credits with the rings having room again, or a gap
+ * was seen in the receive sequence: send the credits or the NAK in a control
+ * frame unless a frame queued by a writer has carried them already.
+ */
+static bool mcuspi_link_pending(struct mcuspi_dev *mcuspi)
+{
+	int credits = READ_ONCE(mcuspi->rx_credits);
+
+	if (!bitmap_empty(mcuspi->rx_nak, MCUSPI_SERIALS)) {
+		return true;
+	}
+	return (mcuspi->features & MCUSPI_FEAT_CREDITS) && credits <= mcuspi->rx_credit_low &&
+	       mcuspi_rx_credits(mcuspi) >= credits + mcuspi->rx_credit_low;
+}
+
+static void mcuspi_link_work(struct work_struct *work)
+{
+	struct mcuspi_dev * mcuspi = container_of(work, struct mcuspi_dev, link_work);
+	uint8_t * frame;
+
+	if (!mcuspi_link_pending(mcuspi)) {
+		return;
+	}
+	mutex_lock(&mcuspi->tx_lock);
+	/* a full queue carries the NAK once it drains, see mcuspi_tx_complete */
+	if (mcuspi_link_pending(mcuspi) &&
+	    mcuspi_tx_get_slot(mcuspi, true, &frame) == 0) {
+		pack_one_mcu_frame(mcuspi, frame, NULL, 0, MCUSPI_LINK_CONTROL, 0);
+		mcuspi_tx_put_slot(mcuspi, mcu_frame_length(mcuspi, 0));
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_CONTROL);
+	}
+	mutex_unlock(&mcuspi->tx_lock);
+}
+
+/* depth is the slot count, a power of 2 */
+int init_mcu_message_queue(mcu_message_queue **msg_queue, uint32_t depth)
+{
+	BUILD_BUG_ON(MAX_BUFFERED_MSG & (MAX_BUFFERED_MSG - 1));
+	BUILD_BUG_ON(sizeof(struct mcu_message) != sizeof(struct mcuspi_ring_slot));
+	BUILD_BUG_ON(offsetof(struct mcu_message, payload_desc) != offsetof(struct mcuspi_ring_slot, payload_desc));
+	BUILD_BUG_ON(offsetof(struct mcu_message, payload) != offsetof(struct mcuspi_ring_slot, payload));
+	BUILD_BUG_ON(sizeof(struct mcuspi_ring_ctrl) > PAGE_SIZE);
+
+	*msg_queue = kzalloc(sizeof(mcu_message_queue), GFP_KERNEL);
+	if (!*msg_queue) {
+		return -ENOMEM;
+	}
+	/* every slot is allocated here, receive path never allocates */
+	(*msg_queue)->ring_size = PAGE_ALIGN(depth * sizeof(mcu_message));
+	(*msg_queue)->ctrl = vmalloc_user(PAGE_SIZE + (*msg_queue)->ring_size);
+	if (!(*msg_queue)->ctrl) {
+		kfree(*msg_queue);
+		*msg_queue = NULL;
+		return -ENOMEM;
+	}
+	(*msg_queue)->meta = kcalloc(depth, sizeof(struct mcu_message_meta), GFP_KERNEL);
+	if (!(*msg_queue)->meta) {
+		vfree((*msg_queue)->ctrl);
+		kfree(*msg_queue);
+		*msg_queue = NULL;
+		return -ENOMEM;
+	}
+	(*msg_queue)->slots = (void *)(*msg_queue)->ctrl + PAGE_SIZE;
+	(*msg_queue)->ctrl->head = 0;
+	(*msg_queue)->ctrl->tail = 0;
+	(*msg_queue)->mask = depth - 1;
+	(*msg_queue)->ctrl->slot_count = depth;
+	(*msg_queue)->ctrl->slot_size = sizeof(mcu_message);
+	(*msg_queue)->ctrl->ring_offset = PAGE_SIZE;
+	(*msg_queue)->ctrl->ring_size = (*msg_queue)->ring_size;
+	spin_lock_init(&(*msg_queue)->write_lock);
+	mutex_init(&(*msg_queue)->read_lock);
+	init_waitqueue_head(&(*msg_queue)->wait);
+	return 0;
+}
+
+int deinit_mcu_message_queue(mcu_message_queue *msg_queue)
+{
+	if (!msg_queue) {
+		return -EFAULT;
+	}
+	vfree(msg_queue->ctrl);
+	kfree(msg_queue->meta);
+	kfree(msg_queue);
+	return 0;
+}
+
+int init_mcu_message(mcu_message **msg)
+{
+	*msg = kzalloc(sizeof(mcu_message), GFP_KERNEL);
+	if (!*msg) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+int deinit_mcu_message(mcu_message *msg)
+{
+	if (!msg) {
+		return -EFAULT;
+	}
+	kfree(msg);
+	return 0;
+}
+
+/* 
+ * Ring the next msg of a reader is taken from: the one of its class device,
+ * else the first non-empty class in priority order.
+ */
+static struct mcu_message_queue *
+mcuspi_rx_queue(struct mcuspi_dev *mcuspi, struct mcu_message_queue *queue)
+{
+	int i;
+
+	if (queue) {
+		return queue;
+	}
+	for (i = 0; i < mcuspi->nr_classes - 1; i++) {
+		if (!is_mcu_message_queue_empty(mcuspi->recv_queues[i])) {
+			return mcuspi->recv_queues[i];
+		}
+	}
+	return mcuspi->recv_queues[max(mcuspi->nr_classes - 1, 0)];
+}
+
+static inline bool mcuspi_rx_empty(struct mcuspi_dev *mcuspi, struct mcu_message_queue *queue)
+{
+	return is_mcu_message_queue_empty(mcuspi_rx_queue(mcuspi, queue));
+}
+
+static inline wait_queue_head_t *
+mcuspi_rx_wait(struct mcuspi_dev *mcuspi, struct mcu_message_queue *queue)
+{
+	return queue ? &queue->wait : &mcuspi->recv_wait;
+}
+
+/* msgs waiting in every receive ring */
+static int mcuspi_rx_count(struct mcuspi_dev *mcuspi)
+{
+	int i, count = 0;
+
+	for (i = 0; i < mcuspi->nr_classes; i++) {
+		if (mcuspi->recv_queues[i]) {
+			count += get_mcu_message_count_in_queue(mcuspi->recv_queues[i]);
+		}
+	}
+	return count;
+}
+
+/* a reassembled msg waits for a payload mode read of /dev/mcuspiX */
+static inline bool mcuspi_frag_ready(struct mcuspi_dev *mcuspi, struct mcu_message_queue *queue)
+{
+	return !queue && (mcuspi->features & MCUSPI_FEAT_FRAG) && !list_empty(&mcuspi->frag_done);
+}
+
+/* 
+ * Copy the oldest reassembled msg to userspace, the part past count is
+ * dropped as with a msg of the rings. Return the bytes copied or -EAGAIN.
+ */
+static ssize_t mcuspi_frag_read(struct mcuspi_dev *mcuspi, struct mcu_message_queue *queue,
+				char __user *userbuf, size_t count)
+{
+	struct mcuspi_frag_msg * msg = NULL;
+	unsigned long flags;
+
+	if (!mcuspi_frag_ready(mcuspi, queue)) {
+		return -EAGAIN;
+	}
+	spin_lock_irqsave(&mcuspi->frag_lock, flags);
+	if (!list_empty(&mcuspi->frag_done)) {
+		msg = list_first_entry(&mcuspi->frag_done, struct mcuspi_frag_msg, node);
+		list_del(&msg->node);
+	}
+	spin_unlock_irqrestore(&mcuspi->frag_lock, flags);
+	if (!msg) {
+		return -EAGAIN;
+	}
+	count = min_t(size_t, count, msg->length);
+	if (copy_to_user(userbuf, msg->payload, count)) {
+		/* leave the msg for the next read */
+		spin_lock_irqsave(&mcuspi->frag_lock, flags);
+		list_add(&msg->node, &mcuspi->frag_done);
+		spin_unlock_irqrestore(&mcuspi->frag_lock, flags);
+		return -EFAULT;
+	}
+	spin_lock_irqsave(&mcuspi->frag_lock, flags);
+	list_add(&msg->node, &mcuspi->frag_free);
+	spin_unlock_irqrestore(&mcuspi->frag_lock, flags);
+	return count;
+}
+
+static void mcuspi_dev_release(struct kref *kref);
+
+/* 
+ * Set by remove: the rings stay until the file is closed, the bus is gone.
+ * An op already past the check may still sleep on a ring.
+ */
+static inline bool mcuspi_dead(struct mcuspi_dev *mcuspi)
+{
+	bool dead;
+
+	spin_lock(&mcuspi->dead_lock);
+	dead = mcuspi->dead;
+	spin_unlock(&mcuspi->dead_lock);
+	return dead;
+}
+
+/* User is reading data from /dev/mcuspiX */
+static ssize_t mcuspi_read_file(struct file *file, char __user *userbuf,
+                               size_t count, loff_t *ppos)
+{
+	int expval, size;
+	//char *recvbuf;
+	struct mcuspi_file * mcuspi_file;
+	struct mcuspi_dev * mcuspi;
+	struct mcu_message * mcu_msg = NULL;
+	struct mcu_message_queue * mcu_msg_queue = NULL;
+	struct mcuspi_sub * sub;
+	int offset = 0;
+	int ret = 0;
+
+
+	mcuspi_file = file->private_data;
+	mcuspi = mcuspi_file->mcuspi;
+	mcu_msg = &mcuspi_file->msg;
+	mcu_msg_queue = mcuspi_file->queue; /* NULL takes from every class */
+	if (mcuspi_dead(mcuspi)) {
+		return -ENODEV;
+	}
+	/*
+	dev_info(&mcuspi->spid->dev, 
+		 "mcuspi_read_file entered on %s\n", mcuspi->name);
+		 */
+
+	if (!mcu_msg || !mcuspi->recv_queues[0]) {
+		dev_info(&mcuspi->spid->dev, 
+		    "mcu_msg: %08x, mcu_msg_queue: %08x\n", mcu_msg, mcuspi->recv_queues[0]);
+		return -EFAULT; 
+	}
+
+	sub = smp_load_acquire(&mcuspi_file->sub);
+	if (sub) {
+		while ((ret = mcuspi_sub_read(mcuspi, sub, mcuspi_file->mode, userbuf, count)) == -EAGAIN) {
+			if (file->f_flags & O_NONBLOCK) {
+				return -EAGAIN;
+			}
+			ret = wait_event_interruptible(sub->wait, !mcuspi_sub_empty(sub));
+			if (ret) {
+				return ret;
+			}
+		}
+		return ret;
+	}
+
+	/* with several classes, a single read only takes from one of them */
+	if (mcuspi_file->mode == MCUSPI_MODE_RECORD) {
+		while ((ret = copy_mcu_messages_to_user(mcuspi_rx_queue(mcuspi, mcu_msg_queue),
+						userbuf, count)) == -EAGAIN) {
+			if (file->f_flags & O_NONBLOCK) {
+				return -EAGAIN;
+			}
+			ret = wait_event_interruptible(*mcuspi_rx_wait(mcuspi, mcu_msg_queue),
+					!mcuspi_rx_empty(mcuspi, mcu_msg_queue));
+			if (ret) {
+				return ret;
+			}
+		}
+		return ret;
+	}
+
+	/* reassembled msgs go ahead of the rings */
+	ret = mcuspi_frag_read(mcuspi, mcu_msg_queue, userbuf, count);
+	if (ret != -EAGAIN) {
+		return ret;
+	}
+
+	/* block until the isr stores a msg, another reader may take it first */
+	mutex_lock(&mcuspi_file->lock);
+	while ((ret = load_one_mcu_message_from_queue(mcuspi_rx_queue(mcuspi, mcu_msg_queue),
+					mcu_msg)) == -EAGAIN) {
+		mutex_unlock(&mcuspi_file->lock);
+		if (file->f_flags & O_NONBLOCK) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(*mcuspi_rx_wait(mcuspi, mcu_msg_queue),
+				!mcuspi_rx_empty(mcuspi, mcu_msg_queue) ||
+				mcuspi_frag_ready(mcuspi, mcu_msg_queue));
+		if (ret) {
+			return ret;
+		}
+		ret = mcuspi_frag_read(mcuspi, mcu_msg_queue, userbuf, count);
+		if (ret != -EAGAIN) {
+			return ret;
+		}
+		mutex_lock(&mcuspi_file->lock);
+	}
+	if (ret < 0) {
+		mutex_unlock(&mcuspi_file->lock);
+		dev_info(&mcuspi->spid->dev, 
+			"load_one_mcu_message_from_queue Failed with %d\n", ret);
+		return -EFAULT;
+	}
+	//recvbuf = kzalloc(MAX_PAYLOAD_LENGTH, GFP_KERNEL);
 	
 	count = min(mcu_msg->payload_length, count);
 	offset = min(*ppos, mcu_msg->payload_length - count);
@@ -436,145 +2550,653 @@ static ssize_t mcuspi_read_file(struct file *file, char __user *userbuf,
 		 "count:%d, offset: %d, buf_ptr: %08x\n", count, offset, mcu_msg->payload + offset);
 	*/
 	if(copy_to_user(userbuf, mcu_msg->payload + offset, count)) {
+		mutex_unlock(&mcuspi_file->lock);
 		pr_info("Failed to copy payload content to user space\n");
 		return -EFAULT;
 	}
+	mutex_unlock(&mcuspi_file->lock);
 	/*
 	dev_info(&mcuspi->spid->dev, 
 		 "mcuspi_read_file exited on %s\n", mcuspi->name);
 	*/
 
-	//kfree(recvbuf);
+	//kfree(recvbuf);
+
+	return count;
+}
+
+
+
+/* pack mcu_msg into the tx queue, return 0 once it is queued */
+static int send_one_mcu_message(struct mcuspi_dev *mcuspi, mcu_message *mcu_msg, bool nonblock)
+{
+	uint8_t * frame;
+	uint16_t len;
+	int ret;
+
+	ret = mcuspi_tx_begin(mcuspi);
+	if (ret) {
+		return ret;
+	}
+	ret = mcuspi_tx_get_slot(mcuspi, nonblock, &frame);
+	if (ret == 0) {
+		len = pack_one_mcu_message(mcuspi, mcu_msg, frame);
+		mcuspi_tx_put_slot(mcuspi, mcu_frame_length(mcuspi, len));
+	}
+	mcuspi_tx_end(mcuspi);
+	return ret;
+}
+
+/* 
+ * Copy the payload from userspace straight into a tx slot and queue it, the
+ * caller is between mcuspi_tx_begin and mcuspi_tx_end.
+ */
+static int queue_one_user_message(struct mcuspi_dev *mcuspi, const uint8_t *payload_desc,
+			const void __user *payload, uint16_t payload_length, bool nonblock)
+{
+	uint8_t * frame;
+	int ret;
+
+	ret = mcuspi_tx_get_slot(mcuspi, nonblock, &frame);
+	if (ret) {
+		return ret;
+	}
+	if (copy_from_user(frame + PAYLOAD_SHIFT, payload, payload_length)) {
+		return -EFAULT; /* slot is not queued */
+	}
+	payload_length = pack_one_mcu_frame(mcuspi, frame, payload_desc, payload_length, 0, 0);
+	mcuspi_tx_put_slot(mcuspi, mcu_frame_length(mcuspi, payload_length));
+	return 0;
+}
+
+/* 
+ * Record mode write, queue up to MCUSPI_MAX_RECORDS_PER_WRITE records back to
+ * back. Return the bytes of the records queued.
+ */
+static ssize_t mcuspi_write_records(struct mcuspi_file *mcuspi_file, const char __user *userbuf,
+				size_t count, bool nonblock)
+{
+	struct mcuspi_dev * mcuspi = mcuspi_file->mcuspi;
+	struct mcuspi_record record;
+	size_t done = 0;
+	ssize_t ret = 0;
+	int nr = 0;
+
+	ret = mcuspi_tx_begin(mcuspi);
+	if (ret) {
+		return ret;
+	}
+
+	while (nr < MCUSPI_MAX_RECORDS_PER_WRITE && count - done >= sizeof(record)) {
+		if (copy_from_user(&record, userbuf + done, sizeof(record))) {
+			ret = -EFAULT;
+			break;
+		}
+		/* padding of the last record may be left out */
+		if (record.payload_length > MAX_PAYLOAD_LENGTH ||
+		    sizeof(record) + record.payload_length > count - done) {
+			ret = -EINVAL;
+			break;
+		}
+		/* only the first record may wait for queue space */
+		ret = queue_one_user_message(mcuspi, record.payload_desc,
+				userbuf + done + sizeof(record), record.payload_length,
+				nonblock || nr > 0);
+		if (ret) {
+			break;
+		}
+		done += min(MCUSPI_RECORD_SIZE(record.payload_length), count - done);
+		nr++;
+	}
+	mcuspi_tx_end(mcuspi);
+	if (nr == 0 && ret == 0) {
+		ret = -EINVAL;
+	}
+	return nr ? done : ret;
+}
+
+/* 
+ * Payload mode write of more than MAX_PAYLOAD_LENGTH bytes with
+ * "dozh,fragments": one msg of up to MCUSPI_MAX_FRAGS fragments queued back
+ * to back. The msg is queued whole or the write fails: with nonblock it
+ * takes room for as many fragments as the queue holds up front, and once
+ * the first fragment is queued only a fatal signal or a fault stops it.
+ * The MCU drops a msg cut that way when the next one starts.
+ */
+static ssize_t mcuspi_write_fragments(struct mcuspi_dev *mcuspi, const char __user *userbuf,
+				size_t count, bool nonblock)
+{
+	uint8_t * frame;
+	uint8_t link_flags;
+	uint16_t sent; /* payload bytes of the frame, compressed */
+	size_t done = 0;
+	size_t len;
+	uint32_t nr;
+	int frag;
+	ssize_t ret;
+
+	count = min_t(size_t, count, MCUSPI_MAX_FRAGS * MAX_PAYLOAD_LENGTH);
+	nr = DIV_ROUND_UP(count, MAX_PAYLOAD_LENGTH);
+	ret = mcuspi_tx_begin(mcuspi);
+	if (ret) {
+		return ret;
+	}
+	nr = min(nr, mcuspi_tx_capacity(mcuspi));
+	if (!mcuspi_tx_has_room(mcuspi, nr)) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_QUEUE_FULL);
+		ret = nonblock ? -EAGAIN :
+		      wait_event_interruptible(mcuspi->tx_wait, mcuspi_tx_has_room(mcuspi, nr));
+		if (ret) {
+			goto out;
+		}
+	}
+	for (frag = 0; done < count; frag++) {
+		len = min_t(size_t, count - done, MAX_PAYLOAD_LENGTH);
+		link_flags = MCUSPI_LINK_FRAG | (done + len == count ? MCUSPI_LINK_FRAG_END : 0);
+		if (frag >= nr) {
+			ret = wait_event_killable(mcuspi->tx_wait, mcuspi_tx_has_space(mcuspi));
+			if (ret) {
+				goto out;
+			}
+		}
+		/* tx_lock is held, the room taken above is still free */
+		mcuspi_tx_get_slot(mcuspi, true, &frame);
+		if (copy_from_user(frame + PAYLOAD_SHIFT, userbuf + done, len)) {
+			ret = -EFAULT; /* slot is not queued */
+			goto out;
+		}
+		sent = pack_one_mcu_frame(mcuspi, frame, NULL, len, link_flags, frag);
+		mcuspi_tx_put_slot(mcuspi, mcu_frame_length(mcuspi, sent));
+		done += len;
+	}
+	mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_TX_FRAGMENTED);
+	ret = done;
+out:
+	mcuspi_tx_end(mcuspi);
+	return ret;
+}
+
+/* 
+ * Queue msgs[0..nr-1] described by struct mcuspi_msg, block for queue space
+ * unless nonblock. Return the number of msgs queued.
+ */
+static long mcuspi_send_msgs(struct mcuspi_file *mcuspi_file, struct mcuspi_msg __user *msgs,
+				uint32_t nr, bool nonblock)
+{
+	struct mcuspi_dev * mcuspi = mcuspi_file->mcuspi;
+	struct mcuspi_msg msg;
+	uint32_t done = 0;
+	long ret = 0;
+
+	ret = mcuspi_tx_begin(mcuspi);
+	if (ret) {
+		return ret;
+	}
+
+	while (done < nr) {
+		if (copy_from_user(&msg, &msgs[done], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (msg.payload_length > MAX_PAYLOAD_LENGTH) {
+			ret = -EMSGSIZE;
+			break;
+		}
+		ret = queue_one_user_message(mcuspi, msg.payload_desc, u64_to_user_ptr(msg.payload),
+				msg.payload_length, nonblock);
+		if (ret) {
+			break;
+		}
+		done++;
+	}
+	mcuspi_tx_end(mcuspi);
+	return done ? done : ret;
+}
+
+/* 
+ * Receive up to nr msgs into msgs[0..nr-1], block for the first one unless
+ * the file is O_NONBLOCK. Return the number of msgs received.
+ */
+static long mcuspi_recv_msgs(struct file *file, struct mcuspi_msg __user *msgs, uint32_t nr)
+{
+	struct mcuspi_file * mcuspi_file = file->private_data;
+	struct mcuspi_dev * mcuspi = mcuspi_file->mcuspi;
+	struct mcu_message_queue * msg_queue = mcuspi_file->queue;
+	struct mcuspi_sub * sub = smp_load_acquire(&mcuspi_file->sub);
+	struct mcuspi_msg msg;
+	uint32_t done = 0;
+	long ret = 0;
+
+	while (done < nr) {
+		if (copy_from_user(&msg, &msgs[done], sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (sub) {
+			ret = mcuspi_sub_recv_one(mcuspi, sub, &msg);
+		} else {
+			ret = load_one_mcu_message_to_user(mcuspi_rx_queue(mcuspi, msg_queue), &msg);
+		}
+		if (ret == -EAGAIN && done == 0 && !(file->f_flags & O_NONBLOCK)) {
+			ret = sub ? wait_event_interruptible(sub->wait, !mcuspi_sub_empty(sub)) :
+				wait_event_interruptible(*mcuspi_rx_wait(mcuspi, msg_queue),
+					!mcuspi_rx_empty(mcuspi, msg_queue));
+			if (ret) {
+				break;
+			}
+			continue;
+		}
+		if (ret) {
+			break;
+		}
+		if (copy_to_user(&msgs[done], &msg, sizeof(msg))) {
+			ret = -EFAULT;
+			break;
+		}
+		done++;
+	}
+	return done ? done : ret;
+}
+
+/* Writing from the terminal command line, \n is added */
+static ssize_t mcuspi_write_file(struct file *file, const char __user *userbuf,
+                                   size_t count, loff_t *ppos)
+{
+	int ret = 0;
+	struct mcuspi_file * mcuspi_file;
+	struct mcuspi_dev * mcuspi;
+
+	mcuspi_file = file->private_data;
+	mcuspi = mcuspi_file->mcuspi;
+	if (mcuspi_dead(mcuspi)) {
+		return -ENODEV;
+	}
+/*
+	dev_info(&mcuspi->spid->dev, 
+		 "mcuspi_write_file entered on %s\n", mcuspi->name);
+
+	dev_info(&mcuspi->spid->dev,
+		 "we have written %zu characters to file\n", count); 
+*/
+	if (mcuspi_file->mode == MCUSPI_MODE_RECORD) {
+		return mcuspi_write_records(mcuspi_file, userbuf, count,
+					file->f_flags & O_NONBLOCK);
+	}
+
+	if (count > MAX_PAYLOAD_LENGTH && (mcuspi->features & MCUSPI_FEAT_FRAG)) {
+		return mcuspi_write_fragments(mcuspi, userbuf, count, file->f_flags & O_NONBLOCK);
+	}
+
+	/* payload is copied straight into a tx slot, with an all zero payload_desc */
+	count = min_t(size_t, count, MAX_PAYLOAD_LENGTH);
+	ret = mcuspi_tx_begin(mcuspi);
+	if (ret) {
+		return ret;
+	}
+	ret = queue_one_user_message(mcuspi, NULL, userbuf, count, file->f_flags & O_NONBLOCK);
+	mcuspi_tx_end(mcuspi);
+
+	if (ret == -EFAULT) 
+		dev_err(&mcuspi->spid->dev, "Bad copied value\n");
+	if (ret < 0) 
+		return ret;
+		/*
+	else
+		dev_info(&mcuspi->spid->dev, "we have written %zu characters to spi bus.\n", count); 
+		*/
+/*
+	dev_info(&mcuspi->spid->dev, 
+		 "mcuspi_write_file exited on %s\n", mcuspi->name);
+*/
+	return count;
+}
+
+static int mcuspi_open_common(struct file *file, struct mcuspi_dev *mcuspi,
+			struct mcu_message_queue *queue)
+{
+	struct mcuspi_file * mcuspi_file;
+
+	mcuspi_file = kzalloc(sizeof(*mcuspi_file), GFP_KERNEL);
+	if (!mcuspi_file) {
+		return -ENOMEM;
+	}
+	spin_lock(&mcuspi->dead_lock);
+	if (mcuspi->dead) {
+		spin_unlock(&mcuspi->dead_lock);
+		kfree(mcuspi_file);
+		return -ENODEV;
+	}
+	kref_get(&mcuspi->kref);
+	spin_unlock(&mcuspi->dead_lock);
+	mcuspi_file->mcuspi = mcuspi;
+	mcuspi_file->queue = queue;
+	mcuspi_file->mode = MCUSPI_MODE_PAYLOAD;
+	mutex_init(&mcuspi_file->lock);
+	file->private_data = mcuspi_file;
+	return 0;
+}
+
+static int mcuspi_open_file(struct inode *inode, struct file *file)
+{
+	/* calc mcuspi addr by miscdevice addr. miscdevice addr fill into
+	 * file->private_data by misc_open()*/
+	return mcuspi_open_common(file, container_of(file->private_data,
+			     struct mcuspi_dev, 
+			     mcu_spi_miscdevice), NULL);
+}
+
+/* /dev/mcuspiX-cN reads class N only */
+static int mcuspi_open_class_file(struct inode *inode, struct file *file)
+{
+	struct mcuspi_class * class = container_of(file->private_data,
+			struct mcuspi_class, miscdevice);
+
+	if (!class->mcuspi->recv_queues[class->class]) {
+		return -ENODEV;
+	}
+	return mcuspi_open_common(file, class->mcuspi, class->mcuspi->recv_queues[class->class]);
+}
+
+static int mcuspi_release_file(struct inode *inode, struct file *file)
+{
+	struct mcuspi_file * mcuspi_file = file->private_data;
+
+	mcuspi_unsubscribe(mcuspi_file);
+	kref_put(&mcuspi_file->mcuspi->kref, mcuspi_dev_release);
+	kfree(mcuspi_file);
+	return 0;
+}
+
+static long mcuspi_ioctl_file(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct mcuspi_file * mcuspi_file = file->private_data;
+	struct mcuspi_msg_vec vec;
+	struct mcuspi_filter filter;
+	uint32_t mode;
+	long ret;
+
+	if (mcuspi_dead(mcuspi_file->mcuspi)) {
+		return -ENODEV;
+	}
+	switch (cmd) {
+	case MCUSPI_IOC_SET_MODE:
+		if (get_user(mode, (uint32_t __user *)arg)) {
+			return -EFAULT;
+		}
+		if (mode != MCUSPI_MODE_PAYLOAD && mode != MCUSPI_MODE_RECORD) {
+			return -EINVAL;
+		}
+		mcuspi_file->mode = mode;
+		return 0;
+	case MCUSPI_IOC_SEND:
+		ret = mcuspi_send_msgs(mcuspi_file, (struct mcuspi_msg __user *)arg, 1,
+					file->f_flags & O_NONBLOCK);
+		return min(ret, 0L);
+	case MCUSPI_IOC_RECV:
+		ret = mcuspi_recv_msgs(file, (struct mcuspi_msg __user *)arg, 1);
+		return min(ret, 0L);
+	case MCUSPI_IOC_SUBSCRIBE:
+		if (copy_from_user(&filter, (void __user *)arg, sizeof(filter))) {
+			return -EFAULT;
+		}
+		return mcuspi_subscribe(mcuspi_file, &filter);
+	case MCUSPI_IOC_SENDV:
+	case MCUSPI_IOC_RECVV:
+		if (copy_from_user(&vec, (void __user *)arg, sizeof(vec))) {
+			return -EFAULT;
+		}
+		if (vec.nr == 0) {
+			return 0;
+		}
+		if (cmd == MCUSPI_IOC_SENDV) {
+			return mcuspi_send_msgs(mcuspi_file, u64_to_user_ptr(vec.msgs), vec.nr,
+						file->f_flags & O_NONBLOCK);
+		}
+		return mcuspi_recv_msgs(file, u64_to_user_ptr(vec.msgs), vec.nr);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static __poll_t mcuspi_poll_file(struct file *file, poll_table *wait)
+{
+	struct mcuspi_file * mcuspi_file;
+	struct mcuspi_dev * mcuspi;
+	struct mcuspi_sub * sub;
+	__poll_t mask = 0;
+
+	mcuspi_file = file->private_data;
+	mcuspi = mcuspi_file->mcuspi;
+	if (mcuspi_dead(mcuspi)) {
+		return EPOLLERR | EPOLLHUP;
+	}
+	if (!mcuspi->recv_queues[0]) {
+		return EPOLLERR;
+	}
+
+	sub = smp_load_acquire(&mcuspi_file->sub);
+	if (sub) {
+		poll_wait(file, &sub->wait, wait);
+	} else {
+		poll_wait(file, mcuspi_rx_wait(mcuspi, mcuspi_file->queue), wait);
+	}
+	poll_wait(file, &mcuspi->tx_wait, wait);
+	if (sub ? !mcuspi_sub_empty(sub) :
+	    (!mcuspi_rx_empty(mcuspi, mcuspi_file->queue) ||
+	     (mcuspi_file->mode == MCUSPI_MODE_PAYLOAD && mcuspi_frag_ready(mcuspi, mcuspi_file->queue)))) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (mcuspi_tx_has_space(mcuspi)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	return mask;
+}
+
+/* 
+ * Map the receive ring of /dev/mcuspiX: the control page at offset 0, the
+ * slots read-only at ctrl->ring_offset. Layout is described in mcu-spi.h.
+ * With several classes only the class devices can be mapped, with the
+ * drop-oldest policy none.
+ */
+static int mcuspi_mmap_file(struct file *file, struct vm_area_struct *vma)
+{
+	struct mcuspi_file * mcuspi_file;
+	struct mcuspi_dev * mcuspi;
+	struct mcu_message_queue * msg_queue;
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	mcuspi_file = file->private_data;
+	mcuspi = mcuspi_file->mcuspi;
+	if (mcuspi_dead(mcuspi)) {
+		return -ENODEV;
+	}
+	if (mcuspi_file->sub) {
+		return -EINVAL;
+	}
+	msg_queue = mcuspi_file->queue;
+	if (!msg_queue && mcuspi->nr_classes == 1) {
+		msg_queue = mcuspi->recv_queues[0];
+	}
+	if (!msg_queue) {
+		return mcuspi->recv_queues[0] ? -EINVAL : -EFAULT;
+	}
+	/* the driver moves head with drop-oldest, the consumer could not own it */
+	if (msg_queue->overflow == MCUSPI_OVERFLOW_DROP_OLDEST) {
+		return -EINVAL;
+	}
+
+	if (vma->vm_pgoff == 0) {
+		if (size != PAGE_SIZE) {
+			return -EINVAL;
+		}
+	} else if (vma->vm_pgoff == PAGE_SIZE >> PAGE_SHIFT) {
+		if (size > msg_queue->ring_size) {
+			return -EINVAL;
+		}
+		/* slots are written by the driver only */
+		if (vma->vm_flags & VM_WRITE) {
+			return -EPERM;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	} else {
+		return -EINVAL;
+	}
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
 
-	return count;
+	return remap_vmalloc_range(vma, msg_queue->ctrl, vma->vm_pgoff);
 }
 
+static irqreturn_t mcu_spi_set_intr_busy(int irq_no, void *data)
+{
 
+	struct mcuspi_dev * mcuspi = data;
+	mcuspi->irq_ns = ktime_get_ns();
+	WRITE_ONCE(mcuspi->rx_pending, true);
+	if (trace_mcuspi_irq_hardirq_enabled()) {
+		trace_mcuspi_irq_hardirq(mcuspi->name, -1, 0, mcuspi_rx_count(mcuspi));
+	}
+	return IRQ_WAKE_THREAD;
+}
 
-/* Writing from the terminal command line, \n is added */
-static ssize_t mcuspi_write_file(struct file *file, const char __user *userbuf,
-                                   size_t count, loff_t *ppos)
+/* 
+ * The MCU has another frame ready: MCUSPI_LINK_MORE in the frame just read,
+ * or "int" still low with "dozh,int-level".
+ */
+static bool mcuspi_rx_more(struct mcuspi_dev *mcuspi, const uint8_t *buf, int status)
 {
-	int ret = 0;
-	int offset = 0;
-	struct mcuspi_dev * mcuspi;
-	struct mcu_message * mcu_msg;
-	uint8_t * sendbuf = NULL;
+	/* the frame itself was good, it may be a duplicate or find its ring full */
+	if ((mcuspi->features & MCUSPI_FEAT_LINK) &&
+	    (status == 0 || status == -ENOSPC || status == -EALREADY) &&
+	    (buf[PREAMBLE_LENGTH + SERIAL_NO_LENGTH + MCUSPI_LINK_CTRL_OFFSET] & MCUSPI_LINK_MORE)) {
+		return true;
+	}
+	return (mcuspi->features & MCUSPI_FEAT_INT_LEVEL) &&
+	       gpiod_get_raw_value_cansleep(mcuspi->int_gpio) == 0;
+}
 
-	mcuspi = container_of(file->private_data,
-			     struct mcuspi_dev, 
-			     mcu_spi_miscdevice);
-/*
-	dev_info(&mcuspi->spid->dev, 
-		 "mcuspi_write_file entered on %s\n", mcuspi->name);
+/* the isr thread takes the bus if it is idle */
+static bool mcuspi_bus_try_rx(struct mcuspi_dev *mcuspi)
+{
+	unsigned long flags;
+	bool idle;
 
-	dev_info(&mcuspi->spid->dev,
-		 "we have written %zu characters to file\n", count); 
-*/
-	mcu_msg = mcuspi->send_msg;
-	if (!mcu_msg) {
-		return -EFAULT; 
-	}
-	mcu_msg->payload_length = max(count, 0);
-	mcu_msg->payload_length = min(count, MAX_PAYLOAD_LENGTH);
-	offset = min(*ppos, MAX_PAYLOAD_LENGTH - mcu_msg->payload_length);
-	offset = max(offset, 0);
-	if (mcu_msg->payload_length > 0) {
-		if(copy_from_user(mcu_msg->payload, userbuf, mcu_msg->payload_length)) {
-			dev_err(&mcuspi->spid->dev, "Bad copied value\n");
-			return -EFAULT;
-		}
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	idle = mcuspi->bus_state == MCUSPI_BUS_IDLE;
+	if (idle) {
+		mcuspi->bus_state = MCUSPI_BUS_RX;
 	}
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	return idle;
+}
 
-	sendbuf = kzalloc(MAX_PACKET_LENGTH, GFP_KERNEL);
-	if (!sendbuf) {
-		return -ENOMEM; 
+/* 
+ * The isr thread owns the bus between mcuspi_bus_rx_begin and
+ * mcuspi_bus_rx_end. It waits for the tx batch in flight, rx_pending keeps
+ * new batches back meanwhile, see mcuspi_tx_build_batch.
+ */
+static void mcuspi_bus_rx_begin(struct mcuspi_dev *mcuspi)
+{
+	if (!mcuspi_bus_try_rx(mcuspi)) {
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_ISR_TX_WAITS);
+		wait_event(mcuspi->tx_wait, mcuspi_bus_try_rx(mcuspi));
 	}
-	pack_one_mcu_message(mcu_msg, sendbuf);
-	
-	ret |= data_write_to_bus(mcuspi, sendbuf, MAX_PACKET_LENGTH); //it use a fixed length(MAX_PACKET_LENGTH) in PHY.
-
-	kfree(sendbuf);
-
-	if (ret < 0) 
-		dev_err(&mcuspi->spid->dev, "the device is not found, ERRNO: %d\n", ret);
-		/*
-	else
-		dev_info(&mcuspi->spid->dev, "we have written %zu characters to spi bus.\n", count); 
-		*/
-/*
-	dev_info(&mcuspi->spid->dev, 
-		 "mcuspi_write_file exited on %s\n", mcuspi->name);
-*/
-	return count;
 }
 
-static irqreturn_t mcu_spi_set_intr_busy(int irq_no, void *data)
+/* more: the isr thread reads the next frame of a burst right away */
+static void mcuspi_bus_rx_end(struct mcuspi_dev *mcuspi, bool more)
 {
+	unsigned long flags;
 
-	struct mcuspi_dev * mcuspi = data;
-	mcuspi->intr_recv_not_comp = true;
-	return IRQ_WAKE_THREAD;
+	spin_lock_irqsave(&mcuspi->tx_spin, flags);
+	mcuspi->bus_state = MCUSPI_BUS_IDLE;
+	WRITE_ONCE(mcuspi->rx_pending, more);
+	spin_unlock_irqrestore(&mcuspi->tx_spin, flags);
+	mcuspi_tx_kick(mcuspi);
 }
 
-static irqreturn_t mcu_spi_isr(int irq_no, void *data)
+/* 
+ * Read and queue one frame for the isr thread, readers to wake are added to
+ * wake. more is whether the burst may go on on input, whether the MCU has the
+ * next frame ready on output, tx then keeps waiting for it.
+ */
+static int mcuspi_isr_read_one(struct mcuspi_dev *mcuspi, uint8_t *buf, unsigned long *wake,
+			       bool *more)
 {
-	int val;
-	struct mcuspi_dev * mcuspi = data;
-	uint8_t *buf;
 	int status = 0;
-	int payload_length = 0;
-	uint32_t checksum;
 
-	//dev_info(&mcuspi->spid->dev, "interrupt received. device: %s\n", mcuspi->name);
-	buf = kzalloc(MAX_PACKET_LENGTH, GFP_KERNEL);
-	if (!buf) {
-		dev_info(&mcuspi->spid->dev, "allocate memory fail in isr. device: %s\n", mcuspi->name);
-		mcuspi->intr_recv_not_comp = false;
-		return IRQ_HANDLED;
-	}
+	mcuspi_bus_rx_begin(mcuspi);
 	status = data_read_from_bus(mcuspi, buf, MAX_PACKET_LENGTH); 
-	if (status) {
-		dev_info(&mcuspi->spid->dev, "spi read fail in isr. device: %s\n", mcuspi->name);
-		kfree(buf);
-		mcuspi->intr_recv_not_comp = false;
-		return IRQ_HANDLED;
+	if (trace_mcuspi_spi_rx_done_enabled()) {
+		trace_mcuspi_spi_rx_done(mcuspi->name, status > 0 && buf[0] == MCUSPI_PREAMBLE ? buf[PREAMBLE_LENGTH] : -1,
+				max(status, 0), mcuspi_rx_count(mcuspi));
 	}
-	mcuspi->intr_recv_not_comp = false;
-	
-	//dev_dump_hex(buf, MAX_PACKET_LENGTH);
-	//TODO: write a unpack func.
-	payload_length = *(uint16_t *)(buf + PAYLOAD_SHIFT - 2);
-	payload_length = max(payload_length, 0);
-	payload_length = min(payload_length, MAX_PAYLOAD_LENGTH);
-	checksum = ~crc32(0xFFFFFFFF, buf, HEAD_LENGTH + payload_length);
-	//dev_info(&mcuspi->spid->dev, "crc32 checksum = %08x, msg_checksum = %08x\n", checksum, *(uint32_t *)(buf + PAYLOAD_SHIFT + payload_length));
-	if (checksum != *(uint32_t *)(buf + PAYLOAD_SHIFT + payload_length)) {
-		dev_info(&mcuspi->spid->dev, "crc32 checksum mismatch in isr. device: %s\nchecksum = %08x, msg_checksum = %08x\n", 
-					mcuspi->name, checksum, *(uint32_t *)(buf + PAYLOAD_SHIFT + payload_length));
-		kfree(buf);
-		//mcuspi->intr_recv_not_comp = false;
-		return IRQ_HANDLED;
+	if (status >= 0) {
+		//dev_dump_hex(buf, MAX_PACKET_LENGTH);
+		status = receive_one_mcu_frame(mcuspi, buf, status, wake);
 	}
-	/*
-	dev_info(&mcuspi->spid->dev,
-		 "store_one_mcu_message_to_queue, payload_length:%d, PREAMBLE_LENGTH + SERIAL_NO_LENGTH:%d, PAYLOAD_SHIFT:%d\n", 
-		 		payload_length, PREAMBLE_LENGTH + SERIAL_NO_LENGTH, PAYLOAD_SHIFT);
-
-	dev_info(&mcuspi->spid->dev,
-		 "store_one_mcu_message_to_queue, buf:%ld, payload_desc:%ld, payload:%ld\n", 
-		 		buf, buf + PREAMBLE_LENGTH + SERIAL_NO_LENGTH, buf + PAYLOAD_SHIFT);
+	*more = *more && mcuspi_rx_more(mcuspi, buf, status);
+	mcuspi_bus_rx_end(mcuspi, *more);
+	if (status == 0) {
+		mcuspi_hist_add(mcuspi->stats, MCUSPI_HIST_IRQ_TO_QUEUE, ktime_get_ns() - mcuspi->irq_ns);
+	} else if (status == -ENODATA) {
+		/* the frame went out along with a tx frame, the MCU is idle now */
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_IDLE);
+	} else if (status == -EBADMSG) {
+		dev_info_ratelimited(&mcuspi->spid->dev, "bad length or crc32 in isr. device: %s\n", mcuspi->name);
+	} else if (status == -ENOSPC) {
+		dev_info_ratelimited(&mcuspi->spid->dev, "receive queue full in isr. device: %s\n", mcuspi->name);
+	} else if (status == -EALREADY) {
+		/* duplicate frame, counted and dropped */
+	} else {
+		dev_info_ratelimited(&mcuspi->spid->dev, "spi read fail in isr. errno:%d device: %s\n", status, mcuspi->name);
+	}
+	return status;
+}
 
-	*/
-	status = store_one_mcu_message_to_queue(mcuspi->recv_msg_queue, 
-			payload_length, buf + PREAMBLE_LENGTH + SERIAL_NO_LENGTH, buf + PAYLOAD_SHIFT);
-	kfree(buf);
+/* 
+ * Threaded handler of "int". It keeps reading while the MCU has frames
+ * ready, up to MCUSPI_RX_BURST of them, then wakes its own thread again for
+ * the rest of the burst. A tx batch goes out between two
+ * reads only once it has waited tx_starve_us. Readers are woken once at the end of the burst, or once
+ * rx_coalesce_us has passed since the first frame they were not woken for.
+ */
+static irqreturn_t mcu_spi_isr(int irq_no, void *data)
+{
+	struct mcuspi_dev * mcuspi = data;
+	uint8_t *buf;
+	unsigned long wake = 0;
+	u64 window_ns = (u64)READ_ONCE(rx_coalesce_us) * NSEC_PER_USEC;
+	u64 wake_ns = 0;
+	bool more;
+	int n = 0;
 
-	if (status) {
-		dev_info(&mcuspi->spid->dev, "store msg fail in isr. errno:%d device: %s\n", status, mcuspi->name);
+	//dev_info(&mcuspi->spid->dev, "interrupt received. device: %s\n", mcuspi->name);
+	buf = mcuspi->isr_buf; /* IRQF_ONESHOT, only one isr thread use it at a time */
+	for (;;) {
+		more = !READ_ONCE(mcuspi->tx_stop);
+		mcuspi_isr_read_one(mcuspi, buf, &wake, &more);
+		if (wake && !wake_ns) {
+			wake_ns = ktime_get_ns();
+		}
+		if (wake && ktime_get_ns() - wake_ns >= window_ns) {
+			mcuspi_rx_wake(mcuspi, wake);
+			wake = 0;
+			wake_ns = 0;
+		}
+		if (!more) {
+			break;
+		}
+		/* as mcu_spi_set_intr_busy does for an edge */
+		mcuspi->irq_ns = ktime_get_ns();
+		mcuspi_stat_inc(mcuspi->stats, MCUSPI_CNT_RX_BURST_READS);
+		if (++n >= MCUSPI_RX_BURST) {
+			/* rx_pending stays set, tx keeps waiting for the next run */
+			irq_wake_thread(irq_no, mcuspi);
+			break;
+		}
 	}
+	mcuspi_rx_wake(mcuspi, wake);
 
-	
 	return IRQ_HANDLED;
 }
 
@@ -651,24 +3273,61 @@ static ssize_t recv_remain_msg_count_show(struct file *filp, struct kobject *kob
 {
 	struct mcuspi_dev * mcuspi;
 	struct spi_device * spid;
-	struct mcu_message_queue * msg_queue;
+	int16_t msg_count;
 
 	spid = to_spi_device(kobj_to_dev(kobj->parent));
 	mcuspi = spi_get_drvdata(spid);
-	msg_queue = mcuspi->recv_msg_queue;
+	msg_count = mcuspi_rx_count(mcuspi); /* of every class */
 
 	/*
 	dev_info(&mcuspi->spid->dev,
 		 "recv_remain_msg_count_show, spid:%p, mcuspi:%p, msg_queue:%p, msg_cnt:%d\n", 
-	 		spid, mcuspi, msg_queue, msg_queue->msg_count);
+	 		spid, mcuspi, msg_queue, msg_count);
 	*/
-	count = min(count, sizeof(msg_queue->msg_count));
-	off = min(off, sizeof(msg_queue->msg_count) - count);
-	memcpy(buf, &(msg_queue->msg_count) + off, count);
+	count = min(count, sizeof(msg_count));
+	off = min(off, sizeof(msg_count) - count);
+	memcpy(buf, (uint8_t *)&msg_count + off, count);
 	return count;
 }
 static BIN_ATTR(remain_msg_count, S_IRUGO, recv_remain_msg_count_show, NULL);
 
+/* frames dropped because the ring of their class was full, of every class */
+static ssize_t recv_queue_full_show(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct mcuspi_dev * mcuspi;
+	struct spi_device * spid;
+	uint32_t queue_full;
+
+	spid = to_spi_device(kobj_to_dev(kobj->parent));
+	mcuspi = spi_get_drvdata(spid);
+	queue_full = mcuspi_stat_sum(mcuspi->stats, MCUSPI_CNT_RX_QUEUE_FULL);
+
+	count = min(count, sizeof(queue_full));
+	off = min(off, sizeof(queue_full) - count);
+	memcpy(buf, (uint8_t *)&queue_full + off, count);
+	return count;
+}
+static BIN_ATTR(queue_full, S_IRUGO, recv_queue_full_show, NULL);
+
+static ssize_t recv_rx_errors_show(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct mcuspi_dev * mcuspi;
+	struct spi_device * spid;
+	uint32_t rx_errors;
+
+	spid = to_spi_device(kobj_to_dev(kobj->parent));
+	mcuspi = spi_get_drvdata(spid);
+	rx_errors = mcuspi_stat_sum(mcuspi->stats, MCUSPI_CNT_RX_BAD_FRAMES);
+
+	count = min(count, sizeof(rx_errors));
+	off = min(off, sizeof(rx_errors) - count);
+	memcpy(buf, (uint8_t *)&rx_errors + off, count);
+	return count;
+}
+static BIN_ATTR(rx_errors, S_IRUGO, recv_rx_errors_show, NULL);
+
 static ssize_t recv_get_msg_store(struct file *filp, struct kobject *kobj,
 		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
 {
@@ -680,7 +3339,7 @@ static ssize_t recv_get_msg_store(struct file *filp, struct kobject *kobj,
 
 	spid = to_spi_device(kobj_to_dev(kobj->parent));
 	mcuspi = spi_get_drvdata(spid);
-	msg_queue = mcuspi->recv_msg_queue;
+	msg_queue = mcuspi_rx_queue(mcuspi, NULL); /* highest class with a msg */
 	mcu_msg = mcuspi->recv_msg;
 
 	load_one_mcu_message_from_queue(msg_queue, mcu_msg);
@@ -694,6 +3353,8 @@ static struct bin_attribute *recv_msg_attributes[] = {
 	&bin_attr_recv_payload_len,
 	&bin_attr_recv_payload_desc,
 	&bin_attr_remain_msg_count,
+	&bin_attr_queue_full,
+	&bin_attr_rx_errors,
 	&bin_attr_get_msg,
 	NULL
 };
@@ -781,7 +3442,6 @@ static ssize_t send_put_msg_store(struct file *filp, struct kobject *kobj,
 	struct mcuspi_dev * mcuspi;
 	struct spi_device * spid;
 	struct mcu_message * mcu_msg;
-	uint8_t * sendbuf = NULL;
 	int ret = 0;
 
 	spid = to_spi_device(kobj_to_dev(kobj->parent));
@@ -790,15 +3450,7 @@ static ssize_t send_put_msg_store(struct file *filp, struct kobject *kobj,
 	if (!mcu_msg) {
 		return -EFAULT; 
 	}
-	sendbuf = kzalloc(MAX_PACKET_LENGTH, GFP_KERNEL);
-	if (!sendbuf) {
-		return -ENOMEM; 
-	}
-	pack_one_mcu_message(mcu_msg, sendbuf);
-	
-	ret |= data_write_to_bus(mcuspi, sendbuf, MAX_PACKET_LENGTH); //it use a fixed length(MAX_PACKET_LENGTH) in PHY.
-
-	kfree(sendbuf);
+	ret = send_one_mcu_message(mcuspi, mcu_msg, false);
 
 	if (ret) {
 		return -EFAULT;
@@ -808,12 +3460,31 @@ static ssize_t send_put_msg_store(struct file *filp, struct kobject *kobj,
 }
 static BIN_ATTR(put_msg, S_IWUSR|S_IWGRP, NULL, send_put_msg_store);
 
+static ssize_t send_tx_errors_show(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct mcuspi_dev * mcuspi;
+	struct spi_device * spid;
+	uint32_t tx_errors;
+
+	spid = to_spi_device(kobj_to_dev(kobj->parent));
+	mcuspi = spi_get_drvdata(spid);
+	tx_errors = mcuspi_stat_sum(mcuspi->stats, MCUSPI_CNT_TX_ERRORS);
+
+	count = min(count, sizeof(tx_errors));
+	off = min(off, sizeof(tx_errors) - count);
+	memcpy(buf, (uint8_t *)&tx_errors + off, count);
+	return count;
+}
+static BIN_ATTR(tx_errors, S_IRUGO, send_tx_errors_show, NULL);
+
 
 static struct bin_attribute *send_msg_attributes[] = {
 	&bin_attr_send_payload,
 	&bin_attr_send_payload_len,
 	&bin_attr_send_payload_desc,
 	&bin_attr_put_msg,
+	&bin_attr_tx_errors,
 	NULL
 };
 
@@ -828,13 +3499,259 @@ static const struct attribute_group *msg_attr_groups[] = {
 	NULL,
 };
 
+/* debugfs <name>/stats, counters and non-empty histogram buckets */
+static int mcuspi_stats_show(struct seq_file *s, void *unused)
+{
+	struct mcuspi_dev * mcuspi = s->private;
+	u64 hist[MCUSPI_HIST_BUCKETS];
+	int i, b, cpu;
+
+	for (i = 0; i < MCUSPI_CNT_NR; i++) {
+		seq_printf(s, "%-16s %llu\n", mcuspi_counter_names[i], mcuspi_stat_sum(mcuspi->stats, i));
+	}
+	for (i = 0; i < MCUSPI_HIST_NR; i++) {
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu) {
+			for (b = 0; b < MCUSPI_HIST_BUCKETS; b++) {
+				hist[b] += per_cpu_ptr(mcuspi->stats, cpu)->hist[i][b];
+			}
+		}
+		seq_printf(s, "\n%s_ns:\n", mcuspi_hist_names[i]);
+		for (b = 0; b < MCUSPI_HIST_BUCKETS; b++) {
+			if (hist[b]) {
+				seq_printf(s, "  >= 2^%-2d %llu\n", b, hist[b]);
+			}
+		}
+	}
+	if (mcuspi->nr_classes == 1) {
+		return 0;
+	}
+	for (i = 0; i < mcuspi->nr_classes; i++) {
+		u64 frames = 0, full = 0;
+
+		memset(hist, 0, sizeof(hist));
+		for_each_possible_cpu(cpu) {
+			struct mcuspi_stats * st = per_cpu_ptr(mcuspi->stats, cpu);
+
+			frames += st->class_cnt[i][MCUSPI_CLASS_CNT_FRAMES];
+			full += st->class_cnt[i][MCUSPI_CLASS_CNT_QUEUE_FULL];
+			for (b = 0; b < MCUSPI_HIST_BUCKETS; b++) {
+				hist[b] += st->class_hist[i][b];
+			}
+		}
+		seq_printf(s, "\nclass%d depth %u rx_frames %llu rx_queue_full %llu\n",
+			   i, mcuspi->recv_queues[i] ? mcuspi->recv_queues[i]->mask + 1 : 0, frames, full);
+		seq_printf(s, "class%d_%s_ns:\n", i, mcuspi_hist_names[MCUSPI_HIST_RESIDENCY]);
+		for (b = 0; b < MCUSPI_HIST_BUCKETS; b++) {
+			if (hist[b]) {
+				seq_printf(s, "  >= 2^%-2d %llu\n", b, hist[b]);
+			}
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mcuspi_stats);
+
 /* declare a file_operations structure */
 static const struct file_operations mcuspi_fops = {
 	.owner = THIS_MODULE,
+	.open = mcuspi_open_file,
+	.release = mcuspi_release_file,
+	.unlocked_ioctl = mcuspi_ioctl_file,
+	.compat_ioctl = compat_ptr_ioctl,
+	.read = mcuspi_read_file,
+	.write = mcuspi_write_file,
+	.mmap = mcuspi_mmap_file,
+	.poll = mcuspi_poll_file,
+};
+
+static const struct file_operations mcuspi_class_fops = {
+	.owner = THIS_MODULE,
+	.open = mcuspi_open_class_file,
+	.release = mcuspi_release_file,
+	.unlocked_ioctl = mcuspi_ioctl_file,
+	.compat_ioctl = compat_ptr_ioctl,
 	.read = mcuspi_read_file,
 	.write = mcuspi_write_file,
+	.mmap = mcuspi_mmap_file,
+	.poll = mcuspi_poll_file,
 };
 
+/* 
+ * Overflow policy of the receive rings from "dozh,rx-overflow", else the
+ * rx_overflow module parameter. block needs the "ready" gpio, it is driven
+ * from the isr thread and must not sleep.
+ */
+static int mcuspi_init_rx_overflow(struct mcuspi_dev *mcuspi)
+{
+	struct device * dev = &mcuspi->spid->dev;
+	const char * policy = rx_overflow;
+	int ret;
+
+	device_property_read_string(dev, "dozh,rx-overflow", &policy);
+	ret = match_string(mcuspi_overflow_names, ARRAY_SIZE(mcuspi_overflow_names), policy);
+	if (ret < 0) {
+		dev_err(dev, "unknown receive overflow policy %s\n", policy);
+		return ret;
+	}
+	mcuspi->overflow = ret;
+
+	mcuspi->ready_gpio = devm_gpiod_get_optional(dev, "ready", GPIOD_OUT_HIGH);
+	if (IS_ERR(mcuspi->ready_gpio)) {
+		return PTR_ERR(mcuspi->ready_gpio);
+	}
+	if (mcuspi->overflow == MCUSPI_OVERFLOW_BLOCK &&
+	    (!mcuspi->ready_gpio || gpiod_cansleep(mcuspi->ready_gpio))) {
+		dev_err(dev, "block overflow policy needs a non sleeping ready gpio\n");
+		return -EINVAL;
+	}
+	dev_info(dev, "receive overflow policy: %s\n", mcuspi_overflow_names[mcuspi->overflow]);
+	return 0;
+}
+
+/* 
+ * Receive classes from "dozh,rx-class-depths", the ring depth of each class,
+ * class 0 first. Without it there is one class of rx_depth slots.
+ */
+static int mcuspi_init_rx_classes(struct mcuspi_dev *mcuspi)
+{
+	struct device * dev = &mcuspi->spid->dev;
+	u32 depths[MCUSPI_MAX_CLASSES] = { rx_depth };
+	int i, nr, ret;
+
+	ret = mcuspi_init_rx_overflow(mcuspi);
+	if (ret) {
+		return ret;
+	}
+
+	nr = device_property_count_u32(dev, "dozh,rx-class-depths");
+	if (nr > MCUSPI_MAX_CLASSES) {
+		dev_err(dev, "at most %d receive classes\n", MCUSPI_MAX_CLASSES);
+		return -EINVAL;
+	}
+	if (nr > 0) {
+		ret = device_property_read_u32_array(dev, "dozh,rx-class-depths", depths, nr);
+		if (ret) {
+			return ret;
+		}
+	} else {
+		nr = 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		ret = init_mcu_message_queue(&mcuspi->recv_queues[i],
+				roundup_pow_of_two(clamp_t(u32, depths[i], 2, MCUSPI_MAX_RING_DEPTH)));
+		if (ret) {
+			return ret;
+		}
+		mcuspi->recv_queues[i]->class = i;
+		mcuspi->recv_queues[i]->overflow = mcuspi->overflow;
+		mcuspi->recv_queues[i]->mcuspi = mcuspi;
+		mcuspi->recv_queues[i]->stats = mcuspi->stats;
+		mcuspi->recv_queues[i]->name = mcuspi->name;
+		mcuspi->nr_classes = i + 1;
+	}
+	if (nr == 1) {
+		dev_info(dev, "receive ring: %u slots\n", mcuspi->recv_queues[0]->mask + 1);
+		return 0;
+	}
+
+	mcuspi->classes = devm_kcalloc(dev, nr, sizeof(*mcuspi->classes), GFP_KERNEL);
+	if (!mcuspi->classes) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr; i++) {
+		mcuspi->classes[i].mcuspi = mcuspi;
+		mcuspi->classes[i].class = i;
+		snprintf(mcuspi->classes[i].name, sizeof(mcuspi->classes[i].name), "%s-c%d",
+			 mcuspi->name, i);
+		mcuspi->classes[i].miscdevice.name = mcuspi->classes[i].name;
+		mcuspi->classes[i].miscdevice.minor = MISC_DYNAMIC_MINOR;
+		mcuspi->classes[i].miscdevice.fops = &mcuspi_class_fops;
+		ret = misc_register(&mcuspi->classes[i].miscdevice);
+		if (ret) {
+			dev_err(dev, "register %s failed\n", mcuspi->classes[i].name);
+			return ret;
+		}
+		dev_info(dev, "receive class %d: %u slots, %s\n", i,
+			 mcuspi->recv_queues[i]->mask + 1, mcuspi->classes[i].name);
+	}
+	return 0;
+}
+
+/* fresh credits are sent when a quarter of the credits of empty rings is left */
+static int mcuspi_init_rx_credits(struct mcuspi_dev *mcuspi)
+{
+	int credits = mcuspi_rx_credits(mcuspi);
+
+	if (credits < 2) {
+		dev_err(&mcuspi->spid->dev, "receive rings too small for dozh,rx-credits\n");
+		return -EINVAL;
+	}
+	mcuspi->rx_credit_low = clamp_t(int, credits / 4, 1, MCUSPI_CREDIT_LOW);
+	dev_info(&mcuspi->spid->dev, "receive credits: %d, refreshed at %d\n",
+		 credits, mcuspi->rx_credit_low);
+	return 0;
+}
+
+/* reassembly buffers of "dozh,fragments", rx_frag_max bytes each */
+static int mcuspi_init_rx_frags(struct mcuspi_dev *mcuspi)
+{
+	struct mcuspi_frag_msg * msg;
+	size_t size;
+	int i;
+
+	spin_lock_init(&mcuspi->frag_lock);
+	INIT_LIST_HEAD(&mcuspi->frag_done);
+	INIT_LIST_HEAD(&mcuspi->frag_free);
+	mcuspi->frag_max = clamp_t(u32, roundup(rx_frag_max, MAX_PAYLOAD_LENGTH),
+				MAX_PAYLOAD_LENGTH, MCUSPI_MAX_FRAGS * MAX_PAYLOAD_LENGTH);
+	size = ALIGN(struct_size(msg, payload, mcuspi->frag_max), sizeof(u64));
+	mcuspi->frag_pool = vzalloc(MCUSPI_FRAG_BUFS * size);
+	if (!mcuspi->frag_pool) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < MCUSPI_FRAG_BUFS; i++) {
+		msg = mcuspi->frag_pool + i * size;
+		list_add_tail(&msg->node, &mcuspi->frag_free);
+	}
+	dev_info(&mcuspi->spid->dev, "fragments: %d reassembly buffers of %u bytes\n",
+		 MCUSPI_FRAG_BUFS, mcuspi->frag_max);
+	return 0;
+}
+
+/* the rings are freed with the device, open files may still read them */
+static void mcuspi_deinit_rx_classes(struct mcuspi_dev *mcuspi)
+{
+	int i;
+
+	for (i = 0; mcuspi->classes && i < mcuspi->nr_classes; i++) {
+		if (mcuspi->classes[i].miscdevice.this_device) {
+			misc_deregister(&mcuspi->classes[i].miscdevice);
+		}
+	}
+}
+
+/* last put of mcuspi_dev, by remove or by the release of the last open file */
+static void mcuspi_dev_release(struct kref *kref)
+{
+	struct mcuspi_dev * mcuspi = container_of(kref, struct mcuspi_dev, kref);
+	int i;
+
+	for (i = 0; i < mcuspi->nr_classes; i++) {
+		deinit_mcu_message_queue(mcuspi->recv_queues[i]);
+	}
+	vfree(mcuspi->frag_pool);
+	kvfree(mcuspi->shared_pool);
+	deinit_mcu_message(mcuspi->send_msg);
+	deinit_mcu_message(mcuspi->recv_msg);
+	deinit_mcuspi_tx_queue(mcuspi);
+	kfree(mcuspi->tx_compress_buf);
+	free_percpu(mcuspi->stats);
+	put_device(&mcuspi->spid->dev);
+	kfree(mcuspi);
+}
+
 static int mcu_spi_init_sysfs(struct spi_device *spid) 
 {
 	int ret = 0;
@@ -845,20 +3762,35 @@ static int mcu_spi_init_sysfs(struct spi_device *spid)
                                              &spid->dev.kobj);
 	if (!mcuspi->send_subdir) {
 		dev_err(&spid->dev, "create send_subdir failed\n");
-		return -EFAULT;
+		return -ENOMEM;
 	}
 	for (i = 0; send_msg_attributes[i]; i++) {
-		ret |= sysfs_create_bin_file(mcuspi->send_subdir, send_msg_attributes[i]);
+		ret = sysfs_create_bin_file(mcuspi->send_subdir, send_msg_attributes[i]);
+		if (ret) {
+			goto err;
+		}
 	}
 	mcuspi->recv_subdir = kobject_create_and_add(recv_msg_attr_group.name,
                                              &spid->dev.kobj);
 	if (!mcuspi->recv_subdir) {
 		dev_err(&spid->dev, "create recv_subdir failed\n");
-		return -EFAULT;
+		ret = -ENOMEM;
+		goto err;
 	}
 	for (i = 0; recv_msg_attributes[i]; i++) {
-		ret |= sysfs_create_bin_file(mcuspi->recv_subdir, recv_msg_attributes[i]);
+		ret = sysfs_create_bin_file(mcuspi->recv_subdir, recv_msg_attributes[i]);
+		if (ret) {
+			goto err;
+		}
 	}
+	return 0;
+
+err:
+	/* the put removes the directory with the files created in it */
+	kobject_put(mcuspi->recv_subdir);
+	kobject_put(mcuspi->send_subdir);
+	mcuspi->recv_subdir = NULL;
+	mcuspi->send_subdir = NULL;
 	return ret;
 }
 
@@ -909,78 +3841,218 @@ static int mcu_spi_probe(struct spi_device *spid)
 
 	struct gpio_desc *interrupt_gpio;
 	int irq_no;
+	unsigned long irq_flags;
 
 	/* Allocate new structure representing device */
-	mcuspi = devm_kzalloc(&spid->dev, sizeof(struct mcuspi_dev), GFP_KERNEL); //should free automatic.
+	mcuspi = kzalloc(sizeof(struct mcuspi_dev), GFP_KERNEL); //freed by mcuspi_dev_release
 	if (!mcuspi) {
 		dev_err(&spid->dev, "mcuspi mem allocation failed!\n");
 		return -ENOMEM;
 	}
+	kref_init(&mcuspi->kref);
+	spin_lock_init(&mcuspi->dead_lock);
 	/* Store pointer to the device-structure in bus device context */
 	spi_set_drvdata(spid, mcuspi);
 
-	/* Store pointer to SPI device/client */
+	/* Store pointer to SPI device/client, open files may outlive remove */
 	mcuspi->spid = spid;
-	/* init mutex lock */
-	mutex_init(&mcuspi->bus_lock);
-	/* init interrupt in progress flag and unexpected data ptr */
-	mcuspi->intr_recv_not_comp = false;
-	mcuspi->unexpected_recv_data_when_send = NULL;
+	get_device(&spid->dev);
+	init_waitqueue_head(&mcuspi->recv_wait);
+	/* the bus is idle, no isr read pending */
+	mcuspi->bus_state = MCUSPI_BUS_IDLE;
+	mcuspi->rx_pending = false;
+	/* protocol features supported by the MCU firmware */
+	if (device_property_read_bool(&spid->dev, "dozh,variable-length")) {
+		mcuspi->features |= MCUSPI_FEAT_VARLEN;
+		device_property_read_u32(&spid->dev, "dozh,head-gap-us", &mcuspi->head_gap_us);
+	}
+	if (device_property_read_bool(&spid->dev, "dozh,link-control")) {
+		mcuspi->features |= MCUSPI_FEAT_LINK;
+	}
+	if (device_property_read_bool(&spid->dev, "dozh,int-level")) {
+		mcuspi->features |= MCUSPI_FEAT_INT_LEVEL;
+	}
+	if (device_property_read_bool(&spid->dev, "dozh,rx-credits")) {
+		if (!(mcuspi->features & MCUSPI_FEAT_LINK)) {
+			dev_err(&spid->dev, "dozh,rx-credits needs dozh,link-control\n");
+			err = -EINVAL;
+			goto err_put;
+		}
+		mcuspi->features |= MCUSPI_FEAT_CREDITS;
+	}
+	if (device_property_read_bool(&spid->dev, "dozh,fragments")) {
+		if (!(mcuspi->features & MCUSPI_FEAT_LINK)) {
+			dev_err(&spid->dev, "dozh,fragments needs dozh,link-control\n");
+			err = -EINVAL;
+			goto err_put;
+		}
+		mcuspi->features |= MCUSPI_FEAT_FRAG;
+	}
+	/* a mask of 0 still takes compressed frames from the MCU */
+	if (!device_property_read_u32(&spid->dev, "dozh,compress-classes", &mcuspi->compress_classes)) {
+		if (!(mcuspi->features & MCUSPI_FEAT_LINK)) {
+			dev_err(&spid->dev, "dozh,compress-classes needs dozh,link-control\n");
+			err = -EINVAL;
+			goto err_put;
+		}
+		mcuspi->features |= MCUSPI_FEAT_COMPRESS;
+	}
+	INIT_LIST_HEAD(&mcuspi->subs);
+	mutex_init(&mcuspi->subs_lock);
+	INIT_LIST_HEAD(&mcuspi->shared_free);
+	spin_lock_init(&mcuspi->shared_lock);
+	/* sequence numbers of both directions */
+	spin_lock_init(&mcuspi->rx_seq_lock);
+	mcuspi->rx_expected = -1;
+	INIT_WORK(&mcuspi->link_work, mcuspi_link_work);
+	INIT_WORK(&mcuspi->tx_rx_work, mcuspi_tx_rx_work);
+	spin_lock_init(&mcuspi->flow_lock);
+	INIT_DELAYED_WORK(&mcuspi->flow_work, mcuspi_flow_work);
+	mcuspi->stats = alloc_percpu(struct mcuspi_stats);
+	if (!mcuspi->stats) {
+		dev_err(&spid->dev, "mcuspi stats allocation failed!\n");
+		err = -ENOMEM;
+		goto err_put;
+	}
+	/* frame checksum, self tested against crc32_le */
+	mcuspi->crc = mcuspi_select_crc(&spid->dev);
+	dev_info(&spid->dev, "The crc32 backend is: %s\n", mcuspi->crc->name);
+	/* frame buffer of isr, must exist before the irq is requested */
+	mcuspi->isr_buf = devm_kzalloc(&spid->dev, mcu_rx_buf_length(mcuspi), GFP_KERNEL);
+	if (!mcuspi->isr_buf) {
+		dev_err(&spid->dev, "mcuspi isr_buf allocation failed!\n");
+		err = -ENOMEM;
+		goto err_put;
+	}
+	if (mcuspi->features & MCUSPI_FEAT_COMPRESS) {
+		mcuspi->tx_compress_buf = kzalloc(MAX_PAYLOAD_LENGTH, GFP_KERNEL);
+		if (!mcuspi->tx_compress_buf) {
+			dev_err(&spid->dev, "mcuspi tx_compress_buf allocation failed!\n");
+			err = -ENOMEM;
+			goto err_put;
+		}
+		dev_info(&spid->dev, "compressed classes: 0x%x\n", mcuspi->compress_classes);
+	}
+	/* tx queue, used by the isr to resume tx after a read */
+	ret = init_mcuspi_tx_queue(mcuspi);
+	if (ret) {
+		dev_err(&spid->dev, "mcuspi tx queue allocation failed!\n");
+		err = ret;
+		goto err_put;
+	}
 	/* Initialize the misc device, mcuspi incremented after each probe call */
 	sprintf(mcuspi->name, "mcuspi%01d", counter++); 
 	dev_info(&spid->dev, 
 		 "mcu_spi_probe is entered on %s\n", mcuspi->name);
+	mcuspi->debugfs = debugfs_create_dir(mcuspi->name, NULL);
+	debugfs_create_file("stats", 0444, mcuspi->debugfs, mcuspi, &mcuspi_stats_fops);
+	debugfs_create_u32("inject_rx_errors", 0644, mcuspi->debugfs, &mcuspi->inject_rx_errors);
+	/* receive rings, the isr stores to them once the irq is requested */
+	ret = mcuspi_init_rx_classes(mcuspi);
+	if (!ret && (mcuspi->features & MCUSPI_FEAT_CREDITS)) {
+		ret = mcuspi_init_rx_credits(mcuspi);
+	}
+	if (!ret && (mcuspi->features & MCUSPI_FEAT_FRAG)) {
+		ret = mcuspi_init_rx_frags(mcuspi);
+	}
+	if (!ret) {
+		ret = init_mcu_message(&mcuspi->send_msg);
+	}
+	if (!ret) {
+		ret = init_mcu_message(&mcuspi->recv_msg);
+	}
+	if (ret) {
+		err = ret;
+		goto err_rx_classes;
+	}
 
 	mcuspi->mcu_spi_miscdevice.name = mcuspi->name;
 	mcuspi->mcu_spi_miscdevice.minor = MISC_DYNAMIC_MINOR;
 	mcuspi->mcu_spi_miscdevice.fops = &mcuspi_fops;
 
-    /* Get GPIO start with "int" in device tree */
-	interrupt_gpio = devm_gpiod_get(&spid->dev, "int", GPIOD_IN);
+    /* 
+     * Get GPIO start with "int" in device tree. Without it the interrupt of
+     * the spi device itself is used, with the trigger type it was set up
+     * with, so a controller without gpios (a virtual one) can drive it.
+     */
+	interrupt_gpio = devm_gpiod_get_optional(&spid->dev, "int", GPIOD_IN);
 	if (IS_ERR(interrupt_gpio)) {
 		dev_err(&spid->dev, "gpio get index failed\n");
 		err = PTR_ERR(interrupt_gpio); /* PTR_ERR return an int from a pointer */
-		return ERR_PTR(err);
+		goto err_rx_classes;
 	}
 
-	irq_no = gpiod_to_irq(interrupt_gpio);
+	mcuspi->int_gpio = interrupt_gpio;
+
+	if (interrupt_gpio) {
+		irq_no = gpiod_to_irq(interrupt_gpio);
+		irq_flags = IRQF_TRIGGER_FALLING;
+	} else {
+		irq_no = spid->irq > 0 ? spid->irq : -ENXIO;
+		irq_flags = 0;
+	}
 	if (irq_no < 0) {
 		dev_err(&spid->dev, "gpio get irq failed\n");
 		err = irq_no;
-		return ERR_PTR(err);
+		goto err_rx_classes;
+	}
+	if (!interrupt_gpio && (mcuspi->features & MCUSPI_FEAT_INT_LEVEL)) {
+		dev_err(&spid->dev, "dozh,int-level needs the int gpio\n");
+		err = -EINVAL;
+		goto err_rx_classes;
 	}
 	dev_info(&spid->dev, "The IRQ number is: %d\n", irq_no);
+	mcuspi->irq = irq_no;
 
 	/* Request threaded interrupt */
 	err = devm_request_threaded_irq(&spid->dev, irq_no, mcu_spi_set_intr_busy,
-			mcu_spi_isr, IRQF_TRIGGER_FALLING | IRQF_ONESHOT, mcuspi->name, mcuspi);
+			mcu_spi_isr, irq_flags | IRQF_ONESHOT, mcuspi->name, mcuspi);
 	if (err)
-		return ERR_PTR(err);
+		goto err_rx_classes;
 
 
 	/* Register sysfs hooks */
 	//ret |= sysfs_create_groups(&spid->dev.kobj, msg_attr_groups);
-	mcu_spi_init_sysfs(spid);
-	
+	err = mcu_spi_init_sysfs(spid);
+	if (err)
+		goto err_irq;
 
-	
 	dev_info(&spid->dev, "spid->dev.kobj: %s", spid->dev.kobj.name);
 	//sysfs file may under /sys/class/spi_master/spix/spix.y/ZZZ
 
-	/* Register misc device */
-	ret |= misc_register(&mcuspi->mcu_spi_miscdevice);
+	/* Register misc device last, files may be opened from here on */
+	err = misc_register(&mcuspi->mcu_spi_miscdevice);
+	if (err) {
+		dev_err(&spid->dev, "register %s failed\n", mcuspi->name);
+		goto err_sysfs;
+	}
 
-	ret |= init_mcu_message_queue(&mcuspi->recv_msg_queue);
-	ret |= init_mcu_message(&mcuspi->send_msg);
-	ret |= init_mcu_message(&mcuspi->recv_msg);
-	//test crc32
-	uint32_t crc32_result = ~crc32(0xFFFFFFFF, "UUUUUUUUUUUUUUUU", 15);
-	dev_info(&spid->dev, "The crc32 is: %x\n", crc32_result);
+	/* the MCU sends nothing before it has been given credits */
+	if (mcuspi->features & MCUSPI_FEAT_CREDITS) {
+		schedule_work(&mcuspi->link_work);
+	}
 
 	dev_info(&spid->dev, 
 		 "mcu_spi_probe is exited on %s\n", mcuspi->name);
 
-	return ret;
+	return 0;
+
+	/* in the reverse order of probe, as in remove */
+err_sysfs:
+	mcu_spi_deinit_sysfs(spid);
+err_irq:
+	devm_free_irq(&spid->dev, mcuspi->irq, mcuspi);
+err_rx_classes:
+	/* as in remove, no batch and no link_work may start on a failed probe */
+	mcuspi_tx_stop(mcuspi);
+	cancel_work_sync(&mcuspi->tx_rx_work);
+	cancel_work_sync(&mcuspi->link_work);
+	cancel_delayed_work_sync(&mcuspi->flow_work);
+	mcuspi_deinit_rx_classes(mcuspi);
+	debugfs_remove_recursive(mcuspi->debugfs);
+err_put:
+	kref_put(&mcuspi->kref, mcuspi_dev_release);
+	return err;
 }
 
 
@@ -995,9 +4067,12 @@ static int mcu_spi_remove(struct spi_device *spid)
 	dev_info(&spid->dev, 
 		 "mcu_spi_remove is entered on %s\n", mcuspi->name);
 
-	deinit_mcu_message_queue(mcuspi->recv_msg_queue);
-	deinit_mcu_message(mcuspi->send_msg);
-	deinit_mcu_message(mcuspi->recv_msg);
+	/* open files fail from now on, they keep the rings until closed */
+	spin_lock(&mcuspi->dead_lock);
+	mcuspi->dead = true;
+	spin_unlock(&mcuspi->dead_lock);
+	/* devm_free_irq waits for a running isr thread */
+	devm_free_irq(&spid->dev, mcuspi->irq, mcuspi);
 	/* Deregister misc device */
 	misc_deregister(&mcuspi->mcu_spi_miscdevice);
 
@@ -1005,8 +4080,16 @@ static int mcu_spi_remove(struct spi_device *spid)
 	//sysfs_remove_groups(&spid->dev.kobj, msg_attr_groups);
 	mcu_spi_deinit_sysfs(spid);
 
+	mcuspi_tx_stop(mcuspi);
+	cancel_work_sync(&mcuspi->tx_rx_work);
+	cancel_work_sync(&mcuspi->link_work);
+	cancel_delayed_work_sync(&mcuspi->flow_work);
+	debugfs_remove_recursive(mcuspi->debugfs);
+	mcuspi_deinit_rx_classes(mcuspi);
+
 	dev_info(&spid->dev, 
 		 "mcu_spi_remove is exited on %s\n", mcuspi->name);
+	kref_put(&mcuspi->kref, mcuspi_dev_release);
 
 	return 0;
 
@@ -1040,7 +4123,26 @@ static struct spi_driver mcu_spi_driver = {
 	.id_table =         mcu_spi_id,
 };
 
-module_spi_driver(mcu_spi_driver);
+#if IS_ENABLED(CONFIG_KUNIT)
+#include "mcu-spi-test.c"
+#else
+static inline void mcuspi_run_tests(void)
+{
+}
+#endif
+
+static int __init mcu_spi_init(void)
+{
+	mcuspi_run_tests();
+	return spi_register_driver(&mcu_spi_driver);
+}
+module_init(mcu_spi_init);
+
+static void __exit mcu_spi_exit(void)
+{
+	spi_unregister_driver(&mcu_spi_driver);
+}
+module_exit(mcu_spi_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("DoZh <TATQAQTAT@gmail.com>");
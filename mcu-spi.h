@@ -0,0 +1,243 @@
+/*
+ * Userspace interface of the mcu-spi driver (/dev/mcuspiX).
+ * This header is shared by the driver and by userspace programs.
+ */
+#ifndef _MCU_SPI_H
+#define _MCU_SPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MCUSPI_PAYLOAD_DESC_LENGTH 64
+#define MCUSPI_MAX_PAYLOAD_LENGTH 1024
+
+/*
+ * mmap() of the receive ring
+ *
+ * Offset 0 maps the control page (one page, read/write). The slot array
+ * starts at ctrl->ring_offset and can only be mapped read-only, it is
+ * ctrl->slot_count slots of ctrl->slot_size bytes, slot_count is a power of 2.
+ *
+ * head and tail are free running counters, slot of index i is
+ * slots[i & (slot_count - 1)]. The driver fills slots and advances tail,
+ * the consumer advances head once it is done with a slot:
+ *
+ *	head = ctrl->head;
+ *	tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+ *	while (head != tail) {
+ *		handle(&slots[head & (ctrl->slot_count - 1)]);
+ *		head++;
+ *	}
+ *	__atomic_store_n(&ctrl->head, head, __ATOMIC_RELEASE);
+ *
+ * The mmap consumer owns head, do not mix it with read() on the same device.
+ * mmap() fails with EINVAL when the driver overwrites old messages of a
+ * full ring (drop-oldest, see below).
+ */
+struct mcuspi_ring_slot {
+	__u16 payload_length;
+	__u8 reserved[6];
+	__u8 payload_desc[MCUSPI_PAYLOAD_DESC_LENGTH];
+	__u8 payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+};
+
+struct mcuspi_ring_ctrl {
+	__u32 head;		/* written by the consumer */
+	__u32 reserved0[15];
+	__u32 tail;		/* written by the driver */
+	__u32 reserved1[15];
+	__u32 slot_count;
+	__u32 slot_size;
+	__u32 ring_offset;	/* mmap offset of the slot array */
+	__u32 ring_size;	/* bytes mappable at ring_offset */
+};
+
+/*
+ * Receive classes
+ *
+ * With the "dozh,rx-class-depths" device tree property the driver keeps a
+ * receive ring per class, of the depth given for it. payload_desc[0] of a
+ * received frame is its class, 0 is the most urgent, values past the last
+ * class go to the last one. /dev/mcuspiX-cN reads and maps the ring of
+ * class N only. /dev/mcuspiX takes from the most urgent class that has a
+ * message. A record mode read() takes the records of one class only, and
+ * mmap() of /dev/mcuspiX fails with EINVAL when there are several classes.
+ * Without the property there is one ring of rx_depth (module parameter)
+ * slots.
+ *
+ * A frame that finds its ring full is handled by the "dozh,rx-overflow"
+ * policy, or the rx_overflow module parameter: "drop-newest" drops it,
+ * "drop-oldest" overwrites the oldest unread message and "block" drives the
+ * "ready" gpio low shortly before a ring fills, the MCU must not start a new
+ * frame until it is high again.
+ */
+#define MCUSPI_MAX_CLASSES 4
+
+/*
+ * Record mode
+ *
+ * After MCUSPI_IOC_SET_MODE(MCUSPI_MODE_RECORD), read() and write() carry a
+ * sequence of records: struct mcuspi_record followed by payload_length bytes
+ * of payload, padded with zeros to MCUSPI_RECORD_ALIGN.
+ * read() returns as many whole records as fit in the buffer, it fails with
+ * EMSGSIZE if not even the first one fits.
+ * write() queues up to MCUSPI_MAX_RECORDS_PER_WRITE records back to back
+ * and returns the bytes of the records it has queued. They go out in order
+ * with no frame of another writer between them, but not in one bus
+ * session: the driver sends a few frames per spi transfer and may read
+ * frames of the MCU between two transfers.
+ */
+struct mcuspi_record {
+	__u32 payload_length;
+	__u8 payload_desc[MCUSPI_PAYLOAD_DESC_LENGTH];
+};
+
+#define MCUSPI_RECORD_ALIGN 4
+#define MCUSPI_RECORD_SIZE(len) \
+	((sizeof(struct mcuspi_record) + (len) + MCUSPI_RECORD_ALIGN - 1) & ~(MCUSPI_RECORD_ALIGN - 1))
+#define MCUSPI_MAX_RECORDS_PER_WRITE 32
+
+#define MCUSPI_MODE_PAYLOAD 0	/* default, one payload per read()/write() */
+#define MCUSPI_MODE_RECORD 1
+
+/*
+ * Message ioctls
+ *
+ * MCUSPI_IOC_SEND queues one message, payload points to payload_length bytes.
+ * MCUSPI_IOC_RECV takes the next received message, it blocks unless the file
+ * is O_NONBLOCK. payload_length is the size of the buffer at payload on input
+ * and the length of the message on output, MCUSPI_MSG_TRUNC is set in flags
+ * when the buffer was too small.
+ * The vector forms handle msgs[0..nr-1] and return the number of messages
+ * handled. SENDV queues the messages back to back, RECVV only blocks for the
+ * first message.
+ *
+ * Sending
+ *
+ * write() and the send ioctls copy the messages to a transmit queue and
+ * return once they are queued, the driver clocks them out in the background.
+ * They block while the queue is full, or fail with EAGAIN when the file is
+ * O_NONBLOCK. poll() reports POLLOUT while the queue has free space.
+ */
+struct mcuspi_msg {
+	__u8 payload_desc[MCUSPI_PAYLOAD_DESC_LENGTH];
+	__u32 payload_length;
+	__u32 flags;		/* MCUSPI_MSG_xxx */
+	__u64 payload;		/* user pointer */
+};
+
+#define MCUSPI_MSG_TRUNC (1 << 0)
+
+struct mcuspi_msg_vec {
+	__u64 msgs;		/* user pointer to struct mcuspi_msg[nr] */
+	__u32 nr;
+	__u32 reserved;
+};
+
+#define MCUSPI_IOC_MAGIC 'm'
+#define MCUSPI_IOC_SET_MODE _IOW(MCUSPI_IOC_MAGIC, 0, __u32)
+#define MCUSPI_IOC_SEND _IOW(MCUSPI_IOC_MAGIC, 1, struct mcuspi_msg)
+#define MCUSPI_IOC_RECV _IOWR(MCUSPI_IOC_MAGIC, 2, struct mcuspi_msg)
+#define MCUSPI_IOC_SENDV _IOW(MCUSPI_IOC_MAGIC, 3, struct mcuspi_msg_vec)
+#define MCUSPI_IOC_RECVV _IOW(MCUSPI_IOC_MAGIC, 4, struct mcuspi_msg_vec)
+
+/*
+ * Subscriptions
+ *
+ * MCUSPI_IOC_SUBSCRIBE makes the file receive the messages whose
+ * payload_desc matches the filter: (payload_desc[i] & mask[i]) == value[i]
+ * for every byte. A message is handed to every subscribed file it matches
+ * and then skips the receive rings. Messages that match no filter go to the
+ * receive rings as before.
+ * Reads, the receive ioctls and poll() of a subscribed file only see its
+ * own messages, up to MCUSPI_SUB_DEPTH of them wait for the file, newer
+ * ones are dropped while it is full. mmap() is not available. A file can
+ * subscribe once, the subscription ends when the file is closed.
+ */
+#define MCUSPI_SUB_DEPTH 64
+
+struct mcuspi_filter {
+	__u8 mask[MCUSPI_PAYLOAD_DESC_LENGTH];
+	__u8 value[MCUSPI_PAYLOAD_DESC_LENGTH];
+};
+
+#define MCUSPI_IOC_SUBSCRIBE _IOW(MCUSPI_IOC_MAGIC, 5, struct mcuspi_filter)
+
+/*
+ * Link control
+ *
+ * With the "dozh,link-control" device tree property the last
+ * MCUSPI_LINK_CTRL_LENGTH bytes of payload_desc carry struct mcuspi_link_ctrl
+ * in both directions. The driver fills them in every frame it sends, what
+ * userspace puts there is overwritten. Received frames keep them.
+ *
+ * Each side numbers its frames with the serial byte of the frame. A receiver
+ * that sees a serial skipped sends MCUSPI_LINK_NAK with the missing serial,
+ * the sender then sends that frame once more if it is still in its history.
+ * Frames received twice are dropped. Frames with MCUSPI_LINK_CONTROL carry
+ * no user data and are not queued.
+ *
+ * With "dozh,rx-credits" as well the driver sets MCUSPI_LINK_CREDITS in
+ * every frame it sends: the MCU may send the frames up to serial
+ * ack + credits (the first credits frames when MCUSPI_LINK_ACK is not set)
+ * and has to wait for more credits after that. Frames may arrive out of
+ * order, the MCU keeps the furthest limit it was given. The driver sends a
+ * control frame with fresh credits when the MCU runs short of them and the
+ * receive rings have room again.
+ *
+ * The MCU sets MCUSPI_LINK_MORE in a frame when it has the next one ready,
+ * the driver then reads it right away, without waiting for an edge of
+ * "int". The same is done with "dozh,int-level" while "int" stays low.
+ *
+ * With "dozh,fragments" as well a message may be longer than one frame. It
+ * is sent as up to MCUSPI_MAX_FRAGS frames with MCUSPI_LINK_FRAG, frag
+ * counting from 0 and MCUSPI_LINK_FRAG_END in the last one. Every fragment
+ * but the last carries MCUSPI_MAX_PAYLOAD_LENGTH bytes, payload_desc of the
+ * message is the one of fragment 0. A payload mode write() of more than
+ * MCUSPI_MAX_PAYLOAD_LENGTH bytes is sent that way, its fragments are queued
+ * back to back. Fragments from the MCU are reassembled into messages of up
+ * to rx_frag_max bytes (module parameter). They do not go to the receive
+ * rings: only a payload mode read() of /dev/mcuspiX returns them, ahead of
+ * the rings. Record mode, MCUSPI_IOC_RECV/RECVV, mmap(), the class devices
+ * /dev/mcuspiX-cN and subscribers never see them. A message still missing
+ * fragments rx_frag_timeout_ms after its first one, or finding every
+ * reassembly buffer waiting for a reader, is dropped.
+ * write() of a message in fragments queues all of them or fails, a message
+ * cut by a fatal signal or a fault is dropped by the MCU when the next one
+ * starts. It takes at most MCUSPI_MAX_FRAGS fragments, or
+ * MCUSPI_MAX_PAYLOAD_LENGTH bytes without "dozh,fragments".
+ *
+ * With "dozh,compress-classes" as well, a mask of classes (payload_desc[0]
+ * as for the receive classes), the driver compresses the payload of the
+ * frames it sends in those classes when that makes it shorter, and sets
+ * MCUSPI_LINK_COMPRESSED. The codec is the run length one of
+ * mcu-spi-proto.h. A frame from the MCU with MCUSPI_LINK_COMPRESSED is
+ * decompressed after its CRC check, whatever its class, userspace only sees
+ * the payload decompressed. Fragments are compressed one by one, the
+ * lengths of fragments above are the ones decompressed. The bus time is
+ * only cut with "dozh,variable-length", fixed length frames take as long.
+ */
+#define MCUSPI_LINK_CTRL_OFFSET 56
+#define MCUSPI_LINK_CTRL_LENGTH 8
+
+struct mcuspi_link_ctrl {
+	__u8 flags;		/* MCUSPI_LINK_xxx */
+	__u8 ack;		/* serial of the newest frame received */
+	__u8 nak;		/* serial to send again */
+	__u8 credits;		/* frames that may follow ack, at most 127 */
+	__u8 frag;		/* fragment index with MCUSPI_LINK_FRAG */
+	__u8 reserved[3];
+};
+
+#define MCUSPI_LINK_ACK (1 << 0)	/* ack is valid */
+#define MCUSPI_LINK_NAK (1 << 1)	/* nak is valid */
+#define MCUSPI_LINK_CONTROL (1 << 2)
+#define MCUSPI_LINK_CREDITS (1 << 3)	/* credits is valid */
+#define MCUSPI_LINK_MORE (1 << 4)	/* from the MCU, another frame is ready */
+#define MCUSPI_LINK_FRAG (1 << 5)	/* fragment of a message, frag is valid */
+#define MCUSPI_LINK_FRAG_END (1 << 6)	/* last fragment of the message */
+#define MCUSPI_LINK_COMPRESSED (1 << 7)	/* payload is run length coded */
+
+#define MCUSPI_MAX_FRAGS 256
+
+#endif /* _MCU_SPI_H */
@@ -0,0 +1,65 @@
+/*
+ * The frame CRC32 backends of the driver that build on the host: the
+ * portable bitwise reference, slice-by-8 and, on an aarch64 host with the
+ * CRC extension, the armv8 instructions through arm_acle.h.
+ */
+#ifndef _MCUSPI_CRC_BACKENDS_H
+#define _MCUSPI_CRC_BACKENDS_H
+
+#include "../mcu-spi-proto.h"
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+static uint32_t crc_table[8][256];
+
+static uint32_t crc_bitwise(uint32_t crc, const uint8_t *p, size_t len)
+{
+	return mcuspi_proto_crc32(crc, p, len);
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	return mcuspi_proto_crc32_slice8((const uint32_t (*)[256])crc_table, crc, p, len);
+}
+
+#ifdef __ARM_FEATURE_CRC32
+static uint32_t crc_armv8(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+	uint32_t w;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32d(crc, v);
+	}
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&w, p, 4);
+		crc = __crc32w(crc, w);
+	}
+	while (len--) {
+		crc = __crc32b(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static const struct crc_backend {
+	const char *name;
+	uint32_t (*crc32)(uint32_t crc, const uint8_t *p, size_t len);
+} crc_backends[] = {
+	{ "bitwise", crc_bitwise },
+	{ "slice8", crc_slice8 },
+#ifdef __ARM_FEATURE_CRC32
+	{ "armv8", crc_armv8 },
+#endif
+};
+
+#define CRC_BACKENDS (sizeof(crc_backends) / sizeof(crc_backends[0]))
+
+static void crc_backends_init(void)
+{
+	mcuspi_proto_crc32_slice8_init(crc_table);
+}
+
+#endif /* _MCUSPI_CRC_BACKENDS_H */
@@ -0,0 +1,37 @@
+/*
+ * Throughput of the host CRC32 backends over a frame head and a full size
+ * frame. The driver prints the same figure for its own backends at probe.
+ */
+#include "crc-backends.h"
+#include "host.h"
+
+static volatile uint32_t sink;
+
+int main(int argc, char **argv)
+{
+	static const size_t lens[] = { MCUSPI_HEAD_LENGTH, MCUSPI_MAX_FRAME_LENGTH - MCUSPI_VERIFY_LENGTH };
+	static uint8_t buf[MCUSPI_MAX_FRAME_LENGTH];
+	unsigned long n = host_iterations(argc, argv, 20000);
+	unsigned long i, iters;
+	char name[32];
+	size_t b, l;
+	uint64_t t;
+
+	crc_backends_init();
+	memset(buf, 0x5A, sizeof(buf));
+	for (b = 0; b < CRC_BACKENDS; b++) {
+		for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+			/* the bitwise reference is slow, give it fewer rounds */
+			iters = b ? n * 10 : n;
+			t = host_now_ns();
+			for (i = 0; i < iters; i++) {
+				buf[0] = i;
+				sink = crc_backends[b].crc32(0xFFFFFFFF, buf, lens[l]);
+			}
+			t = host_now_ns() - t;
+			snprintf(name, sizeof(name), "crc32 %s %zu", crc_backends[b].name, lens[l]);
+			host_report(name, iters, (uint64_t)iters * lens[l], t);
+		}
+	}
+	return 0;
+}
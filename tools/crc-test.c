@@ -0,0 +1,44 @@
+/*
+ * Check every host CRC32 backend with mcu-spi-crc-vectors.h, the vectors
+ * the driver checks its backends with at probe, and against the bitwise
+ * reference over every length and alignment of a frame head and random
+ * frames.
+ */
+#include "../mcu-spi-crc-vectors.h"
+#include "crc-backends.h"
+#include "host.h"
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[MCUSPI_MAX_FRAME_LENGTH + 8];
+	unsigned long n = host_iterations(argc, argv, 100000) / 100;
+	const struct mcuspi_crc_vector *v;
+	uint64_t seed = 0x637263ULL;
+	unsigned long t;
+	size_t b, i, len, off;
+
+	crc_backends_init();
+	for (b = 0; b < CRC_BACKENDS; b++) {
+		mcuspi_crc_vector_pattern(buf, sizeof(buf));
+		for (i = 0; i < sizeof(mcuspi_crc_vectors) / sizeof(mcuspi_crc_vectors[0]); i++) {
+			v = &mcuspi_crc_vectors[i];
+			HOST_CHECK(~crc_backends[b].crc32(0xFFFFFFFF, v->data ? (const uint8_t *)v->data : buf,
+							  v->len) == v->crc);
+		}
+		for (off = 0; off < 8; off++) {
+			for (len = 0; len <= MCUSPI_HEAD_LENGTH; len++) {
+				HOST_CHECK(crc_backends[b].crc32(0xFFFFFFFF, buf + off, len) ==
+					   crc_bitwise(0xFFFFFFFF, buf + off, len));
+			}
+		}
+		for (t = 0; t < n; t++) {
+			len = host_rand(&seed) % (MCUSPI_MAX_FRAME_LENGTH + 1);
+			off = host_rand(&seed) % 8;
+			host_fill_random(&seed, buf + off, len);
+			HOST_CHECK(crc_backends[b].crc32(0xFFFFFFFF, buf + off, len) ==
+				   crc_bitwise(0xFFFFFFFF, buf + off, len));
+		}
+		printf("crc-test: %s ok\n", crc_backends[b].name);
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Resend path of the driver against mcu-spi-emu, with link control, in
+# fixed and variable length mode. Run as root where mcu-spi.ko and
+# mcu-spi-emu.ko are built for the running kernel, `make emu-test`.
+#
+# The driver fails the CRC of every INJECT-th good frame (inject_rx_errors
+# in debugfs), it has to NAK them and take them again from the emulator:
+# rx_recovered goes up and mcuspi-bench sees no frame lost. The emulator
+# NAKs every NAK-th data frame of the driver, the driver has to send them
+# again: tx_retransmits goes up and the emulator takes all SEND frames.
+set -e
+cd "$(dirname "$0")/.."
+
+FRAMES=${FRAMES:-20000}
+SEND=${SEND:-2000}
+INJECT=${INJECT:-7}
+NAK=${NAK:-5}
+SECONDS_MAX=${SECONDS_MAX:-10}
+DEV=${DEV:-mcuspi0}
+DEBUGFS=/sys/kernel/debug
+
+# driver counter from the debugfs stats file
+drv_stat() {
+	awk -v n="$1" '$1 == n { print $2; exit }' "$DEBUGFS/$DEV/stats"
+}
+
+emu() {
+	cat "$DEBUGFS/mcu-spi-emu/$1"
+}
+
+fail() {
+	echo "emu-resend-test: varlen=$varlen: $*" >&2
+	exit 1
+}
+
+unload() {
+	rmmod mcu-spi-emu 2>/dev/null || true
+	rmmod mcu-spi 2>/dev/null || true
+}
+
+trap unload EXIT
+for varlen in 0 1; do
+	unload
+	insmod ./mcu-spi.ko
+	insmod ./mcu-spi-emu.ko link=1 varlen=$varlen rate_hz=2000 burst=4 count=$FRAMES nak_every=$NAK
+	echo "$INJECT" > "$DEBUGFS/$DEV/inject_rx_errors"
+
+	tools/mcuspi-bench -d "/dev/$DEV" -t "$SECONDS_MAX" -n "$FRAMES" -s "$SEND" ||
+		fail "mcuspi-bench saw frames lost or corrupt"
+
+	# the last frames written may still be on their way
+	for i in 1 2 3 4 5; do
+		[ "$(emu host_frames)" -lt "$SEND" ] || break
+		sleep 1
+	done
+	[ "$(drv_stat rx_recovered)" -gt 0 ] || fail "no frame recovered"
+	[ "$(drv_stat tx_retransmits)" -gt 0 ] || fail "no frame sent again"
+	[ "$(emu host_frames)" -eq "$SEND" ] || fail "emulator took $(emu host_frames) of $SEND frames"
+	[ "$(emu host_corrupt)" -eq 0 ] || fail "emulator saw corrupt frames"
+	echo "emu-resend-test: varlen=$varlen: rx_recovered $(drv_stat rx_recovered)" \
+		"tx_retransmits $(drv_stat tx_retransmits) emu resent $(emu resent)"
+done
+echo "emu-resend-test: ok"
@@ -0,0 +1,86 @@
+/*
+ * Per-frame CPU cost of preparing a frame to send, before and after the
+ * buffers were made per device. Before, write() staged the payload in a
+ * kzalloc'ed msg, data_write_to_bus took a fresh zeroed 1096-byte frame,
+ * pack_one_mcu_message pattern-filled all 1024 payload bytes before
+ * copying the real payload and the isr took another zeroed frame for its
+ * read. After, the payload is copied once into a buffer kept by the tx
+ * slot and only head and CRC are filled around it. calloc and free stand
+ * in for kzalloc and kfree. The CRC is the same in both and is left out,
+ * proto-bench measures it.
+ */
+#include "../mcu-spi-proto.h"
+#include "host.h"
+
+#define SAMPLES 1024
+
+static uint8_t user_payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+static volatile uint8_t sink;
+
+static void frame_before(uint16_t payload_length)
+{
+	uint8_t *staged, *sendbuf, *isrbuf, *p;
+	uint8_t data = 0;
+	int i;
+
+	staged = calloc(1, MCUSPI_MAX_PAYLOAD_LENGTH);
+	memcpy(staged, user_payload, payload_length);
+	sendbuf = calloc(1, MCUSPI_MAX_FRAME_LENGTH);
+	/* the test pattern of pack_one_mcu_message */
+	p = sendbuf + MCUSPI_PAYLOAD_OFFSET;
+	for (i = 0; i < MCUSPI_MAX_PAYLOAD_LENGTH; i++) {
+		*p++ = data++;
+	}
+	memcpy(sendbuf + MCUSPI_PAYLOAD_OFFSET, staged, payload_length);
+	sendbuf[0] = MCUSPI_PREAMBLE;
+	mcuspi_proto_put_le16(sendbuf + MCUSPI_COUNT_OFFSET, payload_length);
+	isrbuf = calloc(1, MCUSPI_MAX_FRAME_LENGTH);
+	sink = sendbuf[MCUSPI_PAYLOAD_OFFSET] + isrbuf[0];
+	free(isrbuf);
+	free(sendbuf);
+	free(staged);
+}
+
+static void frame_after(uint8_t *tx_buf, uint16_t payload_length)
+{
+	memcpy(tx_buf + MCUSPI_PAYLOAD_OFFSET, user_payload, payload_length);
+	mcuspi_proto_put_head(tx_buf, 0, NULL, payload_length);
+	sink = tx_buf[MCUSPI_PAYLOAD_OFFSET];
+}
+
+static uint64_t median_cycles(unsigned long n, int after, uint16_t payload_length)
+{
+	static uint8_t tx_buf[MCUSPI_MAX_FRAME_LENGTH];
+	static uint64_t samples[SAMPLES];
+	unsigned long i;
+	uint64_t t;
+
+	for (i = 0; i < n; i++) {
+		t = host_cycles();
+		if (after) {
+			frame_after(tx_buf, payload_length);
+		} else {
+			frame_before(payload_length);
+		}
+		samples[i % SAMPLES] = host_cycles() - t;
+	}
+	return host_percentile(samples, n < SAMPLES ? n : SAMPLES, 0.5);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint16_t lens[] = { 4, 64, 256, MCUSPI_MAX_PAYLOAD_LENGTH };
+	unsigned long n = host_iterations(argc, argv, 20000);
+	uint64_t before, after;
+	unsigned int i;
+
+	memset(user_payload, 0x5A, sizeof(user_payload));
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		before = median_cycles(n, 0, lens[i]);
+		after = median_cycles(n, 1, lens[i]);
+		printf("frame-bench: payload %4u  before %6llu %s  after %6llu %s per frame\n",
+		       lens[i], (unsigned long long)before, host_cycles_unit(),
+		       (unsigned long long)after, host_cycles_unit());
+	}
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Framing of the bus as the driver clocks it, checked against a simulated
+ * MCU. In fixed-length mode every read clocks MCUSPI_MAX_FRAME_LENGTH
+ * bytes, in variable-length mode ("dozh,variable-length") a head of
+ * MCUSPI_HEAD_LENGTH bytes is clocked first and the body is sized from the
+ * payload_length it carries, as spi_read_frame does.
+ */
+#include "../mcu-spi-proto.h"
+#include "host.h"
+
+/* the MCU side, frames queued back to back, zeros once idle */
+struct sim_mcu {
+	uint8_t buf[64 * MCUSPI_MAX_FRAME_LENGTH];
+	size_t len;
+	size_t pos;
+	size_t frame_end; /* the rest of a frame is dropped when chip select rises */
+	uint64_t clocked;
+};
+
+static void sim_queue(struct sim_mcu *mcu, uint8_t serial, const uint8_t *payload, uint16_t payload_length)
+{
+	uint8_t desc[MCUSPI_PAYLOAD_DESC_LENGTH] = { serial };
+
+	HOST_CHECK(mcu->len + MCUSPI_FRAME_LENGTH(payload_length) <= sizeof(mcu->buf));
+	mcu->len += mcuspi_proto_pack(mcu->buf + mcu->len, serial, desc, payload, payload_length);
+}
+
+/* a transfer of len bytes, chip select held from the previous one if cont */
+static void sim_clock(struct sim_mcu *mcu, uint8_t *rx, size_t len, int cont)
+{
+	size_t i;
+
+	if (!cont) {
+		/* a new frame starts with chip select */
+		mcu->pos = mcu->frame_end;
+		mcu->frame_end = mcu->pos < mcu->len ?
+			mcu->pos + MCUSPI_FRAME_LENGTH(mcuspi_proto_get_le16(mcu->buf + mcu->pos + MCUSPI_COUNT_OFFSET)) :
+			mcu->pos;
+	}
+	for (i = 0; i < len; i++) {
+		rx[i] = mcu->pos < mcu->frame_end ? mcu->buf[mcu->pos++] : 0;
+	}
+	mcu->clocked += len;
+}
+
+/* spi_read_frame: head, then exactly payload + CRC with chip select held */
+static int read_varlen(struct sim_mcu *mcu, uint8_t *buf)
+{
+	int payload_length;
+
+	sim_clock(mcu, buf, MCUSPI_HEAD_LENGTH, 0);
+	payload_length = mcuspi_proto_head_length(buf);
+	if (payload_length < 0) {
+		return payload_length;
+	}
+	sim_clock(mcu, buf + MCUSPI_HEAD_LENGTH, payload_length + MCUSPI_VERIFY_LENGTH, 1);
+	return mcuspi_proto_unpack(buf, MCUSPI_FRAME_LENGTH(payload_length));
+}
+
+static int read_fixed(struct sim_mcu *mcu, uint8_t *buf)
+{
+	sim_clock(mcu, buf, MCUSPI_MAX_FRAME_LENGTH, 0);
+	return mcuspi_proto_unpack(buf, MCUSPI_MAX_FRAME_LENGTH);
+}
+
+static struct sim_mcu mcu;
+
+static void check_mode(int varlen, unsigned long n, uint64_t *seed)
+{
+	uint8_t payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+	uint8_t buf[MCUSPI_MAX_FRAME_LENGTH];
+	uint16_t lens[64];
+	unsigned long t;
+	int i, count, ret;
+
+	for (t = 0; t < n; t++) {
+		memset(&mcu, 0, sizeof(mcu));
+		count = 1 + host_rand(seed) % 64;
+		for (i = 0; i < count; i++) {
+			lens[i] = host_rand(seed) % 4 ? host_rand(seed) % 16 :
+				host_rand(seed) % (MCUSPI_MAX_PAYLOAD_LENGTH + 1);
+			memset(payload, i, lens[i]);
+			sim_queue(&mcu, i, payload, lens[i]);
+		}
+		for (i = 0; i < count; i++) {
+			ret = varlen ? read_varlen(&mcu, buf) : read_fixed(&mcu, buf);
+			HOST_CHECK(ret == lens[i]);
+			HOST_CHECK(buf[MCUSPI_DESC_OFFSET] == i);
+			HOST_CHECK(!lens[i] || (buf[MCUSPI_PAYLOAD_OFFSET] == i &&
+						buf[MCUSPI_PAYLOAD_OFFSET + lens[i] - 1] == i));
+		}
+		/* the MCU is idle, a varlen read stops after the head */
+		ret = varlen ? read_varlen(&mcu, buf) : read_fixed(&mcu, buf);
+		HOST_CHECK(ret == -ENODATA);
+		HOST_CHECK(mcu.clocked == (varlen ? mcu.len + MCUSPI_HEAD_LENGTH :
+				(uint64_t)(count + 1) * MCUSPI_MAX_FRAME_LENGTH));
+	}
+}
+
+/* a head announcing more than fits is refused before its body is clocked */
+static void check_bad_head(void)
+{
+	uint8_t buf[MCUSPI_MAX_FRAME_LENGTH];
+
+	memset(&mcu, 0, sizeof(mcu));
+	sim_queue(&mcu, 1, NULL, 0);
+	mcuspi_proto_put_le16(mcu.buf + MCUSPI_COUNT_OFFSET, MCUSPI_MAX_PAYLOAD_LENGTH + 1);
+	HOST_CHECK(read_varlen(&mcu, buf) == -EBADMSG);
+	HOST_CHECK(mcu.clocked == MCUSPI_HEAD_LENGTH);
+}
+
+/* bus bytes per frame of small control traffic in each mode */
+static void report_occupancy(void)
+{
+	static const uint16_t lens[] = { 4, 16, 64, 256, MCUSPI_MAX_PAYLOAD_LENGTH };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		printf("frame-test: payload %4u clocks %4u bytes varlen, %u fixed, %.1fx\n",
+		       lens[i], MCUSPI_FRAME_LENGTH(lens[i]), MCUSPI_MAX_FRAME_LENGTH,
+		       (double)MCUSPI_MAX_FRAME_LENGTH / MCUSPI_FRAME_LENGTH(lens[i]));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = host_iterations(argc, argv, 100000) / 100;
+	uint64_t seed = 0x666172ULL;
+
+	check_mode(0, n, &seed);
+	check_mode(1, n, &seed);
+	check_bad_head();
+	report_occupancy();
+	printf("frame-test: %lu fixed and %lu varlen bursts ok\n", n, n);
+	return 0;
+}
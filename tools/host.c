@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+
+uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t)hi << 32 | lo;
+#else
+	return host_now_ns();
+#endif
+}
+
+const char *host_cycles_unit(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return "cycles";
+#else
+	return "ns";
+#endif
+}
+
+uint32_t host_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+void host_fill_random(uint64_t *state, uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = host_rand(state);
+	}
+}
+
+int host_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static int host_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+uint64_t host_percentile(uint64_t *v, size_t n, double p)
+{
+	size_t i;
+
+	if (!n) {
+		return 0;
+	}
+	qsort(v, n, sizeof(*v), host_cmp_u64);
+	i = p * n;
+	return v[i < n ? i : n - 1];
+}
+
+void host_report(const char *name, uint64_t ops, uint64_t bytes, uint64_t ns)
+{
+	double s = ns ? ns / 1e9 : 1e-9;
+
+	printf("%-28s %12.0f ops/s %10.1f MB/s %8.1f ns/op\n", name, ops / s,
+	       bytes / s / 1e6, ops ? (double)ns / ops : 0);
+}
+
+unsigned long host_iterations(int argc, char **argv, unsigned long def)
+{
+	return argc > 1 ? strtoul(argv[1], NULL, 0) : def;
+}
@@ -0,0 +1,44 @@
+/*
+ * Helpers shared by the host tools in this directory: clocks, a seeded
+ * PRNG, cpu pinning and the report lines of the benchmarks. `make host`
+ * builds them into libmcuspi-host.a.
+ */
+#ifndef _MCUSPI_HOST_H
+#define _MCUSPI_HOST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* CLOCK_MONOTONIC, the clock of ktime_get_ns */
+uint64_t host_now_ns(void);
+
+/* tsc on x86, host_now_ns elsewhere, host_cycles_unit names which one */
+uint64_t host_cycles(void);
+const char *host_cycles_unit(void);
+
+/* xorshift64*, state must not start at 0 */
+uint32_t host_rand(uint64_t *state);
+void host_fill_random(uint64_t *state, uint8_t *buf, size_t len);
+
+/* pin the calling thread, return 0 or -errno */
+int host_pin_cpu(int cpu);
+
+/* sort v and return its p quantile, p in 0 ~ 1 */
+uint64_t host_percentile(uint64_t *v, size_t n, double p);
+
+/* one line per benchmark: ops/s, MB/s and ns per op */
+void host_report(const char *name, uint64_t ops, uint64_t bytes, uint64_t ns);
+
+/* iteration count from argv[1], def when absent */
+unsigned long host_iterations(int argc, char **argv, unsigned long def);
+
+#define HOST_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+#endif /* _MCUSPI_HOST_H */
@@ -0,0 +1,246 @@
+/*
+ * Receive benchmark of the driver against mcu-spi-emu: reads /dev/mcuspiN
+ * in record mode for a while and reports frames/s, bytes/s and the
+ * p50/p99/p999 latency from the generation of a frame in the emulator to
+ * its read() here, both on CLOCK_MONOTONIC. Sequence numbers of the
+ * frames count the frames lost and received twice, payloads not of
+ * mcu-spi-emu.h count as corrupt. With -s it also sends that many stamped
+ * frames, the emulator checks them (mcu-spi-emu/host_* in debugfs).
+ *
+ *	insmod mcu-spi.ko && insmod mcu-spi-emu.ko rate_hz=10000 burst=4
+ *	tools/mcuspi-bench -t 10
+ *
+ * It needs the device, `make host` builds it without running it. Exits 1
+ * when a frame was lost or corrupt.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "../mcu-spi.h"
+#include "../mcu-spi-emu.h"
+#include "host.h"
+
+#define READ_BUFFER_SIZE (64 * 1024)
+
+struct bench {
+	int fd; /* O_NONBLOCK, read */
+	uint64_t frames, bytes, lost, dups, corrupt, unstamped;
+	uint32_t next_seq;
+	int seen;
+	uint64_t *latency;
+	size_t samples, samples_max;
+	/* send side, blocking on a full tx queue rather than the reader */
+	int send_fd;
+	unsigned long send_count;
+	unsigned int send_len;
+	uint64_t sent;
+	int send_err;
+	int send_done;
+};
+
+static int open_record(const char *device, int flags)
+{
+	uint32_t mode = MCUSPI_MODE_RECORD;
+	int fd = open(device, flags);
+
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	if (ioctl(fd, MCUSPI_IOC_SET_MODE, &mode) < 0) {
+		perror("MCUSPI_IOC_SET_MODE");
+		exit(1);
+	}
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-t seconds] [-n frames] [-s frames to send] [-l send length]\n",
+		prog);
+	exit(2);
+}
+
+static void take_record(struct bench *b, const struct mcuspi_record *rec)
+{
+	const uint8_t *payload = (const uint8_t *)(rec + 1);
+	uint64_t now = host_now_ns();
+	uint32_t seq;
+
+	b->frames++;
+	b->bytes += rec->payload_length;
+	if (rec->payload_length < MCUSPI_EMU_STAMP_LENGTH) {
+		b->unstamped++;
+		return;
+	}
+	if (!mcuspi_emu_check(payload, rec->payload_length)) {
+		b->corrupt++;
+		return;
+	}
+	seq = mcuspi_proto_get_le32(payload + MCUSPI_EMU_SEQ_OFFSET);
+	if (b->seen && (int32_t)(seq - b->next_seq) < 0) {
+		b->dups++;
+		return;
+	}
+	if (b->seen) {
+		b->lost += seq - b->next_seq;
+	}
+	b->seen = 1;
+	b->next_seq = seq + 1;
+	if (b->samples == b->samples_max) {
+		b->samples_max = b->samples_max ? b->samples_max * 2 : 65536;
+		b->latency = realloc(b->latency, b->samples_max * sizeof(*b->latency));
+		HOST_CHECK(b->latency);
+	}
+	b->latency[b->samples++] = now - mcuspi_emu_time(payload);
+}
+
+/* split a read() of whole records */
+static void take_records(struct bench *b, const uint8_t *buf, size_t len)
+{
+	const struct mcuspi_record *rec;
+	size_t off = 0, size;
+
+	while (off + sizeof(*rec) <= len) {
+		rec = (const struct mcuspi_record *)(buf + off);
+		size = MCUSPI_RECORD_SIZE(rec->payload_length);
+		HOST_CHECK(rec->payload_length <= MCUSPI_MAX_PAYLOAD_LENGTH && off + size <= len);
+		take_record(b, rec);
+		off += size;
+	}
+	HOST_CHECK(off == len);
+}
+
+/* write() send_count stamped records, MCUSPI_MAX_RECORDS_PER_WRITE at a time */
+static void *send_thread(void *arg)
+{
+	static uint8_t buf[MCUSPI_MAX_RECORDS_PER_WRITE * MCUSPI_RECORD_SIZE(MCUSPI_MAX_PAYLOAD_LENGTH)];
+	struct bench *b = arg;
+	struct mcuspi_record *rec;
+	size_t size = MCUSPI_RECORD_SIZE(b->send_len), len, off;
+	unsigned int i, n;
+	ssize_t ret;
+
+	while (b->sent < b->send_count) {
+		n = b->send_count - b->sent < MCUSPI_MAX_RECORDS_PER_WRITE ?
+		    b->send_count - b->sent : MCUSPI_MAX_RECORDS_PER_WRITE;
+		memset(buf, 0, n * size);
+		for (i = 0; i < n; i++) {
+			rec = (struct mcuspi_record *)(buf + i * size);
+			rec->payload_length = b->send_len;
+			mcuspi_emu_fill((uint8_t *)(rec + 1), b->send_len, host_now_ns(), b->sent + i);
+		}
+		len = n * size;
+		for (off = 0; off < len; off += ret) {
+			ret = write(b->send_fd, buf + off, len - off);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+			} else if (ret < 0) {
+				b->send_err = errno;
+				__atomic_store_n(&b->send_done, 1, __ATOMIC_RELEASE);
+				return NULL;
+			}
+		}
+		b->sent += n;
+	}
+	__atomic_store_n(&b->send_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static uint8_t buf[READ_BUFFER_SIZE];
+	const char *device = "/dev/mcuspi0";
+	struct bench b = { .send_len = 64 };
+	unsigned long max_frames = 0;
+	uint64_t start, end, ns;
+	struct pollfd pfd;
+	double seconds = 5, s;
+	pthread_t sender;
+	ssize_t ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:n:s:l:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 't':
+			seconds = strtod(optarg, NULL);
+			break;
+		case 'n':
+			max_frames = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.send_count = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			b.send_len = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (seconds <= 0 || b.send_len < MCUSPI_EMU_STAMP_LENGTH || b.send_len > MCUSPI_MAX_PAYLOAD_LENGTH) {
+		usage(argv[0]);
+	}
+
+	b.fd = open_record(device, O_RDONLY | O_NONBLOCK);
+	if (b.send_count) {
+		b.send_fd = open_record(device, O_WRONLY);
+	}
+
+	start = host_now_ns();
+	end = start + (uint64_t)(seconds * 1e9);
+	if (b.send_count && pthread_create(&sender, NULL, send_thread, &b)) {
+		perror("pthread_create");
+		return 1;
+	}
+	pfd.fd = b.fd;
+	pfd.events = POLLIN;
+	/* -n ends the run once the sender is done too */
+	while (host_now_ns() < end && (!max_frames || b.frames < max_frames ||
+				       (b.send_count && !__atomic_load_n(&b.send_done, __ATOMIC_ACQUIRE)))) {
+		ret = poll(&pfd, 1, 100);
+		if (ret <= 0) {
+			continue;
+		}
+		ret = read(b.fd, buf, sizeof(buf));
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+		if (ret < 0) {
+			perror("read");
+			return 1;
+		}
+		take_records(&b, buf, ret);
+	}
+	ns = host_now_ns() - start;
+	if (b.send_count) {
+		/* a sender still blocked on a stalled link is cut short */
+		pthread_cancel(sender);
+		pthread_join(sender, NULL);
+	}
+
+	s = ns / 1e9;
+	printf("%s: %lu frames in %.2f s, %.0f frames/s, %.0f bytes/s\n", device,
+	       (unsigned long)b.frames, s, b.frames / s, b.bytes / s);
+	if (b.samples) {
+		printf("latency p50 %lu ns, p99 %lu ns, p999 %lu ns\n",
+		       (unsigned long)host_percentile(b.latency, b.samples, 0.5),
+		       (unsigned long)host_percentile(b.latency, b.samples, 0.99),
+		       (unsigned long)host_percentile(b.latency, b.samples, 0.999));
+	}
+	printf("lost %lu dups %lu corrupt %lu unstamped %lu\n", (unsigned long)b.lost,
+	       (unsigned long)b.dups, (unsigned long)b.corrupt, (unsigned long)b.unstamped);
+	if (b.send_count) {
+		printf("sent %lu of %lu%s%s\n", (unsigned long)b.sent, b.send_count,
+		       b.send_err ? ", " : "", b.send_err ? strerror(b.send_err) : "");
+	}
+	free(b.latency);
+	return b.lost || b.corrupt || b.send_err;
+}
@@ -0,0 +1,105 @@
+/*
+ * Throughput of the codecs of mcu-spi-proto.h as the MCU firmware and the
+ * host tools run them: pack and unpack with the portable CRC, RLE of a
+ * fixed layout record payload and a ring push/pop pair.
+ */
+#include "../mcu-spi-proto.h"
+#include "host.h"
+
+static volatile int sink;
+
+static void bench_pack(unsigned long n, uint16_t payload_length)
+{
+	static uint8_t frame[MCUSPI_MAX_FRAME_LENGTH];
+	uint8_t payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+	char name[32];
+	unsigned long i;
+	uint64_t t;
+
+	memset(payload, 0x5A, sizeof(payload));
+	t = host_now_ns();
+	for (i = 0; i < n; i++) {
+		payload[0] = i;
+		sink += mcuspi_proto_pack(frame, i, NULL, payload, payload_length);
+	}
+	t = host_now_ns() - t;
+	snprintf(name, sizeof(name), "pack %u", payload_length);
+	host_report(name, n, (uint64_t)n * MCUSPI_FRAME_LENGTH(payload_length), t);
+
+	t = host_now_ns();
+	for (i = 0; i < n; i++) {
+		sink += mcuspi_proto_unpack(frame, MCUSPI_FRAME_LENGTH(payload_length));
+	}
+	t = host_now_ns() - t;
+	snprintf(name, sizeof(name), "unpack %u", payload_length);
+	host_report(name, n, (uint64_t)n * MCUSPI_FRAME_LENGTH(payload_length), t);
+}
+
+static void bench_rle(unsigned long n)
+{
+	uint8_t src[MCUSPI_MAX_PAYLOAD_LENGTH], enc[MCUSPI_MAX_PAYLOAD_LENGTH + 16];
+	uint8_t dec[MCUSPI_MAX_PAYLOAD_LENGTH];
+	unsigned long i;
+	uint64_t t;
+	int e = 0;
+
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = i % 16 < 2 ? i / 16 : i % 16 == 3;
+	}
+	t = host_now_ns();
+	for (i = 0; i < n; i++) {
+		src[0] = i;
+		e = mcuspi_proto_rle_encode(enc, sizeof(enc), src, sizeof(src));
+	}
+	t = host_now_ns() - t;
+	host_report("rle encode 1024", n, (uint64_t)n * sizeof(src), t);
+
+	t = host_now_ns();
+	for (i = 0; i < n; i++) {
+		sink += mcuspi_proto_rle_decode(dec, sizeof(dec), enc, e);
+	}
+	t = host_now_ns() - t;
+	host_report("rle decode 1024", n, (uint64_t)n * sizeof(src), t);
+}
+
+static void bench_ring(unsigned long n, uint16_t payload_length)
+{
+	static mcu_message slots[64];
+	static mcu_message out;
+	uint8_t desc[MCUSPI_PAYLOAD_DESC_LENGTH] = { 0 };
+	uint8_t payload[MCUSPI_MAX_PAYLOAD_LENGTH] = { 0 };
+	uint32_t head = 0, tail = 0;
+	const mcu_message *slot;
+	char name[32];
+	unsigned long i;
+	uint64_t t;
+
+	t = host_now_ns();
+	for (i = 0; i < n; i++) {
+		if (!mcuspi_ring_full(&head, tail, 63)) {
+			mcuspi_ring_fill(&slots[tail & 63], desc, payload, payload_length);
+			mcuspi_ring_publish(&tail, tail + 1);
+		}
+		if (mcuspi_ring_used(head, &tail)) {
+			slot = &slots[head & 63];
+			memcpy(&out, slot, 8 + MCUSPI_PAYLOAD_DESC_LENGTH + slot->payload_length);
+			mcuspi_ring_publish(&head, head + 1);
+		}
+	}
+	t = host_now_ns() - t;
+	sink += out.payload_length;
+	snprintf(name, sizeof(name), "ring push+pop %u", payload_length);
+	host_report(name, n, (uint64_t)n * payload_length, t);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = host_iterations(argc, argv, 20000);
+
+	bench_pack(n, 64);
+	bench_pack(n, MCUSPI_MAX_PAYLOAD_LENGTH);
+	bench_rle(n);
+	bench_ring(n * 10, 64);
+	bench_ring(n * 10, MCUSPI_MAX_PAYLOAD_LENGTH);
+	return 0;
+}
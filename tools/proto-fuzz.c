@@ -0,0 +1,161 @@
+/*
+ * Fuzz the codecs of mcu-spi-proto.h: frames and RLE payloads round trip,
+ * damaged or cut short input is refused and never read or written out of
+ * bounds, the ring helpers wrap over the 32 bit index. Run with an
+ * iteration count to go longer than the default.
+ */
+#include "../mcu-spi-proto.h"
+#include "host.h"
+
+static uint64_t seed = 0x6d6375737069ULL;
+
+static void test_crc(void)
+{
+	HOST_CHECK(~mcuspi_proto_crc32(0xFFFFFFFF, (const uint8_t *)"123456789", 9) == 0xCBF43926);
+	HOST_CHECK(~mcuspi_proto_crc32(0xFFFFFFFF, NULL, 0) == 0);
+}
+
+static void test_frames(unsigned long n)
+{
+	static uint8_t frame[MCUSPI_MAX_FRAME_LENGTH + 16];
+	uint8_t payload[MCUSPI_MAX_PAYLOAD_LENGTH], desc[MCUSPI_PAYLOAD_DESC_LENGTH];
+	unsigned long t;
+	size_t len, bit;
+	uint16_t payload_length;
+
+	for (t = 0; t < n; t++) {
+		payload_length = host_rand(&seed) % (MCUSPI_MAX_PAYLOAD_LENGTH + 1);
+		host_fill_random(&seed, payload, payload_length);
+		host_fill_random(&seed, desc, sizeof(desc));
+		len = mcuspi_proto_pack(frame, t, desc, payload, payload_length);
+		HOST_CHECK(len == (size_t)MCUSPI_FRAME_LENGTH(payload_length));
+		HOST_CHECK(mcuspi_proto_unpack(frame, len) == payload_length);
+		HOST_CHECK(mcuspi_proto_head_length(frame) == payload_length);
+		HOST_CHECK(frame[MCUSPI_SERIAL_OFFSET] == (uint8_t)t);
+		HOST_CHECK(!memcmp(frame + MCUSPI_DESC_OFFSET, desc, sizeof(desc)));
+		HOST_CHECK(!memcmp(frame + MCUSPI_PAYLOAD_OFFSET, payload, payload_length));
+		/* bytes clocked after the CRC are ignored */
+		HOST_CHECK(mcuspi_proto_unpack(frame, len + host_rand(&seed) % 16) == payload_length);
+		/* any single bit flip is caught */
+		bit = host_rand(&seed) % (len * 8);
+		frame[bit / 8] ^= 1 << bit % 8;
+		HOST_CHECK(mcuspi_proto_unpack(frame, len) < 0);
+		frame[bit / 8] ^= 1 << bit % 8;
+		/* a frame cut short is refused */
+		HOST_CHECK(mcuspi_proto_unpack(frame, host_rand(&seed) % len) < 0);
+	}
+	/* the payload may already be in place */
+	host_fill_random(&seed, frame + MCUSPI_PAYLOAD_OFFSET, 100);
+	memcpy(payload, frame + MCUSPI_PAYLOAD_OFFSET, 100);
+	len = mcuspi_proto_pack(frame, 1, NULL, frame + MCUSPI_PAYLOAD_OFFSET, 100);
+	HOST_CHECK(mcuspi_proto_unpack(frame, len) == 100);
+	HOST_CHECK(!memcmp(frame + MCUSPI_PAYLOAD_OFFSET, payload, 100));
+
+	memset(frame, 0, sizeof(frame));
+	HOST_CHECK(mcuspi_proto_unpack(frame, sizeof(frame)) == -ENODATA);
+	HOST_CHECK(mcuspi_proto_unpack(frame, 0) == -ENODATA);
+	frame[0] = MCUSPI_PREAMBLE;
+	mcuspi_proto_put_le16(frame + MCUSPI_COUNT_OFFSET, MCUSPI_MAX_PAYLOAD_LENGTH + 1);
+	HOST_CHECK(mcuspi_proto_head_length(frame) == -EBADMSG);
+	HOST_CHECK(mcuspi_proto_unpack(frame, sizeof(frame)) == -EBADMSG);
+}
+
+static void fill_payload(uint8_t *buf, size_t len, int mode)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (mode) {
+		case 0:
+			buf[i] = host_rand(&seed);
+			break;
+		case 1:
+			buf[i] = host_rand(&seed) % 3 ? 0 : host_rand(&seed);
+			break;
+		case 2:
+			buf[i] = (i / (1 + host_rand(&seed) % 5)) & 3;
+			break;
+		default:
+			/* fixed layout records: a counter, a flag and zero padding */
+			buf[i] = i % 16 < 2 ? i / 16 : i % 16 == 3;
+			break;
+		}
+	}
+}
+
+static void test_rle(unsigned long n)
+{
+	/* random data grows by one header byte per 128 */
+	uint8_t src[MCUSPI_MAX_PAYLOAD_LENGTH], enc[MCUSPI_MAX_PAYLOAD_LENGTH + 16];
+	uint8_t dec[MCUSPI_MAX_PAYLOAD_LENGTH + 1];
+	unsigned long t;
+	int len, e, d;
+
+	for (t = 0; t < n; t++) {
+		len = host_rand(&seed) % (MCUSPI_MAX_PAYLOAD_LENGTH + 1);
+		fill_payload(src, len, host_rand(&seed) % 4);
+		e = mcuspi_proto_rle_encode(enc, sizeof(enc), src, len);
+		HOST_CHECK(e >= 0);
+		d = mcuspi_proto_rle_decode(dec, sizeof(dec), enc, e);
+		HOST_CHECK(d == len && !memcmp(src, dec, len));
+		if (len) {
+			HOST_CHECK(mcuspi_proto_rle_encode(enc, e - 1, src, len) == -ENOSPC);
+			/* dst one byte short */
+			HOST_CHECK(mcuspi_proto_rle_decode(dec, len - 1, enc, e) == -EBADMSG);
+		}
+		/* garbage decodes within bounds or is refused */
+		e = host_rand(&seed) % 64;
+		host_fill_random(&seed, enc, e);
+		dec[MCUSPI_MAX_PAYLOAD_LENGTH] = 0x5A;
+		d = mcuspi_proto_rle_decode(dec, MCUSPI_MAX_PAYLOAD_LENGTH, enc, e);
+		HOST_CHECK(d == -EBADMSG || (d >= 0 && d <= MCUSPI_MAX_PAYLOAD_LENGTH));
+		HOST_CHECK(dec[MCUSPI_MAX_PAYLOAD_LENGTH] == 0x5A);
+	}
+	fill_payload(src, MCUSPI_MAX_PAYLOAD_LENGTH, 3);
+	e = mcuspi_proto_rle_encode(enc, sizeof(enc), src, MCUSPI_MAX_PAYLOAD_LENGTH);
+	printf("rle: fixed layout records %d -> %d bytes\n", MCUSPI_MAX_PAYLOAD_LENGTH, e);
+	HOST_CHECK(e > 0 && e < MCUSPI_MAX_PAYLOAD_LENGTH / 2);
+}
+
+static void test_ring(void)
+{
+	static mcu_message slots[4];
+	const uint32_t mask = 3;
+	uint8_t desc[MCUSPI_PAYLOAD_DESC_LENGTH] = { 0 };
+	uint8_t payload[8];
+	uint32_t head = 0xFFFFFFFE, tail = 0xFFFFFFFE;
+	unsigned int i;
+
+	/* fill across the wrap of the free running index */
+	HOST_CHECK(mcuspi_ring_used(head, &tail) == 0);
+	for (i = 0; i <= mask; i++) {
+		HOST_CHECK(!mcuspi_ring_full(&head, tail, mask));
+		desc[0] = i;
+		memset(payload, i, sizeof(payload));
+		mcuspi_ring_fill(&slots[tail & mask], desc, payload, i);
+		mcuspi_ring_publish(&tail, tail + 1);
+	}
+	HOST_CHECK(tail == 2);
+	HOST_CHECK(mcuspi_ring_full(&head, tail, mask));
+	HOST_CHECK(mcuspi_ring_used(head, &tail) == mask + 1);
+	for (i = 0; i <= mask; i++) {
+		HOST_CHECK(slots[head & mask].payload_desc[0] == i);
+		HOST_CHECK(slots[head & mask].payload_length == i);
+		HOST_CHECK(!i || slots[head & mask].payload[i - 1] == i);
+		mcuspi_ring_publish(&head, head + 1);
+		HOST_CHECK(!mcuspi_ring_full(&head, tail, mask));
+	}
+	HOST_CHECK(mcuspi_ring_used(head, &tail) == 0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = host_iterations(argc, argv, 100000);
+
+	test_crc();
+	test_ring();
+	test_frames(n / 10);
+	test_rle(n);
+	printf("proto-fuzz: %lu frames, %lu rle payloads ok\n", n / 10, n);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * SPSC stress of the receive ring: a producer thread stands for the isr
+ * thread and a consumer thread for a reader, pinned to different cpus
+ * when there are two. Every msg carries its sequence number in
+ * payload_desc and payload, the consumer checks order and content. The
+ * same load runs through the queue the ring replaced, the same slots with
+ * a read and a write index and a msg count both sides change, here under
+ * a mutex since the original had no locking at all.
+ */
+#include <pthread.h>
+#include <unistd.h>
+
+#include "../mcu-spi-proto.h"
+#include "host.h"
+
+#define RING_SLOTS 64
+#define OLD_QUEUE_LEN 1024 /* MAX_BUFFERED_MSG */
+
+struct stress {
+	unsigned long n;
+	uint16_t payload_length;
+	int cpus;
+	/* the ring, indices on their own cachelines as in struct mcuspi_ring_ctrl */
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	mcu_message *slots;
+	/* the old queue */
+	pthread_mutex_t lock;
+	mcu_message *old;
+	int16_t read_idx, write_idx, count;
+	uint64_t spins;
+};
+
+static void fill_msg(uint8_t *desc, uint8_t *payload, uint16_t payload_length, uint32_t seq)
+{
+	memset(desc, 0, MCUSPI_PAYLOAD_DESC_LENGTH);
+	memcpy(desc, &seq, sizeof(seq));
+	memset(payload, (uint8_t)seq, payload_length);
+}
+
+static void check_msg(const mcu_message *msg, uint16_t payload_length, uint32_t seq)
+{
+	uint32_t got;
+
+	memcpy(&got, msg->payload_desc, sizeof(got));
+	HOST_CHECK(got == seq);
+	HOST_CHECK(msg->payload_length == payload_length);
+	HOST_CHECK(!payload_length || (msg->payload[0] == (uint8_t)seq &&
+				       msg->payload[payload_length - 1] == (uint8_t)seq));
+}
+
+static void pin(struct stress *s, int cpu)
+{
+	if (s->cpus > 1) {
+		HOST_CHECK(host_pin_cpu(cpu) == 0);
+	}
+}
+
+static void *ring_producer(void *arg)
+{
+	struct stress *s = arg;
+	uint8_t desc[MCUSPI_PAYLOAD_DESC_LENGTH], payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+	uint32_t tail = s->tail;
+	unsigned long i;
+
+	pin(s, 0);
+	for (i = 0; i < s->n; i++) {
+		fill_msg(desc, payload, s->payload_length, i);
+		while (mcuspi_ring_full(&s->head, tail, RING_SLOTS - 1)) {
+			sched_yield();
+		}
+		mcuspi_ring_fill(&s->slots[tail & (RING_SLOTS - 1)], desc, payload, s->payload_length);
+		mcuspi_ring_publish(&s->tail, ++tail);
+	}
+	return NULL;
+}
+
+static void *ring_consumer(void *arg)
+{
+	struct stress *s = arg;
+	static mcu_message msg;
+	uint32_t head = s->head;
+	unsigned long i;
+	const mcu_message *slot;
+
+	pin(s, 1);
+	for (i = 0; i < s->n; i++) {
+		while (!mcuspi_ring_used(head, &s->tail)) {
+			sched_yield();
+		}
+		/* copied out as load_one_mcu_message_from_queue does */
+		slot = &s->slots[head & (RING_SLOTS - 1)];
+		memcpy(msg.payload_desc, slot->payload_desc, MCUSPI_PAYLOAD_DESC_LENGTH);
+		msg.payload_length = slot->payload_length;
+		memcpy(msg.payload, slot->payload, msg.payload_length);
+		mcuspi_ring_publish(&s->head, ++head);
+		check_msg(&msg, s->payload_length, i);
+	}
+	return NULL;
+}
+
+static void *old_producer(void *arg)
+{
+	struct stress *s = arg;
+	uint8_t desc[MCUSPI_PAYLOAD_DESC_LENGTH], payload[MCUSPI_MAX_PAYLOAD_LENGTH];
+	mcu_message *msg;
+	unsigned long i;
+
+	pin(s, 0);
+	for (i = 0; i < s->n; i++) {
+		fill_msg(desc, payload, s->payload_length, i);
+		for (;;) {
+			pthread_mutex_lock(&s->lock);
+			if (s->count < OLD_QUEUE_LEN) {
+				break;
+			}
+			pthread_mutex_unlock(&s->lock);
+			sched_yield();
+		}
+		/* filled in place, as store_one_mcu_message_to_queue did */
+		msg = &s->old[s->write_idx];
+		memcpy(msg->payload_desc, desc, MCUSPI_PAYLOAD_DESC_LENGTH);
+		msg->payload_length = s->payload_length;
+		memcpy(msg->payload, payload, s->payload_length);
+		s->write_idx = (s->write_idx + 1) % OLD_QUEUE_LEN;
+		s->count++;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return NULL;
+}
+
+static void *old_consumer(void *arg)
+{
+	struct stress *s = arg;
+	static mcu_message out;
+	mcu_message *msg;
+	unsigned long i;
+
+	pin(s, 1);
+	for (i = 0; i < s->n; i++) {
+		for (;;) {
+			pthread_mutex_lock(&s->lock);
+			if (s->count) {
+				break;
+			}
+			pthread_mutex_unlock(&s->lock);
+			sched_yield();
+		}
+		msg = &s->old[s->read_idx];
+		memcpy(out.payload_desc, msg->payload_desc, MCUSPI_PAYLOAD_DESC_LENGTH);
+		out.payload_length = msg->payload_length;
+		memcpy(out.payload, msg->payload, msg->payload_length);
+		s->read_idx = (s->read_idx + 1) % OLD_QUEUE_LEN;
+		s->count--;
+		pthread_mutex_unlock(&s->lock);
+		check_msg(&out, s->payload_length, i);
+	}
+	return NULL;
+}
+
+static void run(struct stress *s, const char *name, void *(*prod)(void *), void *(*cons)(void *))
+{
+	pthread_t p, c;
+	char line[48];
+	uint64_t t;
+
+	/* start near the wrap of the free running index */
+	s->head = s->tail = 0xFFFFFF00;
+	s->read_idx = s->write_idx = s->count = 0;
+	t = host_now_ns();
+	HOST_CHECK(!pthread_create(&c, NULL, cons, s));
+	HOST_CHECK(!pthread_create(&p, NULL, prod, s));
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	t = host_now_ns() - t;
+	snprintf(line, sizeof(line), "%s %u", name, s->payload_length);
+	host_report(line, s->n, (uint64_t)s->n * s->payload_length, t);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint16_t lens[] = { 16, 256, MCUSPI_MAX_PAYLOAD_LENGTH };
+	static struct stress s;
+	unsigned int i;
+
+	s.n = host_iterations(argc, argv, 100000) * 2;
+	s.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	s.slots = calloc(RING_SLOTS, sizeof(*s.slots));
+	s.old = calloc(OLD_QUEUE_LEN, sizeof(*s.old));
+	HOST_CHECK(s.slots && s.old);
+	pthread_mutex_init(&s.lock, NULL);
+	if (s.cpus < 2) {
+		printf("ring-stress: one cpu, producer and consumer are not pinned\n");
+	}
+	for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		s.payload_length = lens[i];
+		run(&s, "spsc ring", ring_producer, ring_consumer);
+		run(&s, "old queue", old_producer, old_consumer);
+	}
+	printf("ring-stress: %lu msgs per run in order and intact\n", s.n);
+	free(s.slots);
+	free(s.old);
+	return 0;
+}